@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Latency histogram in the style of HdrHistogram. A value is bucketed by its highest
+// set bit and the kSubBucketBits bits right below it, so every bucket is within
+// 1/2^kSubBucketBits (1.6%) of the values in it, from single nanoseconds up to
+// centuries, at a fixed 30 KiB per histogram. Not thread-safe, every thread keeps its
+// own and they are merged at the end.
+class Histogram {
+ public:
+    static const int kSubBucketBits = 6;
+    static const uint64_t kSubBuckets = 1 << kSubBucketBits;
+
+    Histogram() : counts_((64 - kSubBucketBits + 1) * kSubBuckets) {}
+
+    void record(uint64_t value) {
+        counts_[index(value)]++;
+        count_++;
+        sum_ += value;
+        max_ = std::max(max_, value);
+    }
+
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < counts_.size(); i++) {
+            counts_[i] += other.counts_[i];
+        }
+        count_ += other.count_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t max() const { return max_; }
+    double mean() const { return count_ ? static_cast<double>(sum_) / count_ : 0; }
+
+    // Smallest recorded value that at least p percent of the values are at or below,
+    // rounded up to the end of its bucket.
+    uint64_t percentile(double p) const {
+        if (count_ == 0) {
+            return 0;
+        }
+        uint64_t target = std::max<uint64_t>(1, std::ceil(p / 100 * count_));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); i++) {
+            seen += counts_[i];
+            if (seen >= target) {
+                return std::min(upperBound(i), max_);
+            }
+        }
+        return max_;
+    }
+
+ private:
+    static size_t index(uint64_t value) {
+        if (value < kSubBuckets) {
+            return value;
+        }
+        int shift = 63 - __builtin_clzll(value) - kSubBucketBits;
+        return ((shift + 1) << kSubBucketBits) + ((value >> shift) & (kSubBuckets - 1));
+    }
+
+    static uint64_t upperBound(size_t index) {
+        if (index < kSubBuckets) {
+            return index;
+        }
+        int shift = (index >> kSubBucketBits) - 1;
+        uint64_t sub_bucket = kSubBuckets + (index & (kSubBuckets - 1));
+        return ((sub_bucket + 1) << shift) - 1;
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t max_ = 0;
+};
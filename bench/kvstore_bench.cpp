@@ -0,0 +1,939 @@
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../include/kvstore.h"
+#include "histogram.h"
+
+// Benchmark driver for the KVStore. Either runs a YCSB-style workload against a
+// preloaded store over a number of threads, times restore() on a large log, or
+// compares commit latency across the log modes.
+// Prints a report and optionally writes the same numbers as JSON.
+
+using Clock = std::chrono::steady_clock;
+
+static void printUsage() {
+    std::cout
+        << "Usage: kvstore_bench [options]\n"
+        << "  --workload A|B|C|D|E|F|restore|commit  YCSB mix to run, or another benchmark (A)\n"
+        << "      A 50% read 50% update, B 95% read 5% update, C 100% read,\n"
+        << "      D 95% read 5% insert (latest), E 95% scan 5% insert,\n"
+        << "      F 50% read 50% read-modify-write,\n"
+        << "      commit --ops puts into an empty store once per log mode\n"
+        << "  --read P --update P --insert P --rmw P --scan P  override the mix's proportions\n"
+        << "  --max-scan-length N   scans cover 1 to N keys, uniformly (100)\n"
+        << "  --threads N           client threads (4)\n"
+        << "  --keys N              records loaded before the run (100000)\n"
+        << "  --ops N               operations in the run, over all threads (100000)\n"
+        << "  --duration S          run for S seconds instead of --ops\n"
+        << "  --dist uniform|zipfian|latest  key distribution (zipfian, latest for D)\n"
+        << "  --zipf-theta T        skew of zipfian and latest (0.99)\n"
+        << "  --value-size N        largest value size, at most 4096 (100)\n"
+        << "  --value-dist fixed|uniform|zipfian  value sizes up to --value-size (fixed)\n"
+        << "  --load-batch N        records per WriteBatch while loading (100)\n"
+        << "  --restore-runs N      timed restores per mode (3)\n"
+        << "  --keydir hash|paged|open  Options::keydir (hash)\n"
+        << "  --cache-bytes N       Options::value_cache_bytes (0)\n"
+        << "  --inline-bytes N      Options::inline_value_bytes (0)\n"
+        << "  --segment-size N      Options::segment_size (64 MiB)\n"
+        << "  --log-mode growing|preallocated|direct  Options::log_mode (growing)\n"
+        << "  --mmap-chunk N        Options::mmap_chunk_size (64 MiB)\n"
+        << "  --batch-wait-us N     Options::max_batch_wait (0)\n"
+        << "  --recovery-threads N  Options::recovery_threads (0)\n"
+        << "  --shards N            Options::shards, 0 is one per core (1)\n"
+        << "  --durability sync|group|async  Options::durability (group)\n"
+        << "  --flush-ms N          Options::flush_interval (10)\n"
+        << "  --verify              Options::verify_checksums\n"
+        << "  --compaction-ms N     Options::compaction_interval, 0 is off (0)\n"
+        << "  --path P              store file (kvstore_bench.db)\n"
+        << "  --reuse               keep an existing store instead of loading a new one\n"
+        << "  --keep                leave the store files behind\n"
+        << "  --seed N              random seed (1)\n"
+        << "  --json P              also write the results as JSON to P, - for stdout\n";
+}
+
+// ----------------------------------------------
+// DISTRIBUTIONS
+// ----------------------------------------------
+// YCSB's zipfian generator (Gray et al., "Quickly Generating Billion-Record Synthetic
+// Databases"). Draws from [0, n) with 0 the most popular. The constants take O(n) to
+// compute, so one instance is shared read-only by all the threads.
+class Zipfian {
+ public:
+    Zipfian(uint64_t n, double theta) : n_(std::max<uint64_t>(n, 1)), theta_(theta) {
+        double zeta2 = zeta(2, theta);
+        zetan_ = zeta(n_, theta);
+        alpha_ = 1 / (1 - theta);
+        eta_ = (1 - std::pow(2.0 / n_, 1 - theta)) / (1 - zeta2 / zetan_);
+    }
+
+    uint64_t next(std::mt19937_64& rng) const {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        double uz = u * zetan_;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + std::pow(0.5, theta_)) {
+            return 1;
+        }
+        return std::min<uint64_t>(n_ - 1, n_ * std::pow(eta_ * u - eta_ + 1, alpha_));
+    }
+
+ private:
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; i++) {
+            sum += 1 / std::pow(i, theta);
+        }
+        return sum;
+    }
+
+    uint64_t n_;
+    double theta_;
+    double zetan_;
+    double alpha_;
+    double eta_;
+};
+
+// FNV-1a over the 8 bytes of value. Spreads the popular zipfian ranks over the key
+// space the way YCSB's scrambled zipfian does.
+static uint64_t fnv_hash(uint64_t value) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (int i = 0; i < 8; i++) {
+        hash ^= value & 0xFF;
+        hash *= 0x100000001B3ull;
+        value >>= 8;
+    }
+    return hash;
+}
+
+enum class KeyDist { kUniform, kZipfian, kLatest };
+enum class ValueDist { kFixed, kUniform, kZipfian };
+enum Op { kRead, kUpdate, kInsert, kReadModifyWrite, kScan, kNumOps };
+static const char* const kOpNames[kNumOps] = {"read", "update", "insert", "read_modify_write", "scan"};
+
+struct Config {
+    std::string workload = "A";
+    double proportions[kNumOps] = {0.5, 0.5, 0, 0, 0};
+    size_t threads = 4;
+    uint64_t keys = 100000;
+    uint64_t ops = 100000;
+    double duration = 0;
+    KeyDist key_dist = KeyDist::kZipfian;
+    double zipf_theta = 0.99;
+    uint64_t max_scan_length = 100;
+    size_t value_size = 100;
+    ValueDist value_dist = ValueDist::kFixed;
+    size_t load_batch = 100;
+    size_t restore_runs = 3;
+    std::string path = "kvstore_bench.db";
+    bool reuse = false;
+    bool keep = false;
+    uint64_t seed = 1;
+    std::string json;
+    KVStore::Options options;
+};
+
+// Picks keys and value sizes for one client thread.
+class Chooser {
+ public:
+    Chooser(const Config& config, const Zipfian& key_zipf, const Zipfian& value_zipf,
+            const std::atomic<uint64_t>& next_insert, uint64_t seed)
+        : config_(config), key_zipf_(key_zipf), value_zipf_(value_zipf), next_insert_(next_insert), rng_(seed) {}
+
+    // A key that is already in the store.
+    KVStore::K key() {
+        uint64_t inserted = next_insert_.load(std::memory_order_relaxed);
+        switch (config_.key_dist) {
+        case KeyDist::kUniform:
+            return std::uniform_int_distribution<uint64_t>(0, inserted - 1)(rng_);
+        case KeyDist::kZipfian:
+            // Scrambled over the loaded keys. Inserted ones are never hot.
+            return fnv_hash(key_zipf_.next(rng_)) % config_.keys;
+        case KeyDist::kLatest:
+            // The most recently inserted keys are the most popular ones.
+            return inserted - 1 - key_zipf_.next(rng_) % inserted;
+        }
+        return 0;
+    }
+
+    size_t valueSize() {
+        switch (config_.value_dist) {
+        case ValueDist::kFixed:
+            return config_.value_size;
+        case ValueDist::kUniform:
+            return std::uniform_int_distribution<size_t>(1, config_.value_size)(rng_);
+        case ValueDist::kZipfian:
+            // Small values are the common case.
+            return 1 + value_zipf_.next(rng_);
+        }
+        return config_.value_size;
+    }
+
+    Op op() {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng_);
+        for (int op = 0; op < kNumOps; op++) {
+            if (u < config_.proportions[op]) {
+                return static_cast<Op>(op);
+            }
+            u -= config_.proportions[op];
+        }
+        return kRead;
+    }
+
+    std::mt19937_64& rng() { return rng_; }
+
+ private:
+    const Config& config_;
+    const Zipfian& key_zipf_;
+    const Zipfian& value_zipf_;
+    const std::atomic<uint64_t>& next_insert_;
+    std::mt19937_64 rng_;
+};
+
+// ----------------------------------------------
+// RESULTS
+// ----------------------------------------------
+// Minimal JSON writer, enough for flat objects of numbers and strings.
+class JsonWriter {
+ public:
+    void beginObject(const std::string& key = "") {
+        separate(key);
+        out_ << "{";
+        first_ = true;
+    }
+    void endObject() {
+        out_ << "}";
+        first_ = false;
+    }
+    void beginArray(const std::string& key) {
+        separate(key);
+        out_ << "[";
+        first_ = true;
+    }
+    void endArray() {
+        out_ << "]";
+        first_ = false;
+    }
+    void field(const std::string& key, double value) {
+        separate(key);
+        out_ << std::setprecision(6) << value;
+    }
+    void field(const std::string& key, uint64_t value) {
+        separate(key);
+        out_ << value;
+    }
+    void field(const std::string& key, const std::string& value) {
+        separate(key);
+        out_ << '"' << value << '"';
+    }
+    void field(const std::string& key, bool value) {
+        separate(key);
+        out_ << (value ? "true" : "false");
+    }
+    std::string str() const { return out_.str(); }
+
+ private:
+    void separate(const std::string& key) {
+        if (!first_) {
+            out_ << ",";
+        }
+        first_ = false;
+        if (!key.empty()) {
+            out_ << '"' << key << "\":";
+        }
+    }
+
+    std::ostringstream out_;
+    bool first_ = true;
+};
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void report_latencies(std::ostream& out, JsonWriter& json, const std::string& name, const Histogram& histogram,
+                             double seconds) {
+    double us = 1000.0;
+    out << "  " << std::left << std::setw(18) << name << std::right << std::setw(10) << histogram.count() << " ops "
+        << std::setw(12) << std::fixed << std::setprecision(0) << histogram.count() / seconds << " ops/s"
+        << std::setprecision(1) << "  mean " << histogram.mean() / us << "  p50 " << histogram.percentile(50) / us
+        << "  p99 " << histogram.percentile(99) / us << "  p99.9 " << histogram.percentile(99.9) / us << "  max "
+        << histogram.max() / us << " us" << std::endl;
+    json.beginObject(name);
+    json.field("count", histogram.count());
+    json.field("ops_per_sec", histogram.count() / seconds);
+    json.field("mean_us", histogram.mean() / us);
+    json.field("p50_us", histogram.percentile(50) / us);
+    json.field("p99_us", histogram.percentile(99) / us);
+    json.field("p999_us", histogram.percentile(99.9) / us);
+    json.field("max_us", histogram.max() / us);
+    json.endObject();
+}
+
+// ----------------------------------------------
+// BENCHMARKS
+// ----------------------------------------------
+static void remove_store_files(const std::string& path) {
+    std::filesystem::path dir = std::filesystem::path(path).parent_path();
+    std::string name = std::filesystem::path(path).filename().string();
+    for (const auto& entry : std::filesystem::directory_iterator(dir.empty() ? "." : dir)) {
+        std::string file = entry.path().filename().string();
+        if (file == name || file.rfind(name + ".", 0) == 0) {
+            std::filesystem::remove(entry.path());
+        }
+    }
+}
+
+static uint64_t store_disk_usage(const std::string& path) {
+    std::filesystem::path dir = std::filesystem::path(path).parent_path();
+    std::string name = std::filesystem::path(path).filename().string();
+    uint64_t total = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(dir.empty() ? "." : dir)) {
+        std::string file = entry.path().filename().string();
+        if (file == name || file.rfind(name + ".", 0) == 0) {
+            total += entry.file_size();
+        }
+    }
+    return total;
+}
+
+// Resident anonymous memory of the process. Leaves out the mapped log, so what grows
+// with the store is the keydir and the value cache.
+static uint64_t resident_anon_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    uint64_t size = 0, resident = 0, shared = 0;
+    statm >> size >> resident >> shared;
+    return resident > shared ? (resident - shared) * sysconf(_SC_PAGESIZE) : 0;
+}
+
+// Random bytes that values are sliced out of.
+static std::string make_value_pool(uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::string pool(2 * 4096, '\0');
+    for (auto& c : pool) {
+        c = 'a' + rng() % 26;
+    }
+    return pool;
+}
+
+// Loads keys [0, config.keys) with WriteBatches, split over the client threads.
+static void load(KVStore& store, const Config& config, const std::string& pool, std::ostream& out, JsonWriter& json) {
+    Zipfian value_zipf(config.value_size, config.zipf_theta);
+    std::atomic<uint64_t> next_insert{config.keys};
+    Zipfian key_zipf(1, config.zipf_theta);
+    uint64_t log_bytes = 0;
+    std::mutex log_bytes_mutex;
+
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < config.threads; t++) {
+        threads.emplace_back([&, t] {
+            Chooser chooser(config, key_zipf, value_zipf, next_insert, config.seed * 1000 + t);
+            KVStore::WriteBatch batch;
+            uint64_t bytes = 0;
+            for (uint64_t key = t; key < config.keys; key += config.threads) {
+                size_t size = chooser.valueSize();
+                batch.put(key, pool.substr(chooser.rng()() % 4096, size));
+                bytes += 3 * sizeof(uint32_t) + size;
+                if (batch.size() >= config.load_batch) {
+                    store.write(batch);
+                    batch.clear();
+                }
+            }
+            store.write(batch);
+            std::lock_guard<std::mutex> lock(log_bytes_mutex);
+            log_bytes += bytes;
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double seconds = seconds_since(start);
+    out << "load: " << config.keys << " records in " << std::setprecision(3) << seconds << " s ("
+        << std::setprecision(0) << config.keys / seconds << " records/s, " << std::setprecision(1)
+        << log_bytes / seconds / (1 << 20) << " MiB/s)" << std::endl;
+    json.beginObject("load");
+    json.field("records", config.keys);
+    json.field("seconds", seconds);
+    json.field("records_per_sec", config.keys / seconds);
+    json.field("log_bytes", log_bytes);
+    json.endObject();
+}
+
+// Runs the configured mix against the store. Every operation is timed on its own; a
+// read-modify-write counts as one operation.
+static void run(KVStore& store, const Config& config, const std::string& pool, std::ostream& out, JsonWriter& json) {
+    Zipfian key_zipf(config.keys, config.zipf_theta);
+    Zipfian value_zipf(config.value_size, config.zipf_theta);
+    std::atomic<uint64_t> next_insert{config.keys};
+    std::atomic<int64_t> ops_left{static_cast<int64_t>(config.ops)};
+    std::atomic<bool> stop{false};
+    std::vector<std::vector<Histogram>> histograms(config.threads, std::vector<Histogram>(kNumOps));
+    std::vector<uint64_t> log_bytes(config.threads);
+    std::vector<uint64_t> misses(config.threads);
+    KVStore::CommitStats commits_before = store.commitStats();
+
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < config.threads; t++) {
+        threads.emplace_back([&, t] {
+            Chooser chooser(config, key_zipf, value_zipf, next_insert, config.seed * 1000 + config.threads + t);
+            auto& thread_histograms = histograms[t];
+            while (!stop.load(std::memory_order_relaxed)) {
+                if (config.duration == 0 && ops_left.fetch_sub(1, std::memory_order_relaxed) <= 0) {
+                    break;
+                }
+                Op op = chooser.op();
+                bool writes = op != kRead && op != kScan;
+                size_t size = writes ? chooser.valueSize() : 0;
+                std::string value = writes ? pool.substr(chooser.rng()() % 4096, size) : std::string();
+                auto op_start = Clock::now();
+                switch (op) {
+                case kRead:
+                    misses[t] += !store.get(chooser.key());
+                    break;
+                case kUpdate:
+                    store.put(chooser.key(), value);
+                    break;
+                case kInsert: {
+                    // Readers only pick keys below next_insert, so the key becomes
+                    // pickable a little before it exists. Those reads count as misses.
+                    store.put(next_insert.fetch_add(1), value);
+                    break;
+                }
+                case kReadModifyWrite: {
+                    KVStore::K key = chooser.key();
+                    misses[t] += !store.get(key);
+                    store.put(key, value);
+                    break;
+                }
+                case kScan: {
+                    KVStore::K lo = chooser.key();
+                    uint64_t length = std::uniform_int_distribution<uint64_t>(1, config.max_scan_length)(chooser.rng());
+                    KVStore::K hi = std::min<uint64_t>(uint64_t(lo) + length - 1, ~KVStore::K(0));
+                    store.scan(lo, hi, [](KVStore::K, const KVStore::V&) { return true; });
+                    break;
+                }
+                default:
+                    break;
+                }
+                thread_histograms[op].record(std::chrono::nanoseconds(Clock::now() - op_start).count());
+                if (writes) {
+                    log_bytes[t] += 3 * sizeof(uint32_t) + size;
+                }
+            }
+        });
+    }
+    if (config.duration > 0) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(config.duration));
+        stop = true;
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double seconds = seconds_since(start);
+
+    Histogram all;
+    std::vector<Histogram> by_op(kNumOps);
+    uint64_t total_log_bytes = 0;
+    uint64_t total_misses = 0;
+    for (size_t t = 0; t < config.threads; t++) {
+        for (int op = 0; op < kNumOps; op++) {
+            by_op[op].merge(histograms[t][op]);
+            all.merge(histograms[t][op]);
+        }
+        total_log_bytes += log_bytes[t];
+        total_misses += misses[t];
+    }
+    KVStore::CommitStats commits = store.commitStats();
+    uint64_t fsyncs = commits.batches - commits_before.batches;
+    uint64_t records = commits.records - commits_before.records;
+
+    out << "run: workload " << config.workload << ", " << config.threads << " threads, " << std::setprecision(3)
+        << seconds << " s" << std::endl;
+    json.beginObject("run");
+    json.field("seconds", seconds);
+    json.field("ops_per_sec", all.count() / seconds);
+    json.field("log_bytes", total_log_bytes);
+    json.field("fsyncs", fsyncs);
+    json.field("records_per_fsync", fsyncs ? static_cast<double>(records) / fsyncs : 0.0);
+    json.field("read_misses", total_misses);
+    json.beginObject("latency");
+    report_latencies(out, json, "all", all, seconds);
+    for (int op = 0; op < kNumOps; op++) {
+        if (by_op[op].count() > 0) {
+            report_latencies(out, json, kOpNames[op], by_op[op], seconds);
+        }
+    }
+    json.endObject();
+    KVStore::CacheStats cache = store.cacheStats();
+    if (config.options.value_cache_bytes > 0) {
+        json.field("cache_hits", cache.hits);
+        json.field("cache_misses", cache.misses);
+    }
+    // How long records waited for the sync that made them durable, which for kAsync
+    // writes is what a crash could lose.
+    KVStore::LatencyStats lag = store.stats().durable_lag;
+    json.field("durable_lag_p50_us", lag.p50 / 1e3);
+    json.field("durable_lag_p99_us", lag.p99 / 1e3);
+    json.endObject();
+    out << "  log bytes " << total_log_bytes << " (" << std::setprecision(1) << total_log_bytes / seconds / (1 << 20)
+        << " MiB/s), fsyncs " << fsyncs << " (" << (fsyncs ? static_cast<double>(records) / fsyncs : 0.0)
+        << " records each), read misses " << total_misses << std::endl;
+    out << "  durable lag p50 " << lag.p50 / 1e3 << " p99 " << lag.p99 / 1e3 << " us" << std::endl;
+    if (config.options.value_cache_bytes > 0) {
+        out << "  cache hits " << cache.hits << ", misses " << cache.misses << std::endl;
+    }
+}
+
+// What the store costs in memory, to set against the read latencies of the run, e.g.
+// with and without --inline-bytes or --cache-bytes.
+static void report_memory(KVStore& store, uint64_t memory_before, std::ostream& out, JsonWriter& json) {
+    KVStore::Stats stats = store.stats();
+    uint64_t memory = resident_anon_bytes();
+    memory = memory > memory_before ? memory - memory_before : 0;
+    double per_key = stats.keys ? static_cast<double>(memory) / stats.keys : 0.0;
+    out << "memory: " << std::setprecision(1) << memory / double(1 << 20) << " MiB resident, " << per_key
+        << " bytes per key, " << stats.inline_values << " of " << stats.keys << " values inline, "
+        << stats.file_reads << " file reads" << std::endl;
+    json.beginObject("memory");
+    json.field("resident_bytes", memory);
+    json.field("bytes_per_key", per_key);
+    json.field("keys", stats.keys);
+    json.field("inline_values", stats.inline_values);
+    json.field("file_reads", stats.file_reads);
+    json.endObject();
+}
+
+// Times opening the store, i.e. restore(), once with the hint files and once with
+// every segment scanned. The log is written first unless --reuse finds one.
+static void restore(const Config& config, const std::string& pool, std::ostream& out, JsonWriter& json) {
+    if (!config.reuse || !std::filesystem::exists(config.path)) {
+        remove_store_files(config.path);
+        KVStore::Options options = config.options;
+        options.write_hints = true;
+        KVStore store(config.path, options);
+        load(store, config, pool, out, json);
+    }
+    // The store may have closed before the background thread got to the hints of the
+    // last segments it sealed. restore() writes the missing ones.
+    {
+        KVStore::Options options = config.options;
+        options.write_hints = true;
+        KVStore store(config.path, options);
+    }
+    uint64_t log_bytes = store_disk_usage(config.path);
+    out << "restore: " << std::setprecision(1) << log_bytes / double(1 << 20) << " MiB on disk" << std::endl;
+
+    json.beginArray("restore");
+    for (bool hints : {true, false}) {
+        // Without hints every segment gets scanned. The hint files are moved out of
+        // the way for this so that they can be put back for the next run.
+        std::vector<std::filesystem::path> hint_files;
+        if (!hints) {
+            std::filesystem::path dir = std::filesystem::path(config.path).parent_path();
+            std::string name = std::filesystem::path(config.path).filename().string();
+            for (const auto& entry : std::filesystem::directory_iterator(dir.empty() ? "." : dir)) {
+                std::string file = entry.path().filename().string();
+                if (file.rfind(name, 0) == 0 && entry.path().extension() == ".hint") {
+                    hint_files.push_back(entry.path());
+                }
+            }
+            for (const auto& file : hint_files) {
+                std::filesystem::rename(file, file.string() + ".bench");
+            }
+        }
+        KVStore::Options options = config.options;
+        options.write_hints = false;
+        options.compaction_interval = std::chrono::milliseconds(0);
+        std::vector<double> times;
+        for (size_t i = 0; i < config.restore_runs; i++) {
+            auto start = Clock::now();
+            KVStore store(config.path, options);
+            times.push_back(seconds_since(start));
+            if (!store.get(0) || !store.get(config.keys - 1)) {
+                throw std::runtime_error("restore lost records");
+            }
+        }
+        for (const auto& file : hint_files) {
+            std::filesystem::rename(file.string() + ".bench", file);
+        }
+        std::sort(times.begin(), times.end());
+        double median = times[times.size() / 2];
+        const char* mode = hints ? "hints" : "scan";
+        out << "  " << std::left << std::setw(6) << mode << std::right << std::setprecision(3) << " min "
+            << times.front() << " s  median " << median << " s  max " << times.back() << " s  ("
+            << std::setprecision(1) << log_bytes / median / (1 << 20) << " MiB/s)" << std::endl;
+        json.beginObject();
+        json.field("mode", std::string(mode));
+        json.field("runs", static_cast<uint64_t>(times.size()));
+        json.field("min_seconds", times.front());
+        json.field("median_seconds", median);
+        json.field("max_seconds", times.back());
+        json.field("bytes", log_bytes);
+        json.endObject();
+    }
+    json.endArray();
+}
+
+// Times puts into an empty store, each one until it is durable, once per log mode.
+// What differs is what every fdatasync has to flush besides the records: the file's
+// growth for kGrowing, nothing for kPreallocated, and no page cache either for
+// kDirect. A mode the filesystem doesn't support is reported and skipped.
+static void commit(const Config& config, const std::string& pool, const char* const log_mode_names[],
+                   std::ostream& out, JsonWriter& json) {
+    out << "commit: " << config.ops << " puts of " << config.value_size << " bytes per log mode, " << config.threads
+        << " threads" << std::endl;
+    json.beginObject("commit");
+    for (auto mode : {KVStore::LogMode::kGrowing, KVStore::LogMode::kPreallocated, KVStore::LogMode::kDirect}) {
+        std::string name = log_mode_names[static_cast<int>(mode)];
+        remove_store_files(config.path);
+        KVStore::Options options = config.options;
+        options.log_mode = mode;
+        std::unique_ptr<KVStore> store;
+        try {
+            store = std::make_unique<KVStore>(config.path, options);
+        } catch (const std::exception& e) {
+            out << "  " << name << ": skipped, " << e.what() << std::endl;
+            json.field(name, std::string("unsupported"));
+            continue;
+        }
+
+        std::vector<Histogram> histograms(config.threads);
+        std::atomic<int64_t> ops_left{static_cast<int64_t>(config.ops)};
+        auto start = Clock::now();
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < config.threads; t++) {
+            threads.emplace_back([&, t] {
+                std::mt19937_64 rng(config.seed * 1000 + t);
+                int64_t op;
+                while ((op = ops_left.fetch_sub(1, std::memory_order_relaxed)) > 0) {
+                    std::string value = pool.substr(rng() % 4096, config.value_size);
+                    auto op_start = Clock::now();
+                    store->put(op % config.keys, value);
+                    histograms[t].record(std::chrono::nanoseconds(Clock::now() - op_start).count());
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        double seconds = seconds_since(start);
+
+        Histogram all;
+        for (const auto& histogram : histograms) {
+            all.merge(histogram);
+        }
+        KVStore::Stats stats = store->stats();
+        uint64_t fsyncs = stats.commits.batches;
+        double records_per_fsync = fsyncs ? static_cast<double>(stats.commits.records) / fsyncs : 0.0;
+        out << "  " << name << ": " << fsyncs << " fsyncs (" << std::setprecision(1) << records_per_fsync
+            << " records each), fsync p50 " << stats.fsync_latency.p50 / 1e3 << " p99 "
+            << stats.fsync_latency.p99 / 1e3 << " us" << std::endl;
+        json.beginObject(name);
+        json.field("fsyncs", fsyncs);
+        json.field("records_per_fsync", records_per_fsync);
+        json.field("fsync_p50_us", stats.fsync_latency.p50 / 1e3);
+        json.field("fsync_p99_us", stats.fsync_latency.p99 / 1e3);
+        report_latencies(out, json, "put", all, seconds);
+        json.endObject();
+    }
+    json.endObject();
+}
+
+// ----------------------------------------------
+// COMMAND LINE
+// ----------------------------------------------
+static bool set_workload(Config& config, const std::string& workload) {
+    static const std::map<std::string, std::array<double, kNumOps>> kMixes = {
+        {"A", {0.5, 0.5, 0, 0, 0}},
+        {"B", {0.95, 0.05, 0, 0, 0}},
+        {"C", {1, 0, 0, 0, 0}},
+        {"D", {0.95, 0, 0.05, 0, 0}},
+        {"E", {0, 0, 0.05, 0, 0.95}},
+        {"F", {0.5, 0, 0, 0.5, 0}},
+        {"restore", {0, 0, 0, 0, 0}},
+        {"commit", {0, 1, 0, 0, 0}},
+    };
+    auto it = kMixes.find(workload);
+    if (it == kMixes.end()) {
+        return false;
+    }
+    config.workload = workload;
+    std::copy(it->second.begin(), it->second.end(), config.proportions);
+    if (workload == "D") {
+        config.key_dist = KeyDist::kLatest;
+    }
+    return true;
+}
+
+static Config parse_args(int argc, char* argv[]) {
+    Config config;
+    config.options.compaction_interval = std::chrono::milliseconds(0);
+    // The workload picks defaults that the other flags may override, so it goes first.
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::string(argv[i]) == "--workload" && !set_workload(config, argv[i + 1])) {
+            throw std::invalid_argument(std::string("unknown workload ") + argv[i + 1]);
+        }
+    }
+    bool custom_mix = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                throw std::invalid_argument("missing value for " + arg);
+            }
+            return argv[++i];
+        };
+        if (arg == "--workload") {
+            value();
+        } else if (arg == "--read" || arg == "--update" || arg == "--insert" || arg == "--rmw" || arg == "--scan") {
+            if (!custom_mix) {
+                std::fill(std::begin(config.proportions), std::end(config.proportions), 0);
+                custom_mix = true;
+            }
+            Op op = arg == "--read"     ? kRead
+                    : arg == "--update" ? kUpdate
+                    : arg == "--insert" ? kInsert
+                    : arg == "--scan"   ? kScan
+                                        : kReadModifyWrite;
+            config.proportions[op] = std::stod(value());
+        } else if (arg == "--threads") {
+            config.threads = std::max(1ul, std::stoul(value()));
+        } else if (arg == "--keys") {
+            config.keys = std::max(1ul, std::stoul(value()));
+        } else if (arg == "--ops") {
+            config.ops = std::stoul(value());
+        } else if (arg == "--duration") {
+            config.duration = std::stod(value());
+        } else if (arg == "--dist") {
+            std::string dist = value();
+            if (dist == "uniform") {
+                config.key_dist = KeyDist::kUniform;
+            } else if (dist == "zipfian") {
+                config.key_dist = KeyDist::kZipfian;
+            } else if (dist == "latest") {
+                config.key_dist = KeyDist::kLatest;
+            } else {
+                throw std::invalid_argument("unknown key distribution " + dist);
+            }
+        } else if (arg == "--zipf-theta") {
+            config.zipf_theta = std::stod(value());
+        } else if (arg == "--max-scan-length") {
+            config.max_scan_length = std::max(1ul, std::stoul(value()));
+        } else if (arg == "--value-size") {
+            config.value_size = std::min(4096ul, std::max(1ul, std::stoul(value())));
+        } else if (arg == "--value-dist") {
+            std::string dist = value();
+            if (dist == "fixed") {
+                config.value_dist = ValueDist::kFixed;
+            } else if (dist == "uniform") {
+                config.value_dist = ValueDist::kUniform;
+            } else if (dist == "zipfian") {
+                config.value_dist = ValueDist::kZipfian;
+            } else {
+                throw std::invalid_argument("unknown value size distribution " + dist);
+            }
+        } else if (arg == "--load-batch") {
+            config.load_batch = std::max(1ul, std::stoul(value()));
+        } else if (arg == "--restore-runs") {
+            config.restore_runs = std::max(1ul, std::stoul(value()));
+        } else if (arg == "--keydir") {
+            std::string keydir = value();
+            if (keydir == "hash") {
+                config.options.keydir = KVStore::KeyDirType::kHashMap;
+            } else if (keydir == "paged") {
+                config.options.keydir = KVStore::KeyDirType::kPagedArray;
+            } else if (keydir == "open") {
+                config.options.keydir = KVStore::KeyDirType::kOpenAddressing;
+            } else {
+                throw std::invalid_argument("unknown keydir " + keydir);
+            }
+        } else if (arg == "--cache-bytes") {
+            config.options.value_cache_bytes = std::stoul(value());
+        } else if (arg == "--inline-bytes") {
+            config.options.inline_value_bytes = std::stoul(value());
+        } else if (arg == "--segment-size") {
+            config.options.segment_size = std::stoul(value());
+        } else if (arg == "--log-mode") {
+            std::string mode = value();
+            if (mode == "growing") {
+                config.options.log_mode = KVStore::LogMode::kGrowing;
+            } else if (mode == "preallocated") {
+                config.options.log_mode = KVStore::LogMode::kPreallocated;
+            } else if (mode == "direct") {
+                config.options.log_mode = KVStore::LogMode::kDirect;
+            } else {
+                throw std::invalid_argument("unknown log mode " + mode);
+            }
+        } else if (arg == "--mmap-chunk") {
+            config.options.mmap_chunk_size = std::stoul(value());
+        } else if (arg == "--batch-wait-us") {
+            config.options.max_batch_wait = std::chrono::microseconds(std::stoul(value()));
+        } else if (arg == "--recovery-threads") {
+            config.options.recovery_threads = std::stoul(value());
+        } else if (arg == "--shards") {
+            config.options.shards = std::stoul(value());
+        } else if (arg == "--durability") {
+            std::string durability = value();
+            if (durability == "sync") {
+                config.options.durability = KVStore::Durability::kSync;
+            } else if (durability == "group") {
+                config.options.durability = KVStore::Durability::kGroupCommit;
+            } else if (durability == "async") {
+                config.options.durability = KVStore::Durability::kAsync;
+            } else {
+                throw std::invalid_argument("unknown durability " + durability);
+            }
+        } else if (arg == "--flush-ms") {
+            config.options.flush_interval = std::chrono::milliseconds(std::stoul(value()));
+        } else if (arg == "--verify") {
+            config.options.verify_checksums = true;
+        } else if (arg == "--compaction-ms") {
+            config.options.compaction_interval = std::chrono::milliseconds(std::stoul(value()));
+        } else if (arg == "--path") {
+            config.path = value();
+        } else if (arg == "--reuse") {
+            config.reuse = true;
+        } else if (arg == "--keep") {
+            config.keep = true;
+        } else if (arg == "--seed") {
+            config.seed = std::stoul(value());
+        } else if (arg == "--json") {
+            config.json = value();
+        } else {
+            throw std::invalid_argument("unknown option " + arg);
+        }
+    }
+    return config;
+}
+
+static const char* key_dist_name(KeyDist dist) {
+    switch (dist) {
+    case KeyDist::kUniform:
+        return "uniform";
+    case KeyDist::kZipfian:
+        return "zipfian";
+    case KeyDist::kLatest:
+        return "latest";
+    }
+    return "";
+}
+
+static const char* value_dist_name(ValueDist dist) {
+    switch (dist) {
+    case ValueDist::kFixed:
+        return "fixed";
+    case ValueDist::kUniform:
+        return "uniform";
+    case ValueDist::kZipfian:
+        return "zipfian";
+    }
+    return "";
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (std::string(argv[i]) == "--help" || std::string(argv[i]) == "-h") {
+            printUsage();
+            return 0;
+        }
+    }
+    Config config;
+    try {
+        config = parse_args(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        printUsage();
+        return 1;
+    }
+    // With the JSON going to stdout the report moves over to stderr.
+    std::ostream& out = config.json == "-" ? std::cerr : std::cout;
+    out << std::fixed;
+    const char* keydir_names[] = {"hash", "paged", "open"};
+    const char* durability_names[] = {"sync", "group", "async"};
+    const char* log_mode_names[] = {"growing", "preallocated", "direct"};
+
+    JsonWriter json;
+    json.beginObject();
+    json.beginObject("config");
+    json.field("workload", config.workload);
+    for (int op = 0; op < kNumOps; op++) {
+        json.field(std::string(kOpNames[op]) + "_proportion", config.proportions[op]);
+    }
+    json.field("threads", static_cast<uint64_t>(config.threads));
+    json.field("keys", config.keys);
+    json.field("ops", config.ops);
+    json.field("duration", config.duration);
+    json.field("key_dist", std::string(key_dist_name(config.key_dist)));
+    json.field("zipf_theta", config.zipf_theta);
+    json.field("max_scan_length", config.max_scan_length);
+    json.field("value_size", static_cast<uint64_t>(config.value_size));
+    json.field("value_dist", std::string(value_dist_name(config.value_dist)));
+    json.field("keydir", std::string(keydir_names[static_cast<int>(config.options.keydir)]));
+    json.field("value_cache_bytes", static_cast<uint64_t>(config.options.value_cache_bytes));
+    json.field("inline_value_bytes", static_cast<uint64_t>(config.options.inline_value_bytes));
+    json.field("segment_size", static_cast<uint64_t>(config.options.segment_size));
+    json.field("log_mode", std::string(log_mode_names[static_cast<int>(config.options.log_mode)]));
+    json.field("mmap_chunk_size", static_cast<uint64_t>(config.options.mmap_chunk_size));
+    json.field("max_batch_wait_us", static_cast<uint64_t>(config.options.max_batch_wait.count()));
+    json.field("shards", static_cast<uint64_t>(config.options.shards));
+    json.field("durability", std::string(durability_names[static_cast<int>(config.options.durability)]));
+    json.field("flush_interval_ms", static_cast<uint64_t>(config.options.flush_interval.count()));
+    json.field("verify_checksums", config.options.verify_checksums);
+    json.endObject();
+
+    try {
+        std::string pool = make_value_pool(config.seed);
+        if (config.workload == "restore") {
+            restore(config, pool, out, json);
+        } else if (config.workload == "commit") {
+            commit(config, pool, log_mode_names, out, json);
+        } else {
+            if (!config.reuse) {
+                remove_store_files(config.path);
+            }
+            uint64_t memory_before = resident_anon_bytes();
+            KVStore store(config.path, config.options);
+            if (!config.reuse || !store.get(0)) {
+                load(store, config, pool, out, json);
+            }
+            run(store, config, pool, out, json);
+            report_memory(store, memory_before, out, json);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Benchmark failed: " << e.what() << std::endl;
+        return 1;
+    }
+    json.endObject();
+
+    if (!config.keep) {
+        remove_store_files(config.path);
+    }
+    if (config.json == "-") {
+        std::cout << json.str() << std::endl;
+    } else if (!config.json.empty()) {
+        std::ofstream file(config.json);
+        file << json.str() << std::endl;
+        if (!file) {
+            std::cerr << "Failed to write " << config.json << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
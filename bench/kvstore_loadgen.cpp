@@ -0,0 +1,446 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../include/kvstore.h"
+#include "../include/kvstore_server.h"
+#include "histogram.h"
+
+// Load generator for kvstore_server. Opens a number of connections over a number of
+// threads and keeps a pipeline of GET and SET requests going on each. Every key has
+// one value, derived from the key, so every GET reply can be checked. Can start a
+// server in-process on a free loopback port instead of talking to a running one.
+
+using Clock = std::chrono::steady_clock;
+
+static void printUsage() {
+    std::cout << "Usage: kvstore_loadgen [options]\n"
+              << "  --embedded            serve a fresh store in-process on a free port\n"
+              << "  --path P              store file of the embedded server (kvstore_loadgen.db)\n"
+              << "  --reactors N          reactors of the embedded server (2)\n"
+              << "  --shards N            Options::shards of the embedded store (1)\n"
+              << "  --host H --port N     server to talk to otherwise (127.0.0.1:6380)\n"
+              << "  --threads N           client threads (2)\n"
+              << "  --connections N       connections, over all threads (8)\n"
+              << "  --pipeline N          requests sent per connection before reading replies (16)\n"
+              << "  --keys N              keys, all SET once before the run (10000)\n"
+              << "  --ops N               requests in the run, over all connections (100000)\n"
+              << "  --duration S          run for S seconds instead of --ops\n"
+              << "  --value-size N        value size, at most 4096 (100)\n"
+              << "  --set-ratio R         fraction of requests that are SETs (0.5)\n"
+              << "  --seed N              random seed (1)\n";
+}
+
+struct Config {
+    bool embedded = false;
+    std::string path = "kvstore_loadgen.db";
+    size_t reactors = 2;
+    size_t shards = 1;
+    std::string host = "127.0.0.1";
+    uint16_t port = 6380;
+    size_t threads = 2;
+    size_t connections = 8;
+    size_t pipeline = 16;
+    uint64_t keys = 10000;
+    uint64_t ops = 100000;
+    double duration = 0;
+    size_t value_size = 100;
+    double set_ratio = 0.5;
+    uint64_t seed = 1;
+};
+
+// The one value key ever gets.
+static std::string value_for(KVStore::K key, size_t size) {
+    std::string pattern = std::to_string(key) + ":";
+    std::string value;
+    value.reserve(size);
+    while (value.size() < size) {
+        value += pattern;
+    }
+    value.resize(size);
+    return value;
+}
+
+static void append_command(std::string& out, std::initializer_list<std::string> args) {
+    out += "*" + std::to_string(args.size()) + "\r\n";
+    for (const std::string& arg : args) {
+        out += "$" + std::to_string(arg.size()) + "\r\n";
+        out += arg;
+        out += "\r\n";
+    }
+}
+
+// ----------------------------------------------
+// CLIENT
+// ----------------------------------------------
+// Blocking RESP connection. Only knows the reply types GET and SET produce.
+class Client {
+ public:
+    struct Reply {
+        char type = 0;     // '+', '-', ':' or '$'
+        bool nil = false;  // a null bulk string
+        std::string text;  // the line, or the bulk string
+    };
+
+    Client(const std::string& host, uint16_t port) {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+            throw std::runtime_error("Invalid address " + host);
+        }
+        fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd_ == -1 || connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            if (fd_ != -1) {
+                close(fd_);
+            }
+            throw std::runtime_error("Failed to connect to " + host + ":" + std::to_string(port));
+        }
+        int one = 1;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    ~Client() { close(fd_); }
+
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    void send(const std::string& data) {
+        for (size_t sent = 0; sent < data.size();) {
+            ssize_t n = ::send(fd_, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("send failed");
+            }
+            sent += n;
+        }
+    }
+
+    Reply read() {
+        Reply reply;
+        std::string line = readLine();
+        if (line.empty()) {
+            throw std::runtime_error("Malformed reply");
+        }
+        reply.type = line[0];
+        if (reply.type != '$') {
+            reply.text = line.substr(1);
+            return reply;
+        }
+        long length = std::stol(line.substr(1));
+        if (length < 0) {
+            reply.nil = true;
+            return reply;
+        }
+        while (in_.size() - pos_ < static_cast<size_t>(length) + 2) {
+            fill();
+        }
+        reply.text = in_.substr(pos_, length);
+        pos_ += length + 2;
+        return reply;
+    }
+
+ private:
+    std::string readLine() {
+        while (true) {
+            size_t end = in_.find("\r\n", pos_);
+            if (end != std::string::npos) {
+                std::string line = in_.substr(pos_, end - pos_);
+                pos_ = end + 2;
+                return line;
+            }
+            fill();
+        }
+    }
+
+    void fill() {
+        if (pos_ == in_.size()) {
+            in_.clear();
+            pos_ = 0;
+        }
+        char buf[16384];
+        ssize_t n;
+        do {
+            n = recv(fd_, buf, sizeof(buf), 0);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            throw std::runtime_error("Connection closed by server");
+        }
+        in_.append(buf, n);
+    }
+
+    int fd_ = -1;
+    std::string in_;
+    size_t pos_ = 0;
+};
+
+// ----------------------------------------------
+// LOAD
+// ----------------------------------------------
+enum Op { kGet, kSet, kNumOps };
+static const char* kOpNames[] = {"GET", "SET"};
+
+struct ThreadResult {
+    std::vector<Histogram> latencies{kNumOps};
+    uint64_t errors = 0;
+    uint64_t mismatches = 0;
+};
+
+// SETs every key once, pipelined over one connection, so that the run's GETs all hit.
+static void load(const Config& config) {
+    Client client(config.host, config.port);
+    const uint64_t kBatch = 256;
+    for (uint64_t first = 0; first < config.keys; first += kBatch) {
+        uint64_t last = std::min(config.keys, first + kBatch);
+        std::string out;
+        for (uint64_t key = first; key < last; key++) {
+            append_command(out, {"SET", std::to_string(key), value_for(key, config.value_size)});
+        }
+        client.send(out);
+        for (uint64_t key = first; key < last; key++) {
+            Client::Reply reply = client.read();
+            if (reply.type != '+') {
+                throw std::runtime_error("SET " + std::to_string(key) + " failed: " + reply.text);
+            }
+        }
+    }
+}
+
+// One client thread. Sends a pipeline's worth of requests on each of its connections,
+// then collects the replies, until its share of the ops is done or time is up.
+static void run_thread(const Config& config, size_t connections, uint64_t ops, Clock::time_point deadline,
+                       uint64_t seed, ThreadResult& result) {
+    std::vector<std::unique_ptr<Client>> clients;
+    for (size_t i = 0; i < connections; i++) {
+        clients.push_back(std::make_unique<Client>(config.host, config.port));
+    }
+    std::mt19937_64 rng(seed);
+    std::uniform_int_distribution<KVStore::K> key_dist(0, config.keys - 1);
+    std::bernoulli_distribution set_dist(config.set_ratio);
+
+    struct Request {
+        Op op;
+        KVStore::K key;
+    };
+    std::vector<std::vector<Request>> requests(connections);
+    std::vector<Clock::time_point> sent_at(connections);
+    uint64_t done = 0;
+    while (config.duration > 0 ? Clock::now() < deadline : done < ops) {
+        for (size_t c = 0; c < connections; c++) {
+            requests[c].clear();
+            std::string out;
+            for (size_t i = 0; i < config.pipeline && (config.duration > 0 || done < ops); i++, done++) {
+                Request request{set_dist(rng) ? kSet : kGet, key_dist(rng)};
+                if (request.op == kSet) {
+                    append_command(out, {"SET", std::to_string(request.key), value_for(request.key, config.value_size)});
+                } else {
+                    append_command(out, {"GET", std::to_string(request.key)});
+                }
+                requests[c].push_back(request);
+            }
+            sent_at[c] = Clock::now();
+            if (!out.empty()) {
+                clients[c]->send(out);
+            }
+        }
+        for (size_t c = 0; c < connections; c++) {
+            for (const Request& request : requests[c]) {
+                Client::Reply reply = clients[c]->read();
+                result.latencies[request.op].record(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - sent_at[c]).count());
+                if (reply.type == '-') {
+                    result.errors++;
+                } else if (request.op == kSet ? reply.type != '+'
+                                              : reply.nil || reply.text != value_for(request.key, config.value_size)) {
+                    result.mismatches++;
+                }
+            }
+        }
+    }
+}
+
+static void report_latencies(const std::string& name, const Histogram& histogram, double seconds) {
+    double us = 1000.0;
+    std::cout << "  " << std::left << std::setw(6) << name << std::right << std::setw(10) << histogram.count()
+              << " ops " << std::setw(12) << std::fixed << std::setprecision(0) << histogram.count() / seconds
+              << " ops/s" << std::setprecision(1) << "  mean " << histogram.mean() / us << "  p50 "
+              << histogram.percentile(50) / us << "  p99 " << histogram.percentile(99) / us << "  p99.9 "
+              << histogram.percentile(99.9) / us << "  max " << histogram.max() / us << " us" << std::endl;
+}
+
+static void remove_store_files(const std::string& path) {
+    std::filesystem::path dir = std::filesystem::path(path).parent_path();
+    std::string name = std::filesystem::path(path).filename().string();
+    for (const auto& entry : std::filesystem::directory_iterator(dir.empty() ? "." : dir)) {
+        std::string file = entry.path().filename().string();
+        if (file == name || file.rfind(name + ".", 0) == 0) {
+            std::filesystem::remove(entry.path());
+        }
+    }
+}
+
+static Config parse_args(int argc, char* argv[]) {
+    Config config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--embedded") {
+            config.embedded = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            throw std::invalid_argument(arg + " needs a value");
+        }
+        std::string value = argv[++i];
+        if (arg == "--path") {
+            config.path = value;
+        } else if (arg == "--reactors") {
+            config.reactors = std::stoul(value);
+        } else if (arg == "--shards") {
+            config.shards = std::stoul(value);
+        } else if (arg == "--host") {
+            config.host = value;
+        } else if (arg == "--port") {
+            config.port = static_cast<uint16_t>(std::stoul(value));
+        } else if (arg == "--threads") {
+            config.threads = std::max<size_t>(1, std::stoul(value));
+        } else if (arg == "--connections") {
+            config.connections = std::stoul(value);
+        } else if (arg == "--pipeline") {
+            config.pipeline = std::max<size_t>(1, std::stoul(value));
+        } else if (arg == "--keys") {
+            config.keys = std::max<uint64_t>(1, std::stoull(value));
+        } else if (arg == "--ops") {
+            config.ops = std::stoull(value);
+        } else if (arg == "--duration") {
+            config.duration = std::stod(value);
+        } else if (arg == "--value-size") {
+            config.value_size = std::stoul(value);
+        } else if (arg == "--set-ratio") {
+            config.set_ratio = std::stod(value);
+        } else if (arg == "--seed") {
+            config.seed = std::stoull(value);
+        } else {
+            throw std::invalid_argument("unknown option " + arg);
+        }
+    }
+    if (config.value_size == 0 || config.value_size > 4096) {
+        throw std::invalid_argument("--value-size must be between 1 and 4096");
+    }
+    if (config.set_ratio < 0 || config.set_ratio > 1) {
+        throw std::invalid_argument("--set-ratio must be between 0 and 1");
+    }
+    config.connections = std::max(config.connections, config.threads);
+    return config;
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (std::string(argv[i]) == "--help" || std::string(argv[i]) == "-h") {
+            printUsage();
+            return 0;
+        }
+    }
+    Config config;
+    try {
+        config = parse_args(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        printUsage();
+        return 1;
+    }
+
+    std::unique_ptr<KVStore> store;
+    std::unique_ptr<KVServer> server;
+    ThreadResult total;
+    double seconds = 0;
+    try {
+        if (config.embedded) {
+            remove_store_files(config.path);
+            KVStore::Options store_options;
+            store_options.shards = config.shards;
+            store = std::make_unique<KVStore>(config.path, store_options);
+            KVServer::Options options;
+            options.host = config.host;
+            options.port = 0;
+            options.reactors = config.reactors;
+            server = std::make_unique<KVServer>(*store, options);
+            config.port = server->port();
+        }
+        std::cout << "Loading " << config.keys << " keys into " << config.host << ":" << config.port << std::endl;
+        load(config);
+
+        std::cout << "Running " << config.connections << " connections on " << config.threads
+                  << " threads, pipeline " << config.pipeline << std::endl;
+        std::vector<ThreadResult> results(config.threads);
+        std::vector<std::thread> threads;
+        std::vector<std::exception_ptr> failures(config.threads);
+        Clock::time_point start = Clock::now();
+        Clock::time_point deadline = start + std::chrono::duration_cast<Clock::duration>(
+                                                 std::chrono::duration<double>(config.duration));
+        for (size_t t = 0; t < config.threads; t++) {
+            size_t connections = config.connections / config.threads + (t < config.connections % config.threads);
+            uint64_t ops = config.ops / config.threads + (t < config.ops % config.threads);
+            threads.emplace_back([&, t, connections, ops] {
+                try {
+                    run_thread(config, connections, ops, deadline, config.seed + t, results[t]);
+                } catch (...) {
+                    failures[t] = std::current_exception();
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        for (auto& failure : failures) {
+            if (failure) {
+                std::rethrow_exception(failure);
+            }
+        }
+        for (const ThreadResult& result : results) {
+            for (int op = 0; op < kNumOps; op++) {
+                total.latencies[op].merge(result.latencies[op]);
+            }
+            total.errors += result.errors;
+            total.mismatches += result.mismatches;
+        }
+        if (server) {
+            server->stop();
+            server.reset();
+            store.reset();
+            remove_store_files(config.path);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Load generator failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    Histogram all;
+    for (int op = 0; op < kNumOps; op++) {
+        all.merge(total.latencies[op]);
+    }
+    std::cout << "Ran " << std::fixed << std::setprecision(2) << seconds << " s" << std::endl;
+    report_latencies("all", all, seconds);
+    for (int op = 0; op < kNumOps; op++) {
+        if (total.latencies[op].count() > 0) {
+            report_latencies(kOpNames[op], total.latencies[op], seconds);
+        }
+    }
+    std::cout << "  errors " << total.errors << "  mismatches " << total.mismatches << std::endl;
+    return total.errors == 0 && total.mismatches == 0 ? 0 : 1;
+}
@@ -1,80 +1,779 @@
 #pragma once
 
+#include <cstdint>
+#include <cstring>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
 #include <mutex>
 #include <optional>
 #include <fstream>
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <set>
+#include <thread>
+#include <vector>
 #include <tbb/concurrent_hash_map.h>
+#include <tbb/spin_rw_mutex.h>
 
-// Uncomment this for my little group commit experiment where
-// I try to avoid redundant fsyncs from concurrent puts. This
-// doesn't do anything epoch-related so it's a bit weird.
-// #define GROUP_COMMIT 1
+// Traits of values that are byte strings of any length up to 4096, the kind of
+// value KVStore stores. Key is the key type, any unsigned integer.
+template <typename Key = uint32_t>
+struct StringValueTraits {
+    using K = Key;
+    using V = std::string;
+    // What put takes a value as.
+    using ValueArg = std::string_view;
+    // The size every value has, or 0 if they vary.
+    static constexpr size_t kValueSize = 0;
+
+    // The bytes a value is logged as, and back.
+    static std::string_view bytes(std::string_view value) { return value; }
+    static bool decode(const char* data, size_t size, V& value) {
+        value.assign(data, size);
+        return true;
+    }
+};
 
-class KVStore {
+// Traits of values that are all one trivially copyable T, stored as its bytes.
+// Its records leave out the length field and all have the same size, and a store
+// never opens the log of a store whose key or value size differs.
+template <typename T, typename Key = uint32_t>
+struct FixedValueTraits {
+    static_assert(std::is_trivially_copyable<T>::value, "values are copied in and out of the log bytewise");
+    static_assert(sizeof(T) <= 4096, "values are at most 4096 bytes");
+
+    using K = Key;
+    using V = T;
+    using ValueArg = const T&;
+    static constexpr size_t kValueSize = sizeof(T);
+
+    static std::string_view bytes(const T& value) {
+        return std::string_view(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+    static bool decode(const char* data, size_t size, V& value) {
+        if (size != sizeof(T)) {
+            return false;
+        }
+        memcpy(&value, data, sizeof(T));
+        return true;
+    }
+};
+
+// A log-structured store of Traits::V values under Traits::K keys. KVStore is the
+// one of uint32_t keys and string values; see StringValueTraits and
+// FixedValueTraits for the others.
+template <typename Traits = StringValueTraits<>>
+class BasicKVStore {
 public:
-    using K = uint32_t;
-    using V = std::string;
-    explicit KVStore(const std::string& persistence_file);
-    ~KVStore();
+    using K = typename Traits::K;
+    using V = typename Traits::V;
+    using ValueArg = typename Traits::ValueArg;
+    static_assert(std::is_integral<K>::value && std::is_unsigned<K>::value && sizeof(K) <= sizeof(uint64_t),
+                  "keys are unsigned integers of up to 64 bits");
+
+    // Data structures the in-memory key directory can be kept in.
+    enum class KeyDirType {
+        // tbb::concurrent_hash_map, one node per key.
+        kHashMap,
+        // Pages of packed 8-byte entries indexed directly by key, allocated
+        // as keys show up. Best for dense key ranges.
+        kPagedArray,
+        // Linear-probing table of keys and packed 8-byte entries. For sparse
+        // key ranges.
+        kOpenAddressing,
+    };
+
+    // When put, remove and write return, see Options::durability.
+    enum class Durability {
+        // Once the write is durable. A group commit leader syncs as soon as
+        // a kSync write is waiting instead of holding out max_batch_wait
+        // for a bigger batch.
+        kSync,
+        // Once the write is durable, sharing each fdatasync with the other
+        // writers. This is what put always did.
+        kGroupCommit,
+        // As soon as the write is in the log, visible to get but not yet
+        // durable. A background flusher syncs it within flush_interval; a
+        // crash before that loses it along with every write after it.
+        // flush() and waitDurable() fence.
+        kAsync,
+    };
+
+    // How the log's segment files are laid out and written.
+    enum class LogMode {
+        // Segments grow as records are appended, so every fdatasync also
+        // commits the file's new size.
+        kGrowing,
+        // Segments are allocated and zero-filled at full size before any
+        // record goes in, ahead of time by the background thread, so that
+        // an fdatasync only has data to flush. The data ends at an end
+        // record rather than at the end of the file.
+        kPreallocated,
+        // kPreallocated, with the log written through O_DIRECT. Records are
+        // staged in aligned memory and each group commit round writes them
+        // out as whole 4 KiB blocks, bypassing the page cache. Needs a
+        // filesystem that supports O_DIRECT. The async calls always run on
+        // the thread pool in this mode.
+        kDirect,
+    };
+
+    // Largest Options::inline_value_bytes.
+    static const size_t kMaxInlineValue = 16;
+
+    struct Options {
+        // How many written records end a group commit leader's wait for
+        // max_batch_wait early. Not a cap on the round: writers pwrite in
+        // parallel and a round syncs every record written so far, however
+        // many that is.
+        size_t max_batch_size = 256;
+        // How long a leader waits for more writers to join its batch before
+        // flushing. Zero flushes whatever has queued up by the time the
+        // leader gets to run, which is usually plenty under load.
+        std::chrono::microseconds max_batch_wait{0};
+        // Durable parts of the log are mapped into memory in chunks of this
+        // many bytes so that get() can serve them without a syscall. Must be
+        // a multiple of the page size; zero turns mapping off and every read
+        // goes through pread.
+        size_t mmap_chunk_size = 64 << 20;
+        // The log is rolled over to a new segment file once the current one
+        // grows past this many bytes.
+        size_t segment_size = 64 << 20;
+        // How segments are laid out and written, see LogMode. A store can be
+        // reopened in another mode.
+        LogMode log_mode = LogMode::kGrowing;
+        // How often the background merger checks whether there is anything
+        // to compact. Zero turns the background merger off; compact() can
+        // still be called by hand.
+        std::chrono::milliseconds compaction_interval{30000};
+        // The background merger only runs once at least this many sealed
+        // segments have piled up.
+        size_t compaction_min_segments = 4;
+        // ...and at least this fraction of the log's records are overwritten.
+        // A merge rewrites every live record, so this bounds the bytes copied
+        // per byte reclaimed. Zero merges regardless of garbage.
+        double compaction_min_dead_ratio = 0.5;
+        // Caps how fast a merge writes out compacted data so that it does not
+        // starve foreground I/O. Zero means no limit.
+        size_t compaction_bytes_per_sec = 64 << 20;
+        // Write a hint file next to every sealed segment so that the next
+        // startup can load the keydir without reading the segment itself.
+        bool write_hints = true;
+        // Threads used to scan a segment on startup when it has no hint.
+        // Zero uses one per core.
+        size_t recovery_threads = 0;
+        // Byte budget of the cache get() keeps of recently read values. Zero
+        // turns the cache off.
+        size_t value_cache_bytes = 0;
+        // Which data structure holds the key directory.
+        KeyDirType keydir = KeyDirType::kHashMap;
+        // Values of at most this many bytes (up to kMaxInlineValue) are kept
+        // in the keydir next to their position, so get() answers them from
+        // memory. Each kHashMap entry grows by 16 bytes whether or not its
+        // value fits. The packed keydirs have no room for values and ignore
+        // this. Zero turns it off.
+        size_t inline_value_bytes = 0;
+        // Check a record's checksum every time get() reads a value from disk,
+        // so bit rot shows up as an exception rather than a wrong value.
+        bool verify_checksums = false;
+        // Serve getAsync/putAsync with io_uring where the kernel supports it.
+        // Otherwise, or when this is off, they run on a small thread pool.
+        bool use_io_uring = true;
+        // Size of the thread pool the async calls fall back to.
+        size_t async_threads = 4;
+        // Submission queue size of the io_uring.
+        unsigned io_uring_entries = 256;
+        // Durability of put, remove and write unless the call picks its own.
+        Durability durability = Durability::kGroupCommit;
+        // The flusher behind kAsync writes syncs the log this often while
+        // there is anything to sync...
+        std::chrono::milliseconds flush_interval{10};
+        // ...or as soon as this many bytes are written but not synced.
+        size_t flush_bytes = 1 << 20;
+        // Number of shards the keys are hash-partitioned over. Each shard is a
+        // store of its own at <persistence_file>.shard<i>, with its own log,
+        // group commit and fsyncs, so puts to different shards never wait on
+        // each other and all shards are restored in parallel. The value cache,
+        // async threads and recovery threads are split between the shards.
+        // Zero uses one per core. Fixed once the store is created.
+        size_t shards = 1;
+        // Open the store as a read-only follower of the primary that has it
+        // open for writing, possibly in another process on the same machine.
+        // The follower tails the primary's log and applies records once the
+        // primary has made them durable, never before. Writes to a follower
+        // throw. Follow a sharded store by following each of its shards.
+        bool follower = false;
+        // How often a follower looks for new durable records. Zero leaves
+        // that to catchUp().
+        std::chrono::milliseconds follow_interval{10};
+    };
+
+    // Group commit counters. fsyncs_saved is the number of records that were
+    // made durable by someone else's fsync.
+    struct CommitStats {
+        uint64_t batches = 0;
+        uint64_t records = 0;
+        uint64_t max_batch_size = 0;
+        uint64_t fsyncs_saved = 0;
+    };
+
+    // Value cache counters. Hits and misses only count lookups of live keys.
+    struct CacheStats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        uint64_t entries = 0;
+        uint64_t bytes = 0;
+    };
+
+    // Latency distribution of one kind of operation, in nanoseconds. Percentiles
+    // are accurate to within about 6%.
+    struct LatencyStats {
+        uint64_t count = 0;
+        uint64_t mean = 0;
+        uint64_t p50 = 0;
+        uint64_t p99 = 0;
+        uint64_t p999 = 0;
+        uint64_t max = 0;
+    };
+
+    // Snapshot of the store's counters, see stats().
+    struct Stats {
+        // Calls of the public operations.
+        uint64_t puts = 0;
+        uint64_t removes = 0;
+        uint64_t writes = 0;
+        uint64_t gets = 0;
+        uint64_t multi_gets = 0;
+        // scan() calls and iterators.
+        uint64_t scans = 0;
+        uint64_t async_puts = 0;
+        uint64_t async_gets = 0;
+        // Reads of a value out of a segment, i.e. lookups the value cache
+        // didn't answer, whether mapped or through pread.
+        uint64_t file_reads = 0;
+        uint64_t bytes_appended = 0;
+        // From reserving a record's spot in the log until it is durable.
+        LatencyStats append_latency;
+        // One group commit round's fdatasyncs.
+        LatencyStats fsync_latency;
+        LatencyStats file_read_latency;
+        // How far the durable watermark trails the written log: the bytes not
+        // synced yet, and for how long the oldest of them has been waiting.
+        uint64_t unsynced_bytes = 0;
+        std::chrono::nanoseconds unsynced_age{0};
+        // For each group commit round, how long the oldest record it synced
+        // had been waiting for it.
+        LatencyStats durable_lag;
+        // The log on disk. Live and dead bytes are estimated from the number of
+        // overwritten records and the average record size. Records that a
+        // segment overwrote within itself before the store was reopened from
+        // hint files count as live until compaction gets to them.
+        uint64_t segments = 0;
+        uint64_t log_bytes = 0;
+        uint64_t live_bytes = 0;
+        uint64_t dead_bytes = 0;
+        // Keydir entries, tombstones included.
+        uint64_t keys = 0;
+        uint64_t tombstones = 0;
+        // Keys whose value is held inline, see Options::inline_value_bytes.
+        uint64_t inline_values = 0;
+        CommitStats commits;
+        CacheStats cache;
+        double cache_hit_rate = 0;
+        std::chrono::nanoseconds restore_duration{0};
+        // Open snapshots and the old keydir entries kept around for them.
+        uint64_t snapshots = 0;
+        uint64_t snapshot_versions = 0;
+
+        // The snapshot in the Prometheus text exposition format.
+        std::string toText() const;
+    };
+
+    // A group of puts and removes that write() commits as one unit. After a
+    // crash either all of them are in the store or none are.
+    class WriteBatch {
+    public:
+        // Same limits as BasicKVStore::put.
+        void put(K key, ValueArg value);
+        // Unlike BasicKVStore::remove this writes a tombstone whether or not the
+        // key exists when the batch is written.
+        void remove(K key);
+        size_t size() const { return ops_.size(); }
+        void clear();
+
+    private:
+        friend class BasicKVStore;
+        struct Op {
+            K key;
+            size_t value_offset;  // of the record's value length within records_
+            bool is_deleted;
+        };
+        std::string records_;  // encoded log records, in order
+        std::vector<Op> ops_;
+    };
+
+    // Walks the live keys of a range in key order, see iterate(). Reads values a
+    // batch of keys at a time, so it is not a snapshot: each batch sees the
+    // store as of when it was read. Must not outlive the store.
+    class Iterator {
+    public:
+        bool valid() const { return index_ < batch_.size(); }
+        // Only while valid().
+        K key() const { return batch_[index_].first; }
+        const V& value() const { return batch_[index_].second; }
+        void next();
+
+    private:
+        friend class BasicKVStore;
+        Iterator(const BasicKVStore& store, K lo, K hi, std::vector<uint64_t> at);
+        void fill();
+
+        const BasicKVStore* store_;
+        K next_;  // where the next batch starts
+        K hi_;
+        std::vector<uint64_t> at_;  // log positions of the snapshot it reads from, if any
+        bool more_;  // whether there is anything left past the current batch
+        std::vector<std::pair<K, V>> batch_;
+        size_t index_ = 0;
+    };
+
+    // A consistent view of the store as of one position in the log, see
+    // snapshot(). Reads through it see every write that had returned when it
+    // was taken and none that started after. Must not outlive the store.
+    class Snapshot {
+    public:
+        ~Snapshot();
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+
+        // Same as the store's, as of the snapshot. Scans and iterators over a
+        // snapshot are consistent across batches.
+        std::optional<V> get(K key) const;
+        std::vector<std::optional<V>> multiGet(const std::vector<K>& keys) const;
+        void scan(K lo, K hi, const std::function<bool(K key, const V& value)>& fn) const;
+        Iterator iterate(K lo = 0, K hi = ~K(0)) const;
+
+    private:
+        friend class BasicKVStore;
+        Snapshot(const BasicKVStore& store, std::vector<uint64_t> positions)
+            : store_(&store), positions_(std::move(positions)) {}
+
+        const BasicKVStore* store_;
+        std::vector<uint64_t> positions_;  // in each shard's log, or just the one log
+    };
+
+    // Completion callbacks of the async calls. error is null on success and holds
+    // what the synchronous call would have thrown otherwise. Callbacks run either
+    // on the calling thread, when the result is at hand right away, or on an
+    // internal I/O thread, so they must not block or throw.
+    using GetCallback = std::function<void(std::optional<V> value, std::exception_ptr error)>;
+    using PutCallback = std::function<void(std::exception_ptr error)>;
+
+    explicit BasicKVStore(const std::string& persistence_file);
+    BasicKVStore(const std::string& persistence_file, const Options& options);
+    ~BasicKVStore();
 
     // Stores a mapping from key to value in the kvstore. Note that
     // value can be at most 4096 chars otherwise an exception will be
     // thrown.
     //
-    // This is guaranteed to be durable the moment this function returns.
-    // Any get after this function returns should either see the
-    // given value or a later value.
-    void put(K key, const V &value);
+    // Unless Options::durability is kAsync, this is guaranteed to be durable
+    // the moment this function returns. Any get after this function returns
+    // should either see the given value or a later value.
+    //
+    // Puts into an unsharded store don't allocate: the record header is encoded
+    // on the stack and written out together with value.
+    void put(K key, ValueArg value);
+    void put(K key, ValueArg value, Durability durability);
 
     // Gets a value mapped to K, not necessarily the most recent one.
     // Guaranteed to be within a second stale.
     std::optional<V> get(K key) const;
+    // Same, but copies the value into value and returns whether the key is
+    // there. Reusing value's buffer across calls keeps gets from allocating.
+    bool get(K key, V& value) const;
 
 
-    // Removes the key from the map. Memory used by this key won't
-    // immediately be reclaimed. Has the same semantics as put.
+    // Removes the key from the map. Memory used by this key is reclaimed
+    // once the segment holding the tombstone gets compacted. Has the same
+    // semantics as put.
     void remove(K key);
+    void remove(K key, Durability durability);
+
+    // Commits every put and remove in batch with a single append to the log and
+    // a single fsync. Has the same durability semantics as put. Later operations
+    // on the same key within the batch win. On a sharded store a batch that
+    // spans shards also costs two fsyncs of the batch journal and waits for
+    // any other such batch to finish, and its parts are durable on return
+    // even with kAsync, which is what keeps it all or nothing.
+    void write(const WriteBatch& batch);
+    void write(const WriteBatch& batch, Durability durability);
+
+    // Makes every write that returned before the call durable, kAsync ones
+    // included.
+    void flush();
+    // The end of the log right now. Every write that has returned lies before
+    // it. Sharded stores have one log per shard and no single end, so this
+    // and waitDurable() throw there; use flush().
+    uint64_t logEnd() const;
+    // Blocks until the log is durable up to end, from logEnd(), syncing it if
+    // need be. A follower waits until it has applied its primary's log up to
+    // end instead, so a primary's logEnd() after a write makes a follower
+    // read it.
+    void waitDurable(uint64_t end);
+    // The end of the durable part of the log, which is as far as followers
+    // read. A follower's is the end of the records it has applied.
+    uint64_t durableEnd() const;
+    // Applies every record the primary has made durable since the last call
+    // and returns the new durableEnd(). Only for followers. Throws once the
+    // follower can't keep up with the primary's log, e.g. because a merge
+    // deleted a segment it hadn't read yet; it keeps serving what it has
+    // until reopened.
+    uint64_t catchUp();
+
+    // Gets the values of several keys at once, in the order of keys. The reads
+    // are done in log order so that they sweep through the segments instead of
+    // jumping around.
+    std::vector<std::optional<V>> multiGet(const std::vector<K>& keys) const;
+
+    // Calls fn with every live key in [lo, hi] and its value, in key order,
+    // until fn returns false. Keys sharing a prefix of their high bits form
+    // such a range. Values are read a batch of keys at a time, in log order,
+    // so a scan turns into mostly sequential reads. Like Iterator, not a
+    // snapshot.
+    void scan(K lo, K hi, const std::function<bool(K key, const V& value)>& fn) const;
+    // Iterator over the live keys in [lo, hi] in key order, positioned at the
+    // first one.
+    Iterator iterate(K lo = 0, K hi = ~K(0)) const;
+
+    // Asynchronous get. Values that aren't cached or mapped are read with
+    // io_uring (or the thread pool) instead of blocking the caller. Same
+    // semantics as get.
+    void getAsync(K key, GetCallback callback) const;
+    std::future<std::optional<V>> getAsync(K key) const;
+
+    // Asynchronous put. Returns once the record's spot in the log is reserved;
+    // the callback runs once the record is durable and visible to get, which
+    // is when put would have returned. Oversized values throw right away.
+    void putAsync(K key, V value, PutCallback callback);
+    std::future<void> putAsync(K key, V value);
+
+    // Asynchronous remove. Same semantics as remove, with the callback running
+    // when remove would have returned.
+    void removeAsync(K key, PutCallback callback);
+    std::future<void> removeAsync(K key);
+
+    // Whether key has a live value right now.
+    bool exists(K key) const;
+
+    // Opens a snapshot of the store as it is now. Writers keep going while it is
+    // open, at the cost of holding on to the entries they replace for as long
+    // as some snapshot can see them. Opening one flushes kAsync writes and
+    // waits for the writes in flight to land, which takes about two group
+    // commit rounds under load.
+    std::unique_ptr<Snapshot> snapshot() const;
+
+    // Merges every sealed segment into a single compacted segment that only
+    // holds live records, then deletes the segments it replaced. Runs
+    // concurrently with get/put/remove; puts that land during the merge win
+    // over the records it copies. The background merger calls this too. Does
+    // nothing while a snapshot is open.
+    void compact();
+
+    CommitStats commitStats() const;
+    CacheStats cacheStats() const;
+    // Counters are kept per thread, so taking a snapshot is cheap but doesn't
+    // freeze them all at one instant.
+    Stats stats() const;
 
 private:
     static const uint32_t kTombstone = ~0;
+    // Length field of a record that covers a hole left by a failed write. The
+    // key field holds the length of the hole, header included.
+    static const uint32_t kSkip = ~1;
+    // Length field of the header record of a batch. The key field holds the
+    // length of the batch's records that follow it and the checksum covers them.
+    static const uint32_t kBatch = ~2;
+    // Length field of the record that ends the data of a preallocated
+    // segment. Nothing past it is part of the log.
+    static const uint32_t kEnd = ~3;
     static const uint32_t kMaxValueSize = 4096;
+    // Keys per batch of a scan or an iterator.
+    static const size_t kScanBatch = 256;
+
+    // A position in the log: the segment's file id in the high bits and the
+    // offset within the segment in the low kOffsetBits. Segments are ordered
+    // by file id so comparing positions compares log order.
+    using LogPos = uint64_t;
+    static const int kOffsetBits = 40;
+    static LogPos makePos(uint32_t file_id, std::streamoff offset) {
+        return (static_cast<LogPos>(file_id) << kOffsetBits) | static_cast<LogPos>(offset);
+    }
+    static uint32_t posFile(LogPos pos) { return pos >> kOffsetBits; }
+    static std::streamoff posOffset(LogPos pos) { return pos & ((LogPos(1) << kOffsetBits) - 1); }
+    // Position to read the store at when not reading from a snapshot.
+    static const LogPos kLatest = ~LogPos(0);
 
     // -----------------------
     // LOG RELATED functions
     // ------------------------
+    struct Layout;
     class Reader;
+    class LogFile;
+    class ValueCache;
+    class Metrics;
+    class KeyDir;
+    template <typename Value>
+    class HashKeyDir;
+    class PackedKeyDir;
+    class PagedKeyDir;
+    class OpenKeyDir;
+    class KeyIndex;
+    class Snapshots;
+    class AsyncIo;
+    class ThreadPoolIo;
+    class IoUring;
+    class BufferPool;
+    // The keydir entries a segment contributes, the latest one per key.
+    struct HintEntry {
+        std::streamoff offset;
+        bool is_deleted;
+    };
+    using Hint_T = std::unordered_map<K, HintEntry>;
+    using RecordFn = std::function<void(K key, std::streamoff value_offset, uint32_t value_length, std::string_view value)>;
     void restore();
-    std::optional<V> getValueFromOffset(std::streamoff offset) const;
-    std::streamoff appendRecord(uint32_t checksum, K key, std::optional<std::reference_wrapper<const V>> value);
-    void commitOffset(std::streamoff offset);
+    std::string segmentPath(uint32_t file_id) const;
+    std::streamoff scanLog(const std::string& path, const RecordFn& fn) const;
+    std::streamoff recoverSegment(uint32_t file_id, const std::string& path, Hint_T* hint);
+    bool getValueFromOffset(const LogFile& file, std::streamoff offset, V& value) const;
+    bool decodeValue(const LogFile& file, std::streamoff offset, const char* record, size_t size, V& value) const;
+    LogPos appendToLog(std::string_view header, std::string_view body, Durability durability);
+    LogPos reserveLog(size_t size);
+    bool writeSkipRecord(LogFile& file, std::streamoff offset, uint32_t length);
+    bool writeEndRecord(LogFile& file, std::streamoff offset);
+    void rollSegment(LogFile& file, std::streamoff end_offset);
+    void markWritten(LogPos pos, LogPos end_pos);
+    void failWrite();
+    void commitOffset(std::unique_lock<std::mutex>& lock, LogPos end_pos);
+    void flushBatch(std::unique_lock<std::mutex>& lock);
+    bool syncSegments(uint32_t first_file, LogPos sync_pos);
+    void segmentsDurable(uint32_t first_file, LogPos sync_pos);
+    void finishBatch(bool ok, LogPos sync_pos, uint64_t sync_records, uint64_t sync_bytes);
+    void flushLoop();
+    void kickAsyncPuts(std::unique_lock<std::mutex>& lock);
+    AsyncIo& asyncIo() const;
+    LogFile* findSegment(uint32_t file_id) const;
+    // Where a value lives and where its read goes in the caller's results.
+    struct ValueRef {
+        LogPos pos;
+        size_t index;
+    };
+    std::vector<size_t> readValues(std::vector<ValueRef>& refs, std::vector<std::optional<V>>& values) const;
+    bool scanBatch(K& lo, K hi, LogPos at, size_t limit, std::vector<std::pair<K, V>>& out) const;
+    std::optional<V> getAt(K key, LogPos at) const;
+    bool getAt(K key, LogPos at, V& value) const;
+    std::vector<std::optional<V>> multiGetAt(const std::vector<K>& keys, LogPos at) const;
+    std::string hintPath(uint32_t file_id) const;
+    void writeHint(uint32_t file_id, std::streamoff segment_size, const Hint_T& entries) const;
+    bool loadHint(uint32_t file_id, std::streamoff segment_size);
+    void writePendingHints();
+    void backgroundLoop();
+    bool takeSpare(uint32_t file_id);
+    void prepareSpare();
+    std::vector<uint32_t> segmentIds() const;
+    void openFollower();
+    void follow();
+    uint32_t openNewSegments(uint32_t from_id);
+    void rebase(uint32_t compacted_id);
+    void retireReplaced();
+    void followLoop();
 
-    bool exists(K key) const;
-    void doPut(K key, std::optional<std::reference_wrapper<const V>> value);
+    void doPut(K key, std::optional<std::string_view> value, Durability durability);
+    void appendBatch(const WriteBatch& batch, Durability durability);
+    void doPutAsync(K key, std::optional<std::string_view> value, PutCallback callback);
+    void updateStore(K key, LogPos value_pos, bool is_deleted, std::optional<std::string_view> value = std::nullopt);
+    void inlineValue(K key, LogPos pos, std::string_view value) const;
 
     // store a map between key and file location data of the value
     struct StoreValue {
-        // uint8_t file_id;        // not useful for now since we are only using one file
         std::streamoff offset;  // offset in file
-        // uint64_t timestamp;     // timestamp, again not relevant if we are only using one file, offset does its job
+        uint32_t file_id;       // segment the value lives in
+        // uint64_t timestamp;     // timestamp, not relevant since (file_id, offset) orders the whole log
         bool is_deleted;        // whether or not the value is deleted in the map
     };
+    // The kHashMap keydir's entry when Options::inline_value_bytes is set.
+    struct InlineStoreValue {
+        std::streamoff offset;
+        uint32_t file_id;
+        bool is_deleted;
+        uint8_t inline_size;                  // bytes of inline_value in use, ~0 if the value isn't inline
+        char inline_value[kMaxInlineValue];  // the value itself if it is small enough
+    };
 
-    using Store_T = tbb::concurrent_hash_map<K, StoreValue>;
-    Store_T store_;
-    
-    // Persistence file path
+    // The keydir, one of the KeyDirType implementations.
+    std::unique_ptr<KeyDir> store_;
+    // Open snapshots and the keydir entries they still need.
+    std::unique_ptr<Snapshots> snapshots_;
+
+    // Persistence file path. This is also the first segment, later segments
+    // live next to it as <persistence_file_>.<file_id>.
     std::string persistence_file_;
+    Options options_;
+    // Values by log position, in front of the segments. Null when turned off.
+    std::unique_ptr<ValueCache> value_cache_;
+    // Counters and latency histograms for stats().
+    std::unique_ptr<Metrics> metrics_;
+    std::chrono::nanoseconds restore_duration_{0};
+
+    // -----------------------
+    // SHARDS
+    // ------------------------
+    // With more than one shard the store only routes: every key lives in the
+    // shard store its hash picks, and all the store keeps of its own is the
+    // journal of batches that span shards. Unsharded stores have no shards_.
+    class Journal;
+    // Where a read across shards happens: a snapshot's position in each shard's
+    // log, or in the one log of an unsharded store. Empty reads the latest.
+    using Cut = std::vector<LogPos>;
+    static LogPos cutPos(const Cut& at, size_t shard) { return at.empty() ? kLatest : at[shard]; }
+    void openShards();
+    size_t shardOf(K key) const;
+    void writeParts(const WriteBatch& batch);
+    void openShardSnapshots(size_t shard, Cut& cut) const;
+    std::vector<std::optional<V>> multiGetShards(const std::vector<K>& keys, const Cut& at) const;
+    bool nextBatch(K& lo, K hi, const Cut& at, std::vector<std::pair<K, V>>& out) const;
+    void scanAt(K lo, K hi, const Cut& at, const std::function<bool(K key, const V& value)>& fn) const;
+
+    std::vector<std::unique_ptr<BasicKVStore>> shards_;
+    std::unique_ptr<Journal> journal_;
+    // One batch across shards at a time, and no snapshot opens in the middle
+    // of one.
+    mutable std::mutex batch_mutex_;
 
-    // Mutex on out_fd_
-    mutable std::mutex out_mutex_;
-    int out_fd_;
+    // -----------------------
+    // SEGMENTS
+    // ------------------------
+    // Segments written by appends get even file ids. A compacted segment takes
+    // the odd id right above the newest segment it replaced, which slots it in
+    // between that segment and the next one in log order.
+    //
+    // Readers hold segments_mutex_ for reading while they read from a segment
+    // so that a merge can't delete it out from under them. Appends and the
+    // group commit leader only touch segments that a merge will never delete.
+    mutable tbb::spin_rw_mutex segments_mutex_;
+    // Staging memory of kDirect segments, null in the other modes. Outlives
+    // the segments that hand their buffers back to it.
+    std::unique_ptr<BufferPool> buffer_pool_;
+    std::map<uint32_t, std::unique_ptr<LogFile>> segments_;
+
+    // -----------------------
+    // GROUP COMMIT state
+    // ------------------------
+    // Writers reserve their byte range of the log by bumping tail_ and pwrite
+    // into it in parallel. written_ trails behind as the end of the contiguous
+    // prefix of finished writes. Whoever finds no leader running becomes the
+    // leader, fdatasyncs everything up to written_ and wakes everyone whose
+    // record is now durable.
+    std::atomic<LogPos> tail_{0};  // end of the log including reserved ranges
+    std::atomic<bool> commit_failed_{false};
 
-#ifdef GROUP_COMMIT
-    std::atomic<std::streamoff> max_pending_offset_{0};
-    std::atomic<std::streamoff> committed_offset_{0};
-    std::atomic<int> skipped_fsyncs_{0};
-#endif
+    mutable std::mutex commit_mutex_;
+    std::condition_variable commit_cv_;   // a watermark moved, the log rolled or leadership freed up
+    std::condition_variable batch_cv_;    // a record was written, for a leader waiting on a batch
+    std::map<LogPos, LogPos> written_ranges_;  // finished writes past written_
+    std::map<uint32_t, std::streamoff> rolled_ends_;  // final size of rolled segments written_ hasn't left yet
+    LogPos written_ = 0;   // end of the contiguous prefix of written records
+    LogPos durable_ = 0;   // end of the log known to be on disk
+    uint64_t written_records_ = 0;
+    uint64_t durable_records_ = 0;
+    uint64_t written_bytes_ = 0;
+    uint64_t durable_bytes_ = 0;
+    // When the oldest record past durable_ was written, and when the running
+    // round picked what it syncs.
+    std::chrono::steady_clock::time_point unsynced_since_;
+    std::chrono::steady_clock::time_point round_start_;
+    size_t sync_waiters_ = 0;  // kSync writers waiting for a round
+    bool leader_active_ = false;
+    CommitStats commit_stats_;
+
+    // -----------------------
+    // FOLLOWER state
+    // ------------------------
+    // The primary publishes durable_ to its followers through a mapped file,
+    // <persistence_file>.durable. Null on sharded stores, which publish per
+    // shard.
+    class DurableMark;
+    std::unique_ptr<DurableMark> durable_mark_;
+    // A follower applies the primary's log up to follow_pos_, one catchUp()
+    // at a time, and mirrors it into tail_, written_ and durable_. Its keydir
+    // is based on the compacted segment follow_base_ (0 if none) once it has
+    // been pointed at that segment's records; segments older than it stay
+    // open until no entry points into them.
+    std::mutex follow_mutex_;
+    LogPos follow_pos_ = 0;
+    uint32_t follow_base_ = 0;
+    std::exception_ptr follow_error_;
+    bool follow_stopped_ = false;  // follow_error_ is set, guarded by commit_mutex_
+
+    // -----------------------
+    // FLUSHER state
+    // ------------------------
+    // Syncs the log behind kAsync writes. Started by the first one, and driven
+    // by flush_cv_ and commit_mutex_.
+    std::once_flag flusher_once_;
+    std::thread flusher_;
+    std::condition_variable flush_cv_;
+    bool stop_flusher_ = false;
+
+    // -----------------------
+    // ASYNC I/O state
+    // ------------------------
+    // putAsync records that have been written but aren't durable yet, keyed by
+    // the end of the record. They get their own group commit rounds, led from
+    // the completion threads, so nobody has to block waiting for a sync.
+    struct AsyncPut {
+        K key;
+        LogPos value_pos;
+        bool is_deleted;
+        std::shared_ptr<const std::string> record;  // for its size, and its value for the keydir
+        std::chrono::steady_clock::time_point start;
+        PutCallback callback;
+        unsigned epoch;  // the put's registration with snapshots_
+    };
+    std::map<LogPos, AsyncPut> async_puts_;  // guarded by commit_mutex_
+    size_t async_puts_pending_ = 0;           // putAsync calls whose callback hasn't run yet
+    mutable std::once_flag async_once_;
+    mutable std::unique_ptr<AsyncIo> async_io_;  // created by the first async call
+
+    // -----------------------
+    // BACKGROUND WORK state
+    // ------------------------
+    // A background thread writes hint files for newly sealed segments and runs
+    // the merger.
+    std::mutex compaction_mutex_;  // one merge (or batch of hint writes) at a time
+    std::mutex background_mutex_;
+    std::condition_variable background_cv_;
+    std::vector<uint32_t> unhinted_;  // sealed, durable segments without a hint yet
+    // With a preallocated log it also keeps the next segment ready under
+    // segmentPath(id) + ".tmp": spare_wanted_ is the id to prepare, and
+    // spare_ready_ the one that is. 0 for none.
+    uint32_t spare_wanted_ = 0;
+    uint32_t spare_ready_ = 0;
+    std::atomic<bool> stop_background_{false};  // also makes a running merge bail out
+    std::thread background_;
 };
+
+// The instantiations src/kvstore.cpp compiles. Others need kvstore_impl.h.
+extern template class BasicKVStore<StringValueTraits<uint32_t>>;
+extern template class BasicKVStore<StringValueTraits<uint64_t>>;
+
+using KVStore = BasicKVStore<>;
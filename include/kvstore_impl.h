@@ -0,0 +1,5410 @@
+#pragma once
+
+// BasicKVStore's implementation. src/kvstore.cpp compiles the instantiations
+// kvstore.h declares; include this instead to use a store with other traits.
+// The free helpers it needs live in kvstore::detail and aren't part of the API.
+
+#include "kvstore.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <filesystem>
+#include <limits>
+#include <sstream>
+#include <type_traits>
+#include <vector>
+#include <tbb/concurrent_set.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define KVSTORE_HAVE_IO_URING
+#endif
+#if defined(__SANITIZE_THREAD__)
+#include <sanitizer/tsan_interface.h>
+#endif
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+// ----------------------------------------------
+// KEY DIRECTORY
+// ----------------------------------------------
+// The key directory maps every key to the position of its latest value (or tombstone)
+// in the log. Entries only ever move forward in the log, except when a merge moves
+// them into a compacted segment, so every update is either a forward-only max or a
+// read-modify-write that compaction does with update().
+template <typename Traits>
+class BasicKVStore<Traits>::KeyDir {
+ public:
+    static const uint8_t kNotInline = 0xFF;
+
+    // pos is where the value's length field sits in the log, which can never be 0, so
+    // a pos of 0 means the key has no entry. A small value can come along with its
+    // position (see Options::inline_value_bytes); keydirs without room for it drop it.
+    struct Entry {
+        LogPos pos = 0;
+        bool is_deleted = false;
+        uint8_t inline_size = kNotInline;
+        char inline_value[kMaxInlineValue] = {};
+
+        bool hasInline() const { return inline_size != kNotInline; }
+        std::string_view inlineValue() const { return std::string_view(inline_value, inline_size); }
+        void setInline(std::string_view value) {
+            inline_size = value.size();
+            memcpy(inline_value, value.data(), value.size());
+        }
+    };
+    // A key's entry before and after an advance() or update().
+    struct Change {
+        Entry before;
+        Entry after;
+    };
+
+    virtual ~KeyDir() = default;
+
+    virtual Entry find(K key) const = 0;
+    // Sets key's entry unless it already points at entry.pos or later in the log.
+    virtual Change advance(K key, Entry entry) = 0;
+    // Replaces key's entry with fn(current entry) as one atomic step. fn may get called
+    // more than once when racing with other updates. Returning an entry with pos 0
+    // removes the key.
+    virtual Change update(K key, const std::function<Entry(Entry)>& fn) = 0;
+    // Calls fn with every key in [lo, hi] that has an entry, in key order, until fn
+    // returns false. Keys that get added or removed meanwhile may or may not show up.
+    virtual void scan(K lo, K hi, const std::function<bool(K key, Entry entry)>& fn) const = 0;
+};
+
+// Ordered set of the keys in a keydir that has no order of its own, for scan(). It's
+// a tbb::concurrent_set, i.e. a skiplist, which can be inserted into and walked
+// concurrently but not erased from. Keys that leave the keydir therefore stay behind
+// as ghosts that walks skip over, until they make up half the set and it gets rebuilt.
+// Only new keys and removed keys touch it, overwrites of a key don't.
+template <typename Traits>
+class BasicKVStore<Traits>::KeyIndex {
+ public:
+    // Call after every change to a key's entry in dir, outside of dir's own locks.
+    void changed(const KeyDir& dir, K key, const typename KeyDir::Change& change) {
+        if (change.before.pos == 0 && change.after.pos != 0) {
+            tbb::spin_rw_mutex::scoped_lock lock(rebuild_mutex_, false);
+            if (!keys_.insert(key).second) {
+                // A ghost came back.
+                ghosts_.fetch_sub(1, std::memory_order_relaxed);
+            }
+        } else if (change.before.pos != 0 && change.after.pos == 0) {
+            int64_t ghosts = ghosts_.fetch_add(1, std::memory_order_relaxed) + 1;
+            if (ghosts >= kMinRebuildGhosts && size_t(ghosts) * 2 >= keys_.size()) {
+                rebuild(dir);
+            }
+        }
+    }
+
+    void scan(const KeyDir& dir, K lo, K hi, const std::function<bool(K key, typename KeyDir::Entry entry)>& fn) const {
+        tbb::spin_rw_mutex::scoped_lock lock(rebuild_mutex_, false);
+        for (auto it = keys_.lower_bound(lo); it != keys_.end() && *it <= hi; ++it) {
+            typename KeyDir::Entry entry = dir.find(*it);
+            if (entry.pos != 0 && !fn(*it, entry)) {
+                return;
+            }
+        }
+    }
+
+ private:
+    static const int64_t kMinRebuildGhosts = 1024;
+
+    // Drops the ghosts. Holding rebuild_mutex_ for writing keeps new keys out until
+    // the new set is in place; they're in dir already and get inserted right after.
+    void rebuild(const KeyDir& dir) {
+        tbb::spin_rw_mutex::scoped_lock lock(rebuild_mutex_, true);
+        tbb::concurrent_set<K> live;
+        for (K key : keys_) {
+            if (dir.find(key).pos != 0) {
+                live.insert(key);
+            }
+        }
+        keys_.swap(live);
+        ghosts_.store(0, std::memory_order_relaxed);
+    }
+
+    mutable tbb::spin_rw_mutex rebuild_mutex_;
+    tbb::concurrent_set<K> keys_;
+    std::atomic<int64_t> ghosts_{0};  // keys in keys_ that dir has no entry for, roughly
+};
+
+// Value is StoreValue, or InlineStoreValue to keep small values inline.
+template <typename Traits>
+template <typename Value>
+class BasicKVStore<Traits>::HashKeyDir : public BasicKVStore<Traits>::KeyDir {
+ public:
+    using typename KeyDir::Entry;
+    using typename KeyDir::Change;
+    using KeyDir::kNotInline;
+
+    Entry find(K key) const override {
+        typename Map::const_accessor acc;
+        if (!map_.find(acc, key)) {
+            return Entry();
+        }
+        return toEntry(acc->second);
+    }
+
+    Change advance(K key, Entry entry) override {
+        typename Map::accessor acc;
+        Change change;
+        if (!map_.insert(acc, key)) {
+            change.before = get(acc);
+        }
+        change.after = change.before;
+        if (change.before.pos < entry.pos) {
+            set(acc, entry);
+            change.after = entry;
+        }
+        acc.release();
+        index_.changed(*this, key, change);
+        return change;
+    }
+
+    Change update(K key, const std::function<Entry(Entry)>& fn) override {
+        // Inserting up front keeps the key locked while fn runs even if it's new.
+        // Nobody can look at the placeholder before we fill it in or erase it.
+        typename Map::accessor acc;
+        Change change;
+        if (!map_.insert(acc, key)) {
+            change.before = get(acc);
+        }
+        change.after = fn(change.before);
+        if (change.after.pos == 0) {
+            map_.erase(acc);
+        } else if (change.after.pos != change.before.pos || change.after.is_deleted != change.before.is_deleted ||
+                   change.after.inline_size != change.before.inline_size) {
+            set(acc, change.after);
+        }
+        acc.release();
+        index_.changed(*this, key, change);
+        return change;
+    }
+
+    void scan(K lo, K hi, const std::function<bool(K key, Entry entry)>& fn) const override {
+        index_.scan(*this, lo, hi, fn);
+    }
+
+ private:
+    using Map = tbb::concurrent_hash_map<K, Value>;
+
+    static Entry toEntry(const Value& value) {
+        Entry entry{makePos(value.file_id, value.offset), value.is_deleted};
+        if constexpr (std::is_same_v<Value, InlineStoreValue>) {
+            if (value.inline_size != kNotInline) {
+                entry.setInline(std::string_view(value.inline_value, value.inline_size));
+            }
+        }
+        return entry;
+    }
+
+    static Entry get(const typename Map::accessor& acc) { return toEntry(acc->second); }
+
+    static void set(typename Map::accessor& acc, const Entry& entry) {
+        acc->second.file_id = posFile(entry.pos);
+        acc->second.offset = posOffset(entry.pos);
+        // acc->second.timestamp = 0;
+        acc->second.is_deleted = entry.is_deleted;
+        if constexpr (std::is_same_v<Value, InlineStoreValue>) {
+            acc->second.inline_size = entry.inline_size;
+            if (entry.hasInline()) {
+                memcpy(acc->second.inline_value, entry.inline_value, entry.inline_size);
+            }
+        }
+    }
+
+    Map map_;
+    KeyIndex index_;
+};
+
+// Base for the keydirs that pack an entry into a single 64-bit word: the position in
+// the low 63 bits and the tombstone flag in the top one. All updates are CAS loops on
+// that word.
+template <typename Traits>
+class BasicKVStore<Traits>::PackedKeyDir : public BasicKVStore<Traits>::KeyDir {
+ protected:
+    using typename KeyDir::Entry;
+    using typename KeyDir::Change;
+
+    static const uint64_t kDeletedBit = uint64_t(1) << 63;
+    using Slot = std::atomic<uint64_t>;
+
+    static uint64_t pack(Entry entry) { return entry.pos | (entry.is_deleted ? kDeletedBit : 0); }
+    static Entry unpack(uint64_t word) { return {word & ~kDeletedBit, (word & kDeletedBit) != 0}; }
+
+    static Change advanceSlot(Slot& slot, Entry entry) {
+        uint64_t desired = pack(entry);
+        uint64_t current = slot.load(std::memory_order_acquire);
+        // A lock-free max on the position, an empty slot is 0 and loses to everything.
+        while ((current & ~kDeletedBit) < entry.pos &&
+               !slot.compare_exchange_weak(current, desired, std::memory_order_acq_rel)) {
+        }
+        Entry before = unpack(current);
+        return {before, before.pos < entry.pos ? entry : before};
+    }
+
+    static Change updateSlot(Slot& slot, const std::function<Entry(Entry)>& fn) {
+        uint64_t current = slot.load(std::memory_order_acquire);
+        while (true) {
+            uint64_t desired = pack(fn(unpack(current)));
+            if (desired == current || slot.compare_exchange_weak(current, desired, std::memory_order_acq_rel)) {
+                return {unpack(current), unpack(desired)};
+            }
+        }
+    }
+};
+
+template <typename Traits>
+class BasicKVStore<Traits>::PagedKeyDir : public BasicKVStore<Traits>::PackedKeyDir {
+ public:
+    using typename PackedKeyDir::Entry;
+    using typename PackedKeyDir::Change;
+    using typename PackedKeyDir::Slot;
+    using PackedKeyDir::unpack;
+    using PackedKeyDir::advanceSlot;
+    using PackedKeyDir::updateSlot;
+
+    PagedKeyDir() : pages_(new std::atomic<Slot*>[kNumPages]) {
+        for (size_t i = 0; i < kNumPages; i++) {
+            pages_[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~PagedKeyDir() override {
+        for (size_t i = 0; i < kNumPages; i++) {
+            if (Slot* page = pages_[i].load(std::memory_order_relaxed)) {
+                munmap(page, kPageSize * sizeof(Slot));
+            }
+        }
+    }
+
+    Entry find(K key) const override {
+        Slot* page = pages_[key >> kPageBits].load(std::memory_order_acquire);
+        return page ? unpack(page[key & (kPageSize - 1)].load(std::memory_order_acquire)) : Entry();
+    }
+
+    Change advance(K key, Entry entry) override { return advanceSlot(slot(key), entry); }
+
+    Change update(K key, const std::function<Entry(Entry)>& fn) override { return updateSlot(slot(key), fn); }
+
+    // Already in key order, so this just walks the pages, skipping the missing ones.
+    void scan(K lo, K hi, const std::function<bool(K key, Entry entry)>& fn) const override {
+        for (uint64_t page_index = lo >> kPageBits; page_index <= (hi >> kPageBits); page_index++) {
+            const Slot* page = pages_[page_index].load(std::memory_order_acquire);
+            if (!page) {
+                continue;
+            }
+            uint64_t first = std::max<uint64_t>(lo, page_index << kPageBits);
+            uint64_t last = std::min<uint64_t>(hi, ((page_index + 1) << kPageBits) - 1);
+            for (uint64_t key = first; key <= last; key++) {
+                uint64_t word = page[key & (kPageSize - 1)].load(std::memory_order_acquire);
+                if (word != 0 && !fn(K(key), unpack(word))) {
+                    return;
+                }
+            }
+        }
+    }
+
+ private:
+    // 64Ki entries (512 KiB) per page, and 64Ki pages to cover every 32-bit key.
+    static const int kPageBits = 16;
+    static const size_t kPageSize = size_t(1) << kPageBits;
+    static const size_t kNumPages = (uint64_t(1) << 32) >> kPageBits;
+
+    Slot& slot(K key) {
+        std::atomic<Slot*>& page_ref = pages_[key >> kPageBits];
+        Slot* page = page_ref.load(std::memory_order_acquire);
+        if (!page) {
+            // Anonymous memory comes zeroed and only takes up space once touched, so
+            // a page that only a few keys land in costs a few KiB rather than 512.
+            void* addr = mmap(nullptr, kPageSize * sizeof(Slot), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                              -1, 0);
+            if (addr == MAP_FAILED) {
+                throw std::runtime_error("Failed to allocate keydir page");
+            }
+            Slot* fresh = static_cast<Slot*>(addr);
+            if (page_ref.compare_exchange_strong(page, fresh, std::memory_order_acq_rel)) {
+                page = fresh;
+            } else {
+                // Someone else put the page in first.
+                munmap(addr, kPageSize * sizeof(Slot));
+            }
+        }
+        return page[key & (kPageSize - 1)];
+    }
+
+    std::unique_ptr<std::atomic<Slot*>[]> pages_;
+};
+
+// Keys and entries live in two parallel arrays, 12 bytes per slot. Claiming a slot for
+// a new key is a CAS on the key array. Removed keys keep their slot with an empty
+// entry until the next time the table grows. Growing rehashes everything under
+// resize_mutex_ held for writing; every other operation holds it for reading, so they
+// only contend on it while a resize is going on.
+template <typename Traits>
+class BasicKVStore<Traits>::OpenKeyDir : public BasicKVStore<Traits>::PackedKeyDir {
+ public:
+    using typename PackedKeyDir::Entry;
+    using typename PackedKeyDir::Change;
+    using typename PackedKeyDir::Slot;
+    using PackedKeyDir::unpack;
+    using PackedKeyDir::advanceSlot;
+    using PackedKeyDir::updateSlot;
+
+    OpenKeyDir() { table_ = Table(kInitialCapacity); }
+
+    Entry find(K key) const override {
+        tbb::spin_rw_mutex::scoped_lock lock(resize_mutex_, false);
+        const Slot* slot = const_cast<OpenKeyDir*>(this)->lookup(key, false);
+        return slot ? unpack(slot->load(std::memory_order_acquire)) : Entry();
+    }
+
+    Change advance(K key, Entry entry) override {
+        Change change;
+        {
+            tbb::spin_rw_mutex::scoped_lock lock(resize_mutex_, false);
+            change = advanceSlot(*lookup(key, true), entry);
+        }
+        index_.changed(*this, key, change);
+        maybeGrow();
+        return change;
+    }
+
+    Change update(K key, const std::function<Entry(Entry)>& fn) override {
+        Change change;
+        {
+            tbb::spin_rw_mutex::scoped_lock lock(resize_mutex_, false);
+            change = updateSlot(*lookup(key, true), fn);
+        }
+        index_.changed(*this, key, change);
+        maybeGrow();
+        return change;
+    }
+
+    void scan(K lo, K hi, const std::function<bool(K key, Entry entry)>& fn) const override {
+        index_.scan(*this, lo, hi, fn);
+    }
+
+ private:
+    // Marks a free slot in the key array. That key's entry lives in empty_key_entry_.
+    static const K kEmptyKey = ~K(0);
+    static const size_t kInitialCapacity = 1024;
+
+    struct Table {
+        Table() = default;
+        explicit Table(size_t capacity)
+            : mask(capacity - 1), keys(new std::atomic<K>[capacity]), entries(new Slot[capacity]()) {
+            for (size_t i = 0; i < capacity; i++) {
+                keys[i].store(kEmptyKey, std::memory_order_relaxed);
+            }
+        }
+        size_t mask = 0;
+        std::unique_ptr<std::atomic<K>[]> keys;
+        std::unique_ptr<Slot[]> entries;
+    };
+
+    static size_t hash(K key) { return (key * 0x9E3779B97F4A7C15ull) >> 32; }
+
+    // Finds key's slot, claiming a free one for it if claim is set. Returns nullptr if
+    // the key isn't there and claim isn't set. Caller holds resize_mutex_.
+    Slot* lookup(K key, bool claim) {
+        if (key == kEmptyKey) {
+            return &empty_key_entry_;
+        }
+        for (size_t i = hash(key) & table_.mask;; i = (i + 1) & table_.mask) {
+            K current = table_.keys[i].load(std::memory_order_acquire);
+            if (current == kEmptyKey) {
+                if (!claim) {
+                    return nullptr;
+                }
+                if (table_.keys[i].compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+                    used_.fetch_add(1, std::memory_order_relaxed);
+                    return &table_.entries[i];
+                }
+                // Lost the slot, maybe to the same key.
+            }
+            if (current == key) {
+                return &table_.entries[i];
+            }
+        }
+    }
+
+    // Keeps the table at most 70% full. Writers that come in while a resize is pending
+    // can push it a little past that before they block, which is fine since the table
+    // only has to have a free slot for each of them.
+    void maybeGrow() {
+        if (used_.load(std::memory_order_relaxed) * 10 < (table_size_.load(std::memory_order_relaxed)) * 7) {
+            return;
+        }
+        tbb::spin_rw_mutex::scoped_lock lock(resize_mutex_, true);
+        size_t capacity = table_.mask + 1;
+        if (used_.load(std::memory_order_relaxed) * 10 < capacity * 7) {
+            return;
+        }
+        size_t live = 0;
+        for (size_t i = 0; i < capacity; i++) {
+            live += table_.keys[i].load(std::memory_order_relaxed) != kEmptyKey &&
+                    table_.entries[i].load(std::memory_order_relaxed) != 0;
+        }
+        // Removed keys get dropped on the way, so only grow if the live ones need it.
+        size_t new_capacity = capacity;
+        while (live * 10 >= new_capacity * 5) {
+            new_capacity *= 2;
+        }
+        Table table(new_capacity);
+        for (size_t i = 0; i < capacity; i++) {
+            K key = table_.keys[i].load(std::memory_order_relaxed);
+            uint64_t entry = table_.entries[i].load(std::memory_order_relaxed);
+            if (key == kEmptyKey || entry == 0) {
+                continue;
+            }
+            size_t j = hash(key) & table.mask;
+            while (table.keys[j].load(std::memory_order_relaxed) != kEmptyKey) {
+                j = (j + 1) & table.mask;
+            }
+            table.keys[j].store(key, std::memory_order_relaxed);
+            table.entries[j].store(entry, std::memory_order_relaxed);
+        }
+        table_ = std::move(table);
+        table_size_.store(new_capacity, std::memory_order_relaxed);
+        used_.store(live, std::memory_order_relaxed);
+    }
+
+    mutable tbb::spin_rw_mutex resize_mutex_;
+    Table table_;
+    std::atomic<size_t> table_size_{kInitialCapacity};  // for checking the load without the lock
+    std::atomic<size_t> used_{0};  // slots with a key in them
+    Slot empty_key_entry_{0};
+    KeyIndex index_;
+};
+
+// ----------------------------------------------
+// STATS
+// ----------------------------------------------
+// Counters and latency histograms behind stats(). Every thread bumps the cells of its
+// own shard, so instrumenting the hot paths costs a relaxed add on a cache line that
+// nobody else is writing to, and only stats() reads all the shards.
+template <typename Traits>
+class BasicKVStore<Traits>::Metrics {
+ public:
+    enum Counter {
+        kPuts,
+        kRemoves,
+        kWrites,
+        kGets,
+        kMultiGets,
+        kScans,
+        kAsyncPuts,
+        kAsyncGets,
+        kBytesAppended,
+        // The rest can go down as well as up.
+        kKeys,
+        kTombstones,
+        kInlineValues,
+        kLogRecords,   // records in the log
+        kDeadRecords,  // of those, the ones the keydir doesn't point at
+        kNumCounters,
+    };
+    enum Latency {
+        kAppendLatency,
+        kFsyncLatency,
+        kFileReadLatency,
+        kDurableLag,
+        kNumLatencies,
+    };
+
+    Metrics() : shards_(new Shard[kNumShards]()) {}
+
+    void add(Counter counter, int64_t n = 1) {
+        shard().counters[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void record(Latency latency, std::chrono::steady_clock::time_point start) {
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        Histogram& histogram = shard().latencies[latency];
+        histogram.buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        histogram.sum.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t max = histogram.max.load(std::memory_order_relaxed);
+        while (max < ns && !histogram.max.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+        }
+    }
+
+    // Keeps the keydir counts in step with a change to a key's entry.
+    void countChange(const typename KeyDir::Change& change) {
+        int64_t keys = (change.after.pos != 0) - (change.before.pos != 0);
+        int64_t tombstones = (change.after.pos != 0 && change.after.is_deleted) -
+                             (change.before.pos != 0 && change.before.is_deleted);
+        int64_t inline_values = (change.after.pos != 0 && change.after.hasInline()) -
+                                (change.before.pos != 0 && change.before.hasInline());
+        if (keys != 0) {
+            add(kKeys, keys);
+        }
+        if (tombstones != 0) {
+            add(kTombstones, tombstones);
+        }
+        if (inline_values != 0) {
+            add(kInlineValues, inline_values);
+        }
+    }
+
+    // Sums a counter over the shards. Counters that go down can come out slightly
+    // negative while racing with updates, those read as 0.
+    uint64_t total(Counter counter) const {
+        int64_t sum = 0;
+        for (size_t i = 0; i < kNumShards; i++) {
+            sum += shards_[i].counters[counter].load(std::memory_order_relaxed);
+        }
+        return std::max<int64_t>(sum, 0);
+    }
+
+    // Merges a histogram over the shards of every one of metrics, which is more
+    // than one for a sharded store.
+    static LatencyStats latency(const std::vector<const Metrics*>& metrics, Latency latency) {
+        std::vector<uint64_t> buckets(kNumBuckets);
+        LatencyStats stats;
+        uint64_t sum = 0;
+        for (const Metrics* m : metrics) {
+            for (size_t i = 0; i < kNumShards; i++) {
+                const Histogram& histogram = m->shards_[i].latencies[latency];
+                for (size_t b = 0; b < kNumBuckets; b++) {
+                    buckets[b] += histogram.buckets[b].load(std::memory_order_relaxed);
+                }
+                sum += histogram.sum.load(std::memory_order_relaxed);
+                stats.max = std::max(stats.max, histogram.max.load(std::memory_order_relaxed));
+            }
+        }
+        for (uint64_t count : buckets) {
+            stats.count += count;
+        }
+        if (stats.count == 0) {
+            return stats;
+        }
+        stats.mean = sum / stats.count;
+        auto percentile = [&](double p) {
+            uint64_t target = std::max<uint64_t>(1, std::ceil(p * stats.count));
+            uint64_t seen = 0;
+            for (size_t b = 0; b < kNumBuckets; b++) {
+                seen += buckets[b];
+                if (seen >= target) {
+                    return std::min(bucketEnd(b), stats.max);
+                }
+            }
+            return stats.max;
+        };
+        stats.p50 = percentile(0.5);
+        stats.p99 = percentile(0.99);
+        stats.p999 = percentile(0.999);
+        return stats;
+    }
+
+ private:
+    static const size_t kNumShards = 16;
+    // Log-linear buckets: the highest set bit of a value and the kSubBucketBits bits
+    // below it pick the bucket, so a bucket spans at most 1/16th of its values. Values
+    // of 2^40 ns (18 minutes) and up share the last bucket.
+    static const int kSubBucketBits = 4;
+    static const uint64_t kSubBuckets = 1 << kSubBucketBits;
+    static const int kMaxBits = 40;
+    static const size_t kNumBuckets = (kMaxBits - kSubBucketBits + 1) * kSubBuckets;
+
+    static size_t bucket(uint64_t value) {
+        value = std::min(value, (uint64_t(1) << kMaxBits) - 1);
+        if (value < kSubBuckets) {
+            return value;
+        }
+        int shift = 63 - __builtin_clzll(value) - kSubBucketBits;
+        return ((shift + 1) << kSubBucketBits) + ((value >> shift) & (kSubBuckets - 1));
+    }
+
+    // Largest value that lands in bucket b.
+    static uint64_t bucketEnd(size_t b) {
+        if (b < kSubBuckets) {
+            return b;
+        }
+        int shift = (b >> kSubBucketBits) - 1;
+        return ((kSubBuckets + (b & (kSubBuckets - 1)) + 1) << shift) - 1;
+    }
+
+    struct Histogram {
+        std::atomic<uint64_t> buckets[kNumBuckets];
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+    };
+
+    struct alignas(64) Shard {
+        std::atomic<int64_t> counters[kNumCounters];
+        Histogram latencies[kNumLatencies];
+    };
+
+    // Threads are dealt shards round robin as they first show up.
+    Shard& shard() {
+        static std::atomic<size_t> next_shard{0};
+        thread_local size_t index = next_shard.fetch_add(1, std::memory_order_relaxed) % kNumShards;
+        return shards_[index];
+    }
+
+    std::unique_ptr<Shard[]> shards_;
+};
+
+// ----------------------------------------------
+// SNAPSHOTS
+// ----------------------------------------------
+// A snapshot sees the store as of a position P in the log: for every key, the latest
+// record before P. Two things make that work without stopping writers:
+//
+// - Versions. While a snapshot is open, a writer that moves a key's entry forward
+//   records the entry it replaced, along with the position of the record that replaced
+//   it. A snapshot read that finds the key's entry at or past P looks for the version
+//   that was current at P. Writers do the move and the record under a striped lock so
+//   a read never sees one without the other. With no snapshot open none of this
+//   happens and a write costs one check of an atomic.
+// - Writer epochs. Writers stay registered from before they reserve their spot in the
+//   log until the keydir points at their record. Opening a snapshot waits out every
+//   writer that registered before it flipped the epoch, once so that all writers from
+//   then on see the snapshot and keep versions, and once more after picking P so that
+//   every record before P is in the keydir by the time the snapshot is used.
+//
+// Compaction rewrites positions and deletes segments, which would pull old versions
+// out from under a snapshot, so it doesn't run while one is open.
+template <typename Traits>
+class BasicKVStore<Traits>::Snapshots {
+ public:
+    // Registers a writer for as long as it's in scope.
+    class Writer {
+     public:
+        explicit Writer(Snapshots& snapshots) : snapshots_(snapshots), epoch_(snapshots.enter()) {}
+        ~Writer() { snapshots_.leave(epoch_); }
+        Writer(const Writer&) = delete;
+        Writer& operator=(const Writer&) = delete;
+
+     private:
+        Snapshots& snapshots_;
+        unsigned epoch_;
+    };
+
+    Snapshots() : writers_(new Shard[kNumShards]()) {}
+
+    unsigned enter() {
+        while (true) {
+            unsigned epoch = epoch_.load();
+            std::atomic<int64_t>& writers = shard().writers[epoch & 1];
+            writers.fetch_add(1);
+            // Made it in before the epoch flipped, so a snapshot that flips it waits for us.
+            if (epoch_.load() == epoch) {
+                return epoch;
+            }
+            writers.fetch_sub(1);
+        }
+    }
+
+    void leave(unsigned epoch) { shard().writers[epoch & 1].fetch_sub(1, std::memory_order_release); }
+
+    // Moves key's entry forward like KeyDir::advance, keeping the old entry around
+    // if a snapshot might need it.
+    typename KeyDir::Change advance(KeyDir& dir, K key, typename KeyDir::Entry entry) {
+        if (open_.load() == 0) {
+            return dir.advance(key, entry);
+        }
+        Stripe& stripe = stripes_[stripeOf(key)];
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        typename KeyDir::Change change = dir.advance(key, entry);
+        if (open_.load() == 0) {
+            // The last snapshot closed meanwhile. close() drops open_ before it sweeps
+            // the stripes, so a version kept now might never get swept.
+            return change;
+        }
+        if (change.before.pos != 0 && change.before.pos != change.after.pos) {
+            stripe.versions[key].push_back({change.before, change.after.pos});
+            versions_.fetch_add(1, std::memory_order_relaxed);
+        } else if (entry.pos < change.after.pos) {
+            // A later record for the key got there first. Ours still is the key's
+            // entry between its own position and the next record's, so slot it in.
+            auto& versions = stripe.versions[key];
+            auto next = std::find_if(versions.begin(), versions.end(),
+                                     [&](const Version& version) { return version.entry.pos > entry.pos; });
+            if (next != versions.begin() && std::prev(next)->entry.pos == entry.pos) {
+                return change;
+            }
+            LogPos superseded_at = next == versions.end() ? change.after.pos : next->entry.pos;
+            if (next != versions.begin() && std::prev(next)->superseded_at > entry.pos) {
+                std::prev(next)->superseded_at = entry.pos;
+            }
+            versions.insert(next, {entry, superseded_at});
+            versions_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return change;
+    }
+
+    // key's entry as of position at, or its current one for kLatest.
+    typename KeyDir::Entry find(const KeyDir& dir, K key, LogPos at) const {
+        if (at == kLatest) {
+            return dir.find(key);
+        }
+        const Stripe& stripe = stripes_[stripeOf(key)];
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        typename KeyDir::Entry entry = dir.find(key);
+        if (entry.pos < at) {
+            return entry;
+        }
+        auto it = stripe.versions.find(key);
+        if (it != stripe.versions.end()) {
+            for (const auto& version : it->second) {
+                if (version.entry.pos < at && at < version.superseded_at) {
+                    return version.entry;
+                }
+            }
+        }
+        // The key didn't exist yet.
+        return typename KeyDir::Entry();
+    }
+
+    // Opens a snapshot at whatever position read_pos returns once the writers that
+    // could miss it are out of the way.
+    LogPos open(const std::function<LogPos()>& read_pos) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        open_.fetch_add(1);
+        flipEpoch();
+        LogPos pos = read_pos();
+        flipEpoch();
+        positions_.insert(pos);
+        return pos;
+    }
+
+    void close(LogPos pos) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        positions_.erase(positions_.find(pos));
+        open_.fetch_sub(1);
+        // Drop the versions no remaining snapshot can see. One is visible to the
+        // snapshots between its own position and the one of the record that replaced it.
+        for (Stripe& stripe : stripes_) {
+            std::lock_guard<std::mutex> stripe_lock(stripe.mutex);
+            for (auto it = stripe.versions.begin(); it != stripe.versions.end();) {
+                auto& versions = it->second;
+                size_t before = versions.size();
+                versions.erase(std::remove_if(versions.begin(), versions.end(),
+                                              [&](const Version& version) {
+                                                  auto p = positions_.upper_bound(version.entry.pos);
+                                                  return p == positions_.end() || *p >= version.superseded_at;
+                                              }),
+                               versions.end());
+                versions_.fetch_sub(before - versions.size(), std::memory_order_relaxed);
+                it = versions.empty() ? stripe.versions.erase(it) : std::next(it);
+            }
+        }
+    }
+
+    // For compaction. Keeps snapshots from opening for as long as the returned lock is
+    // held, unless one is open already, in which case the lock doesn't hold anything.
+    std::unique_lock<std::mutex> lockOutSnapshots() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (open_.load() != 0) {
+            lock.unlock();
+        }
+        return lock;
+    }
+
+    uint64_t openCount() const { return open_.load(std::memory_order_relaxed); }
+    uint64_t versionCount() const { return versions_.load(std::memory_order_relaxed); }
+
+ private:
+    static const size_t kNumShards = 16;
+    static const size_t kNumStripes = 64;
+
+    struct Version {
+        typename KeyDir::Entry entry;
+        LogPos superseded_at;  // position of the record that replaced it
+    };
+
+    struct Stripe {
+        mutable std::mutex mutex;
+        std::unordered_map<K, std::vector<Version>> versions;  // oldest first
+    };
+
+    // Writers registered under each parity of the epoch.
+    struct alignas(64) Shard {
+        std::atomic<int64_t> writers[2];
+    };
+
+    static size_t stripeOf(K key) { return (key * 0x9E3779B97F4A7C15ull) >> 58; }
+
+    // Threads are dealt shards round robin as they first show up.
+    Shard& shard() {
+        static std::atomic<size_t> next_shard{0};
+        thread_local size_t index = next_shard.fetch_add(1, std::memory_order_relaxed) % kNumShards;
+        return writers_[index];
+    }
+
+    // Starts a new epoch and waits for the writers of the old one to leave. The one
+    // before that was drained by the previous flip, and mutex_ keeps flips in order.
+    void flipEpoch() {
+        unsigned old_epoch = epoch_.fetch_add(1);
+        while (true) {
+            int64_t writers = 0;
+            for (size_t i = 0; i < kNumShards; i++) {
+                writers += writers_[i].writers[old_epoch & 1].load();
+            }
+            if (writers == 0) {
+                return;
+            }
+            // They're waiting on a group commit round at worst.
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+
+    std::mutex mutex_;  // opening and closing snapshots, and compaction's swap
+    std::multiset<LogPos> positions_;  // of the open snapshots
+    std::atomic<uint64_t> open_{0};
+    std::atomic<unsigned> epoch_{0};
+    std::unique_ptr<Shard[]> writers_;
+    Stripe stripes_[kNumStripes];
+    std::atomic<uint64_t> versions_{0};
+};
+
+template <typename Traits>
+BasicKVStore<Traits>::BasicKVStore(const std::string& persistence_file)
+    : BasicKVStore(persistence_file, Options()) {}
+
+template <typename Traits>
+BasicKVStore<Traits>::BasicKVStore(const std::string& persistence_file, const Options& options)
+    : persistence_file_(persistence_file), options_(options) {
+    if (options_.max_batch_size == 0) {
+        options_.max_batch_size = 1;
+    }
+    if (options_.segment_size == 0 || options_.segment_size >= (size_t(1) << (kOffsetBits - 1))) {
+        throw std::runtime_error("segment_size out of range");
+    }
+    if (options_.follower && options_.shards != 1) {
+        throw std::runtime_error("A follower follows one log, open one per shard of a sharded store");
+    }
+    if (options_.shards == 0) {
+        options_.shards = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (options_.inline_value_bytes > kMaxInlineValue) {
+        throw std::runtime_error("inline_value_bytes out of range");
+    }
+    if (options_.keydir != KeyDirType::kHashMap) {
+        options_.inline_value_bytes = 0;
+    }
+    snapshots_ = std::make_unique<Snapshots>();
+    metrics_ = std::make_unique<Metrics>();
+    if (options_.shards > 1) {
+        auto restore_start = std::chrono::steady_clock::now();
+        openShards();
+        restore_duration_ = std::chrono::steady_clock::now() - restore_start;
+        return;
+    }
+    switch (options_.keydir) {
+    case KeyDirType::kHashMap:
+        if (options_.inline_value_bytes > 0) {
+            store_ = std::make_unique<HashKeyDir<InlineStoreValue>>();
+        } else {
+            store_ = std::make_unique<HashKeyDir<StoreValue>>();
+        }
+        break;
+    case KeyDirType::kPagedArray:
+        // Its pages cover the 32-bit key space and no more.
+        if (sizeof(K) > sizeof(uint32_t)) {
+            throw std::runtime_error("kPagedArray keydir needs keys of at most 32 bits");
+        }
+        store_ = std::make_unique<PagedKeyDir>();
+        break;
+    case KeyDirType::kOpenAddressing:
+        store_ = std::make_unique<OpenKeyDir>();
+        break;
+    }
+    if (options_.value_cache_bytes > 0) {
+        value_cache_ = std::make_unique<ValueCache>(options_.value_cache_bytes);
+    }
+    auto restore_start = std::chrono::steady_clock::now();
+    if (options_.follower) {
+        openFollower();
+        restore_duration_ = std::chrono::steady_clock::now() - restore_start;
+        if (options_.follow_interval.count() > 0) {
+            background_ = std::thread([this] { followLoop(); });
+        }
+        return;
+    }
+    if (options_.log_mode == LogMode::kDirect) {
+        buffer_pool_ = std::make_unique<BufferPool>();
+    }
+    restore();
+    restore_duration_ = std::chrono::steady_clock::now() - restore_start;
+    durable_mark_ = std::make_unique<DurableMark>(persistence_file_ + ".durable", true);
+    durable_mark_->publish(durable_);
+    if (options_.log_mode != LogMode::kGrowing) {
+        spare_wanted_ = posFile(durable_) + 2;
+    }
+    if (options_.compaction_interval.count() > 0 || options_.write_hints || spare_wanted_ != 0) {
+        background_ = std::thread([this] { backgroundLoop(); });
+    }
+}
+
+template <typename Traits>
+BasicKVStore<Traits>::~BasicKVStore() {
+    if (flusher_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(commit_mutex_);
+            stop_flusher_ = true;
+        }
+        flush_cv_.notify_one();
+        flusher_.join();
+    }
+    if (async_io_) {
+        // Let every putAsync call back, then drain whatever else is in flight.
+        std::unique_lock<std::mutex> lock(commit_mutex_);
+        commit_cv_.wait(lock, [this] { return async_puts_pending_ == 0; });
+        lock.unlock();
+        async_io_.reset();
+    }
+    if (background_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(background_mutex_);
+            stop_background_ = true;
+        }
+        background_cv_.notify_all();
+        background_.join();
+    }
+    if (spare_ready_ != 0) {
+        std::error_code ec;
+        std::filesystem::remove(segmentPath(spare_ready_) + ".tmp", ec);
+    }
+    // Closing a preallocated log cleanly marks where its data ends, so that the next
+    // restore can append right there.
+    if (options_.log_mode != LogMode::kGrowing && shards_.empty() && !options_.follower && !commit_failed_ &&
+        durable_ == tail_.load()) {
+        if (!writeEndRecord(*findSegment(posFile(durable_)), posOffset(durable_))) {
+            std::cout << "Failed to mark the end of the log" << std::endl;
+        }
+    }
+}
+
+namespace kvstore::detail {
+
+// Writes all of buf at offset, retrying short writes.
+inline bool pwrite_fully(int fd, const char* buf, size_t size, std::streamoff offset) {
+    while (size > 0) {
+        ssize_t res = pwrite(fd, buf, size, offset);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += res;
+        size -= res;
+        offset += res;
+    }
+    return true;
+}
+
+// fsyncs the directory holding path so that files created in or renamed into it
+// survive a crash.
+inline void sync_directory(const std::string& path) {
+    std::filesystem::path dir = std::filesystem::path(path).parent_path();
+    int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        throw std::runtime_error("Failed to open persistence directory");
+    }
+    int res = fsync(fd);
+    close(fd);
+    if (res != 0) {
+        throw std::runtime_error("Failed to sync persistence directory");
+    }
+}
+
+// ----------------------------------------------
+// CHECKSUMS
+// ----------------------------------------------
+// Records are checksummed with CRC32C over everything after the checksum field: the
+// key, the length and the value. The CRC instructions on x86 (SSE4.2) and ARMv8 are
+// used when the CPU has them, otherwise a table does it a byte at a time.
+
+inline uint32_t crc32c_portable(uint32_t crc, const char* data, size_t size) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> table{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; bit++) {
+                value = (value >> 1) ^ (value & 1 ? 0x82F63B78 : 0);
+            }
+            table[i] = value;
+        }
+        return table;
+    }();
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) inline uint32_t crc32c_hardware(uint32_t crc, const char* data, size_t size) {
+    uint64_t crc64 = crc;
+    for (; size >= sizeof(uint64_t); data += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = static_cast<uint32_t>(crc64);
+    for (; size > 0; data++, size--) {
+        crc = _mm_crc32_u8(crc, static_cast<uint8_t>(*data));
+    }
+    return crc;
+}
+
+inline bool have_crc32c_hardware() { return __builtin_cpu_supports("sse4.2"); }
+#elif defined(__aarch64__) && defined(__linux__)
+__attribute__((target("+crc"))) inline uint32_t crc32c_hardware(uint32_t crc, const char* data, size_t size) {
+    for (; size >= sizeof(uint64_t); data += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; size > 0; data++, size--) {
+        crc = __crc32cb(crc, static_cast<uint8_t>(*data));
+    }
+    return crc;
+}
+
+inline bool have_crc32c_hardware() { return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0; }
+#else
+inline uint32_t crc32c_hardware(uint32_t crc, const char* data, size_t size) {
+    return crc32c_portable(crc, data, size);
+}
+
+inline bool have_crc32c_hardware() { return false; }
+#endif
+
+inline uint32_t (*const crc32c_impl)(uint32_t, const char*, size_t) =
+    have_crc32c_hardware() ? crc32c_hardware : crc32c_portable;
+
+// Extends crc, a CRC32C of some earlier bytes (0 for none), over [data, data + size).
+inline uint32_t crc32c(uint32_t crc, const char* data, size_t size) {
+    return ~crc32c_impl(~crc, data, size);
+}
+
+// Helper function to compute the checksum of a record. Key fields are sizeof(K)
+// wide, so callers name K instead of letting it be deduced from whatever integer a
+// batch length or hole size happens to be held in.
+template <typename K>
+uint32_t make_checksum(std::common_type_t<K> key, uint32_t value_length, std::optional<std::string_view> value) {
+    char header[sizeof(key) + sizeof(value_length)];
+    memcpy(header, &key, sizeof(key));
+    memcpy(header + sizeof(key), &value_length, sizeof(value_length));
+    uint32_t crc = crc32c(0, header, sizeof(header));
+    return value ? crc32c(crc, value->data(), value->size()) : crc;
+}
+
+// Checksum of records in segments from before there were segment headers. It XORs
+// std::hash values, so those files are only readable with the standard library that
+// wrote them.
+template <typename K>
+uint32_t make_legacy_checksum(std::common_type_t<K> key, uint32_t value_length, std::optional<std::string_view> value) {
+    std::hash<K> key_hash;
+    std::hash<uint32_t> value_length_hash;
+    // Hashes the same as std::hash<std::string> without needing a string.
+    std::hash<std::string_view> value_hash;
+    return key_hash(key) ^ value_length_hash(value_length) ^ (value ? value_hash(*value) : 0);
+}
+
+template <typename K>
+using ChecksumFn = uint32_t (*)(K key, uint32_t value_length, std::optional<std::string_view> value);
+
+// Every segment starts with a header naming its format:
+//
+// | magic | version | checksum |
+//
+// where checksum is the CRC32C of the magic and version. Segments without one are
+// from before this format and use the legacy checksum. The low byte of the version
+// is the format's, the rest tags the record layout, see kSegmentVersionOf.
+inline const uint32_t kSegmentMagic = 0x4B565347;  // "KVSG"
+inline const uint32_t kSegmentVersion = 2;
+inline const std::streamoff kSegmentHeaderSize = 3 * sizeof(uint32_t);
+// Version bit of segments whose records have no length field, see Layout.
+inline const uint32_t kSegmentFixedStride = 1u << 15;
+
+// Segment version of a store with the given traits. KVStore's records are untagged,
+// other key widths and fixed value sizes put theirs above the format version so that
+// no store reads records laid out for another.
+template <typename Traits>
+constexpr uint32_t kSegmentVersionOf =
+    sizeof(typename Traits::K) == sizeof(uint32_t) && Traits::kValueSize == 0
+        ? kSegmentVersion
+        : kSegmentVersion | uint32_t(sizeof(typename Traits::K)) << 8 | uint32_t(Traits::kValueSize) << 16 |
+              (Traits::kValueSize != 0 ? kSegmentFixedStride : 0);
+
+inline void encode_segment_header(std::string& out, uint32_t version) {
+    char header[kSegmentHeaderSize];
+    memcpy(header, &kSegmentMagic, sizeof(uint32_t));
+    memcpy(header + sizeof(uint32_t), &version, sizeof(uint32_t));
+    uint32_t checksum = crc32c(0, header, 2 * sizeof(uint32_t));
+    memcpy(header + 2 * sizeof(uint32_t), &checksum, sizeof(uint32_t));
+    out.append(header, sizeof(header));
+}
+
+// Whether data starts with a segment header of the given version. A header of the
+// current format but another record layout throws instead of passing the segment
+// off as a legacy one, which would get it truncated.
+inline bool parse_segment_header(const char* data, size_t size, uint32_t expected_version) {
+    if (size < static_cast<size_t>(kSegmentHeaderSize)) {
+        return false;
+    }
+    uint32_t magic, version, checksum;
+    memcpy(&magic, data, sizeof(magic));
+    memcpy(&version, data + sizeof(uint32_t), sizeof(version));
+    memcpy(&checksum, data + 2 * sizeof(uint32_t), sizeof(checksum));
+    if (magic != kSegmentMagic || checksum != crc32c(0, data, 2 * sizeof(uint32_t))) {
+        return false;
+    }
+    if (version != expected_version && (version & 0xFF) == kSegmentVersion) {
+        throw std::runtime_error("Segment was written by a store with another key or value type");
+    }
+    return version == expected_version;
+}
+
+// Whether the segment at path has a format header. Empty segments don't.
+inline bool has_segment_header(const std::string& path, uint32_t version) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw std::runtime_error("Failed to open persistence file");
+    }
+    char header[kSegmentHeaderSize];
+    ssize_t res = pread(fd, header, sizeof(header), 0);
+    close(fd);
+    return res == kSegmentHeaderSize && parse_segment_header(header, res, version);
+}
+
+// Block size O_DIRECT writes are aligned to and padded out to.
+inline const std::streamoff kDirectBlockSize = 4096;
+
+inline std::streamoff align_down(std::streamoff offset, std::streamoff alignment) {
+    return offset / alignment * alignment;
+}
+
+inline std::streamoff align_up(std::streamoff offset, std::streamoff alignment) {
+    return align_down(offset + alignment - 1, alignment);
+}
+
+}  // namespace kvstore::detail
+
+// Where the fields of a record are. Records of variable-size values are
+//
+// | checksum | key | length | value |
+//
+// and the length field also tells tombstones, skip records, batch headers and end
+// records apart. Records of fixed-size values leave it out and are all kStride bytes,
+// so a segment is an array of them after its header. A record without a value keeps
+// the slot one would have, zeroed, and what kind of record it is only goes into the
+// checksum: that is computed as if the length field were there, and a reader tries
+// the kinds until one matches. Either way a record's keydir position is where its
+// length field is or would be, right after the key.
+template <typename Traits>
+struct BasicKVStore<Traits>::Layout {
+    static constexpr bool kFixed = Traits::kValueSize != 0;
+    // The checksum and the key.
+    static constexpr size_t kPrefixSize = sizeof(uint32_t) + sizeof(K);
+    // How far a record's value is past its keydir position.
+    static constexpr size_t kLengthSize = kFixed ? 0 : sizeof(uint32_t);
+    // Everything but the value.
+    static constexpr size_t kHeaderSize = kPrefixSize + kLengthSize;
+    // Size of a tombstone, a batch header or an end record, and with fixed-size
+    // values of every record.
+    static constexpr size_t kStride = kHeaderSize + Traits::kValueSize;
+    static constexpr size_t kMaxRecordSize = kFixed ? kStride : kHeaderSize + kMaxValueSize;
+
+    // Size of a record whose length field is value_length, which must not be kSkip.
+    static size_t recordSize(uint32_t value_length) {
+        return kFixed ? kStride : kHeaderSize + (value_length <= kMaxValueSize ? value_length : 0);
+    }
+
+    // Encodes the header of a record into the kHeaderSize bytes at out.
+    static void encodeHeader(char* out, uint32_t checksum, K key, uint32_t value_length) {
+        memcpy(out, &checksum, sizeof(checksum));
+        memcpy(out + sizeof(checksum), &key, sizeof(key));
+        if (!kFixed) {
+            memcpy(out + kPrefixSize, &value_length, sizeof(value_length));
+        }
+    }
+
+    // Appends a record to out, padded out to kStride if it has no value of its own.
+    static void encode(std::string& out, uint32_t checksum, K key, uint32_t value_length, std::string_view value) {
+        char header[kHeaderSize];
+        encodeHeader(header, checksum, key, value_length);
+        out.append(header, sizeof(header));
+        out.append(value.data(), value.size());
+        out.append(kHeaderSize + value.size() < kStride ? kStride - kHeaderSize - value.size() : 0, '\0');
+    }
+};
+
+// Aligned chunks of memory that kDirect segments stage their records in. Chunks go
+// back on a free list once their data is on disk, so appends stop allocating once the
+// pool has grown to what is in flight.
+template <typename Traits>
+class BasicKVStore<Traits>::BufferPool {
+ public:
+    static const size_t kChunkSize = 1 << 20;
+
+    ~BufferPool() {
+        for (char* chunk : free_) {
+            free(chunk);
+        }
+    }
+
+    // A zeroed chunk of kChunkSize bytes aligned to kDirectBlockSize.
+    char* get() {
+        char* chunk = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!free_.empty()) {
+                chunk = free_.back();
+                free_.pop_back();
+            }
+        }
+        if (!chunk) {
+            chunk = static_cast<char*>(aligned_alloc(kvstore::detail::kDirectBlockSize, kChunkSize));
+            if (!chunk) {
+                throw std::bad_alloc();
+            }
+        }
+        memset(chunk, 0, kChunkSize);
+        return chunk;
+    }
+
+    void put(char* chunk) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(chunk);
+    }
+
+ private:
+    std::mutex mutex_;
+    std::vector<char*> free_;
+};
+
+// One segment of the log. Keeps one descriptor open for the lifetime of the segment,
+// read-only for sealed segments, and maps the durable part of the segment in
+// fixed-size chunks. A chunk is only mapped once the file is known to extend past its
+// end and is never unmapped or remapped while the segment is open, so readers can use
+// it without any locking as the file grows.
+template <typename Traits>
+class BasicKVStore<Traits>::LogFile {
+ public:
+    LogFile(const std::string& path, uint32_t file_id, bool writable, size_t chunk_size, std::streamoff capacity)
+        : path_(path), file_id_(file_id), chunk_size_(chunk_size) {
+        fd_ = writable ? open(path.c_str(), O_RDWR | O_CREAT, 0644) : open(path.c_str(), O_RDONLY);
+        if (fd_ == -1) {
+            throw std::runtime_error("Failed to open persistence file");
+        }
+        if (chunk_size_ % sysconf(_SC_PAGESIZE) != 0) {
+            close(fd_);
+            throw std::runtime_error("mmap_chunk_size must be a multiple of the page size");
+        }
+        char header[kvstore::detail::kSegmentHeaderSize];
+        ssize_t res = pread(fd_, header, sizeof(header), 0);
+        try {
+            legacy_ = res > 0 &&
+                      !kvstore::detail::parse_segment_header(header, res, kvstore::detail::kSegmentVersionOf<Traits>);
+        } catch (...) {
+            close(fd_);
+            throw;
+        }
+        if (chunk_size_ > 0) {
+            max_chunks_ = capacity / chunk_size_ + 1;
+            chunks_.reset(new std::atomic<const char*>[max_chunks_]);
+            for (size_t i = 0; i < max_chunks_; i++) {
+                chunks_[i].store(nullptr, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    ~LogFile() {
+        for (size_t i = 0; i < mapped_chunks_; i++) {
+            munmap(const_cast<char*>(chunks_[i].load(std::memory_order_relaxed)), chunk_size_);
+        }
+        if (direct_fd_ != -1) {
+            for (const auto& chunk : staged_) {
+                pool_->put(chunk.second);
+            }
+            free(tail_block_);
+            close(direct_fd_);
+        }
+        close(fd_);
+    }
+
+    uint32_t id() const { return file_id_; }
+    const std::string& path() const { return path_; }
+    // Whether the segment predates segment headers and CRC32C checksums.
+    bool legacy() const { return legacy_; }
+
+    // Starts a new, empty segment off with the format header.
+    bool writeHeader() {
+        std::string header;
+        kvstore::detail::encode_segment_header(header, kvstore::detail::kSegmentVersionOf<Traits>);
+        legacy_ = false;
+        return write(header.data(), header.size(), 0);
+    }
+
+    // Final size of the segment once nothing more will be appended to it.
+    void seal(std::streamoff end) { sealed_end_ = end; }
+    std::streamoff sealedEnd() const { return sealed_end_; }
+
+    // Allocates the segment up to capacity bytes so that appends don't grow the file.
+    // With zero_fill the new range is written with zeros too, which turns the
+    // unwritten extents fallocate leaves into written ones; otherwise the first
+    // fdatasync over each extent still has to convert it. Zero filling syncs, so that
+    // the cost is all paid here.
+    bool preallocate(std::streamoff capacity, bool zero_fill) {
+        std::streamoff from = size();
+        if (from >= capacity) {
+            return true;
+        }
+        if (posix_fallocate(fd_, 0, capacity) != 0) {
+            return false;
+        }
+        if (zero_fill) {
+            static const std::vector<char> zeros(1 << 20);
+            for (std::streamoff offset = from; offset < capacity; offset += zeros.size()) {
+                size_t size = std::min<std::streamoff>(zeros.size(), capacity - offset);
+                if (!kvstore::detail::pwrite_fully(fd_, zeros.data(), size, offset)) {
+                    return false;
+                }
+            }
+            return fdatasync(fd_) == 0;
+        }
+        return true;
+    }
+
+    // Switches appends over to O_DIRECT, staged in pool's chunks, with the data ending
+    // at end. Bytes below end stay where they are.
+    void openDirect(BufferPool& pool, std::streamoff end) {
+        direct_fd_ = open(path_.c_str(), O_WRONLY | O_DIRECT);
+        if (direct_fd_ == -1) {
+            throw std::runtime_error("Failed to open persistence file for O_DIRECT");
+        }
+        pool_ = &pool;
+        const size_t block_size = kvstore::detail::kDirectBlockSize;
+        tail_block_ = static_cast<char*>(aligned_alloc(block_size, block_size));
+        if (!tail_block_) {
+            throw std::bad_alloc();
+        }
+        // The first block written out starts before end, so it starts with
+        // whatever is already in the file.
+        std::streamoff from = kvstore::detail::align_down(end, kvstore::detail::kDirectBlockSize);
+        staged_from_ = from;
+        std::vector<char> head(end - from);
+        if (read(from, head.data(), head.size()) != static_cast<ssize_t>(head.size())) {
+            throw std::runtime_error("Failed to read from persistence file");
+        }
+        stage(head.data(), head.size(), from);
+    }
+    bool direct() const { return direct_fd_ != -1; }
+
+    bool write(const char* buf, size_t size, std::streamoff offset) {
+        if (direct()) {
+            stage(buf, size, offset);
+            return true;
+        }
+        return kvstore::detail::pwrite_fully(fd_, buf, size, offset);
+    }
+
+    // Writes head followed by tail with one pwritev, so a record's header and value
+    // don't have to be copied together first.
+    bool write(std::string_view head, std::string_view tail, std::streamoff offset) {
+        if (direct()) {
+            stage(head.data(), head.size(), offset);
+            stage(tail.data(), tail.size(), offset + head.size());
+            return true;
+        }
+        iovec iov[2] = {{const_cast<char*>(head.data()), head.size()}, {const_cast<char*>(tail.data()), tail.size()}};
+        ssize_t res;
+        do {
+            res = pwritev(fd_, iov, 2, offset);
+        } while (res < 0 && errno == EINTR);
+        if (res < 0) {
+            return false;
+        }
+        // Short writes are rare enough to finish piecewise.
+        size_t done = res;
+        if (done < head.size()) {
+            return kvstore::detail::pwrite_fully(fd_, head.data() + done, head.size() - done, offset + done) &&
+                   kvstore::detail::pwrite_fully(fd_, tail.data(), tail.size(), offset + head.size());
+        }
+        done -= head.size();
+        return kvstore::detail::pwrite_fully(fd_, tail.data() + done, tail.size() - done, offset + head.size() + done);
+    }
+
+    // Makes everything written below end durable. Only a kDirect segment needs to
+    // know where that is: it writes the staged blocks from the last synced one up to
+    // end, the last one padded with zeros, before the fdatasync. One sync at a time.
+    bool sync(std::streamoff end) {
+        if (!direct()) {
+            return fdatasync(fd_) == 0;
+        }
+        std::streamoff from;
+        std::streamoff tail = kvstore::detail::align_down(end, kvstore::detail::kDirectBlockSize);
+        std::vector<std::pair<std::streamoff, const char*>> chunks;
+        {
+            std::lock_guard<std::mutex> lock(stage_mutex_);
+            from = staged_from_.load(std::memory_order_relaxed);
+            for (auto it = staged_.begin(); it != staged_.end() && it->first < tail; ++it) {
+                chunks.emplace_back(it->first, it->second);
+            }
+            // Writers are filling in the rest of the last block, so it goes out of a
+            // copy of its written part.
+            if (end > tail) {
+                memset(tail_block_, 0, kvstore::detail::kDirectBlockSize);
+                copyStaged(tail, tail_block_, end - tail);
+            }
+        }
+        for (const auto& chunk : chunks) {
+            std::streamoff begin = std::max(from, chunk.first);
+            std::streamoff stop = std::min<std::streamoff>(tail, chunk.first + BufferPool::kChunkSize);
+            if (begin < stop &&
+                !kvstore::detail::pwrite_fully(direct_fd_, chunk.second + (begin - chunk.first), stop - begin, begin)) {
+                return false;
+            }
+        }
+        if (end > tail &&
+            !kvstore::detail::pwrite_fully(direct_fd_, tail_block_, kvstore::detail::kDirectBlockSize, tail)) {
+            return false;
+        }
+        if (fdatasync(direct_fd_) != 0) {
+            return false;
+        }
+        // Nothing more gets appended to a sealed segment, so its last sync lets go
+        // of all of its staging.
+        bool sealed = end == sealed_end_;
+        std::lock_guard<std::mutex> lock(stage_mutex_);
+        staged_from_.store(sealed ? end : tail, std::memory_order_relaxed);
+        while (!staged_.empty() &&
+               (sealed || staged_.begin()->first + static_cast<std::streamoff>(BufferPool::kChunkSize) <= tail)) {
+            pool_->put(staged_.begin()->second);
+            staged_.erase(staged_.begin());
+        }
+        return true;
+    }
+
+    // Whether the record at offset may only be in the staging buffers.
+    bool staged(std::streamoff offset) const {
+        return direct() && offset >= staged_from_.load(std::memory_order_relaxed);
+    }
+
+    // Copies the record at offset, header and all, out of the staging buffers into
+    // buf, which has room for the largest record. Returns its size, or -1 if it is on
+    // disk already.
+    ssize_t readStaged(std::streamoff offset, char* buf) const {
+        if (!direct()) {
+            return -1;
+        }
+        std::lock_guard<std::mutex> lock(stage_mutex_);
+        if (offset < staged_from_.load(std::memory_order_relaxed)) {
+            return -1;
+        }
+        // Only the record's own bytes, the ones around it may be mid-write.
+        const size_t header_size = Layout::kHeaderSize;
+        copyStaged(offset, buf, header_size);
+        uint32_t value_length = Traits::kValueSize;
+        if (!Layout::kFixed) {
+            memcpy(&value_length, buf + Layout::kPrefixSize, sizeof(value_length));
+        }
+        size_t size = Layout::recordSize(value_length);
+        copyStaged(offset + header_size, buf + header_size, size - header_size);
+        return size;
+    }
+
+    // The record whose keydir position is value_offset if all of it is mapped, with its
+    // size in size.
+    const char* mappedRecord(std::streamoff value_offset, size_t& size) const {
+        uint32_t value_length = Traits::kValueSize;
+        if (!Layout::kFixed) {
+            const char* length_data = mapped(value_offset, sizeof(value_length));
+            if (!length_data) {
+                return nullptr;
+            }
+            memcpy(&value_length, length_data, sizeof(value_length));
+        }
+        size = Layout::recordSize(value_length);
+        return mapped(value_offset - Layout::kPrefixSize, size);
+    }
+
+    // For handing I/O on the segment to the async backend.
+    int fd() const { return fd_; }
+
+    // Current size of the file.
+    std::streamoff size() const {
+        struct stat st;
+        return fstat(fd_, &st) == 0 ? st.st_size : 0;
+    }
+
+    // An async read holds a pin on the segment while it is in flight, which keeps a
+    // merge from deleting it once the segments_ lock is let go.
+    void pin() const { pins_.fetch_add(1, std::memory_order_relaxed); }
+    void unpin() const { pins_.fetch_sub(1, std::memory_order_release); }
+    bool pinned() const { return pins_.load(std::memory_order_acquire) > 0; }
+
+    // Maps every chunk that lies entirely below end. Only one thread does this at a
+    // time (the group commit leader, or whoever opened the segment before publishing
+    // it).
+    void mapUpTo(std::streamoff end) {
+        while (mapped_chunks_ < max_chunks_ &&
+               static_cast<std::streamoff>((mapped_chunks_ + 1) * chunk_size_) <= end) {
+            void* addr = mmap(nullptr, chunk_size_, PROT_READ, MAP_SHARED, fd_, mapped_chunks_ * chunk_size_);
+            if (addr == MAP_FAILED) {
+                // Not fatal, reads of this chunk keep going through pread.
+                return;
+            }
+            chunks_[mapped_chunks_].store(static_cast<const char*>(addr), std::memory_order_release);
+            mapped_chunks_++;
+        }
+    }
+
+    // Returns a pointer to [offset, offset + size) if that range is mapped, nullptr
+    // otherwise. Ranges that straddle two chunks are never mapped.
+    const char* mapped(std::streamoff offset, size_t size) const {
+        if (chunk_size_ == 0) {
+            return nullptr;
+        }
+        size_t index = offset / chunk_size_;
+        size_t chunk_offset = offset % chunk_size_;
+        if (index >= max_chunks_ || chunk_offset + size > chunk_size_) {
+            return nullptr;
+        }
+        const char* chunk = chunks_[index].load(std::memory_order_acquire);
+        return chunk ? chunk + chunk_offset : nullptr;
+    }
+
+    // Reads up to size bytes at offset with a single pread.
+    ssize_t read(std::streamoff offset, char* buf, size_t size) const {
+        ssize_t res;
+        do {
+            res = pread(fd_, buf, size, offset);
+        } while (res < 0 && errno == EINTR);
+        return res;
+    }
+
+ private:
+    std::string path_;
+    uint32_t file_id_;
+    int fd_;
+    size_t chunk_size_;
+    size_t max_chunks_ = 0;
+    std::unique_ptr<std::atomic<const char*>[]> chunks_;
+    size_t mapped_chunks_ = 0;
+    std::streamoff sealed_end_ = 0;
+    bool legacy_ = false;
+    mutable std::atomic<int> pins_{0};
+
+    // Copies size bytes at offset into the staging chunks, allocating the ones that
+    // aren't there yet. The copy itself runs unlocked: the chunks a sync frees are
+    // all below where anyone is still writing.
+    void stage(const char* buf, size_t size, std::streamoff offset) {
+        const std::streamoff chunk_size = BufferPool::kChunkSize;
+        std::vector<std::pair<char*, size_t>> parts;
+        {
+            std::lock_guard<std::mutex> lock(stage_mutex_);
+            for (std::streamoff pos = offset, end = offset + size; pos < end;) {
+                std::streamoff start = kvstore::detail::align_down(pos, chunk_size);
+                char*& chunk = staged_[start];
+                if (!chunk) {
+                    chunk = pool_->get();
+                }
+                size_t part = std::min(end, start + chunk_size) - pos;
+                parts.emplace_back(chunk + (pos - start), part);
+                pos += part;
+            }
+        }
+        for (const auto& part : parts) {
+            memcpy(part.first, buf, part.second);
+            buf += part.second;
+        }
+    }
+
+    // Copies staged bytes out. Called with stage_mutex_ held.
+    void copyStaged(std::streamoff offset, char* buf, size_t size) const {
+        const std::streamoff chunk_size = BufferPool::kChunkSize;
+        for (std::streamoff end = offset + size; offset < end;) {
+            std::streamoff start = kvstore::detail::align_down(offset, chunk_size);
+            size_t part = std::min(end, start + chunk_size) - offset;
+            auto it = staged_.find(start);
+            if (it == staged_.end()) {
+                memset(buf, 0, part);
+            } else {
+                memcpy(buf, it->second + (offset - start), part);
+            }
+            buf += part;
+            offset += part;
+        }
+    }
+
+    // kDirect state. Bytes from staged_from_ on live in the staging chunks, keyed by
+    // their offset, and only get to disk with the next sync.
+    int direct_fd_ = -1;
+    BufferPool* pool_ = nullptr;
+    char* tail_block_ = nullptr;
+    mutable std::mutex stage_mutex_;
+    std::map<std::streamoff, char*> staged_;
+    std::atomic<std::streamoff> staged_from_{0};
+};
+
+// Helper class to read records out of a log file mapped into memory.
+template <typename Traits>
+class BasicKVStore<Traits>::Reader {
+ public:
+    struct Record {
+        K key;
+        uint32_t value_length;  // or kTombstone/kSkip/kBatch
+        std::streamoff value_offset;
+        std::string_view value;
+
+        // Skip records and batch headers don't carry a key.
+        bool isMarker() const { return value_length == kSkip || value_length == kBatch; }
+    };
+
+    explicit Reader(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw std::runtime_error("Failed to open persistence file");
+        }
+        try {
+            map(fd, lseek(fd, 0, SEEK_END));
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+    }
+    // Reads at most the first limit bytes of the file open at fd, which stays the
+    // caller's. This is how a follower reads segments the primary may have deleted.
+    Reader(int fd, std::streamoff limit) { map(fd, std::min<std::streamoff>(lseek(fd, 0, SEEK_END), limit)); }
+    ~Reader() {
+        if (data_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    std::streamoff size() const { return size_; }
+    // The value of the parsed record whose keydir position is value_offset.
+    std::string_view value(std::streamoff value_offset, uint32_t value_length) const {
+        return std::string_view(data_ + value_offset + Layout::kLengthSize, value_length);
+    }
+    // Where the first record is, past the segment header if there is one.
+    std::streamoff dataStart() const { return data_start_; }
+
+    // Parses the record that starts at pos. Returns the size of the whole record, or 0
+    // if there is no good record there.
+    size_t parse(std::streamoff pos, Record& record) const {
+        return pos < 0 ? 0 : parse(data_, size_, pos, record, checksum_);
+    }
+
+    // parse() over the size bytes at data rather than a mapped file, for records kept
+    // elsewhere in the log's layout. checksum is the one of the log they came from.
+    static size_t parse(const char* data, size_t size, size_t pos, Record& record,
+                        kvstore::detail::ChecksumFn<K> checksum) {
+        const size_t header_size = Layout::kHeaderSize;
+        if (pos > size || size - pos < header_size) {
+            return 0;
+        }
+        // What is left of the data from the end of the header on.
+        const size_t rest = size - pos - header_size;
+        uint32_t persisted_checksum;
+        memcpy(&persisted_checksum, data + pos, sizeof(persisted_checksum));
+        memcpy(&record.key, data + pos + sizeof(uint32_t), sizeof(record.key));
+        record.value_offset = pos + Layout::kPrefixSize;
+        if constexpr (Layout::kFixed) {
+            return parseFixed(data, rest, pos, persisted_checksum, record, checksum);
+        }
+        memcpy(&record.value_length, data + pos + Layout::kPrefixSize, sizeof(record.value_length));
+
+        if (record.value_length == kSkip) {
+            // A hole left behind by a failed write, its key holds the length.
+            if (record.key < header_size || record.key - header_size > rest ||
+                persisted_checksum != checksum(record.key, kSkip, std::nullopt)) {
+                return 0;
+            }
+            return record.key;
+        }
+        if (record.value_length == kBatch) {
+            // Starts a batch, its key holds the length of the records that follow and
+            // its checksum covers all of them. Those get parsed one by one afterwards,
+            // this only makes sure that all of them made it.
+            if (record.key > rest ||
+                persisted_checksum !=
+                    checksum(record.key, kBatch, std::string_view(data + pos + header_size, record.key))) {
+                return 0;
+            }
+            return header_size;
+        }
+        if (record.value_length == kTombstone) {
+            if (persisted_checksum != checksum(record.key, kTombstone, std::nullopt)) {
+                return 0;
+            }
+            record.value = std::string_view();
+            return header_size;
+        }
+        if (record.value_length > kMaxValueSize || record.value_length > rest) {
+            return 0;
+        }
+        record.value = std::string_view(data + pos + header_size, record.value_length);
+        // Do checksum verification
+        if (persisted_checksum != checksum(record.key, record.value_length, record.value)) {
+            return 0;
+        }
+        return header_size + record.value_length;
+    }
+
+    // Whether the log ends cleanly at pos, where parse found no record: at the end of
+    // the file, at an end record, or at the zeros of a preallocated segment's unused
+    // tail.
+    bool endsAt(std::streamoff pos) const {
+        if (pos >= size_) {
+            return true;
+        }
+        size_t size = std::min<std::streamoff>(Layout::kHeaderSize, size_ - pos);
+        return isEndRecord(data_ + pos, size) ||
+               std::all_of(data_ + pos, data_ + pos + size, [](char c) { return c == 0; });
+    }
+
+    // The first position at or past pos, up to end, whose header isn't all zeros. No
+    // record's is, so nothing before it can start one.
+    std::streamoff skipZeros(std::streamoff pos, std::streamoff end) const {
+        std::streamoff last = std::min<std::streamoff>(end + Layout::kHeaderSize, size_);
+        std::streamoff nonzero = pos;
+        while (nonzero < last && data_[nonzero] == 0) {
+            nonzero++;
+        }
+        return std::min(end, std::max(pos, nonzero - static_cast<std::streamoff>(Layout::kHeaderSize) + 1));
+    }
+
+    static bool isEndRecord(const char* data, size_t size) {
+        uint32_t checksum, value_length = kEnd;
+        K key;
+        if (size < Layout::kHeaderSize) {
+            return false;
+        }
+        memcpy(&checksum, data, sizeof(checksum));
+        memcpy(&key, data + sizeof(checksum), sizeof(key));
+        if (!Layout::kFixed) {
+            memcpy(&value_length, data + Layout::kPrefixSize, sizeof(value_length));
+        }
+        return value_length == kEnd && key == 0 && checksum == kvstore::detail::make_checksum<K>(0, kEnd, std::nullopt);
+    }
+
+ private:
+    // parse() of a record of fixed-size values, which has no length field to go by.
+    // The checksum of a value is tried first since nearly every record has one, then
+    // those of the records without. rest is what follows the record's header.
+    static size_t parseFixed(const char* data, size_t rest, size_t pos, uint32_t persisted_checksum,
+                             Record& record, kvstore::detail::ChecksumFn<K> checksum) {
+        const size_t stride = Layout::kStride;
+        if (rest < Traits::kValueSize) {
+            return 0;
+        }
+        record.value_length = Traits::kValueSize;
+        record.value = std::string_view(data + pos + Layout::kHeaderSize, Traits::kValueSize);
+        if (persisted_checksum == checksum(record.key, record.value_length, record.value)) {
+            return stride;
+        }
+        record.value = std::string_view();
+        record.value_length = kTombstone;
+        if (persisted_checksum == checksum(record.key, kTombstone, std::nullopt)) {
+            return stride;
+        }
+        // Skip records and batches cover whole records, so their lengths are too.
+        size_t after = rest - Traits::kValueSize;
+        if (record.key == 0 || record.key % stride != 0) {
+            return 0;
+        }
+        record.value_length = kSkip;
+        if (record.key - stride <= after && persisted_checksum == checksum(record.key, kSkip, std::nullopt)) {
+            return record.key;
+        }
+        record.value_length = kBatch;
+        if (record.key <= after &&
+            persisted_checksum == checksum(record.key, kBatch, std::string_view(data + pos + stride, record.key))) {
+            return stride;
+        }
+        return 0;
+    }
+
+    void map(int fd, std::streamoff size) {
+        size_ = std::max<std::streamoff>(size, 0);
+        if (size_ > 0) {
+            void* addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED) {
+                throw std::runtime_error("Failed to map persistence file");
+            }
+            data_ = static_cast<const char*>(addr);
+            madvise(addr, size_, MADV_SEQUENTIAL);
+        }
+        bool has_header;
+        try {
+            has_header =
+                kvstore::detail::parse_segment_header(data_, size_, kvstore::detail::kSegmentVersionOf<Traits>);
+        } catch (...) {
+            if (data_) {
+                munmap(const_cast<char*>(data_), size_);
+            }
+            throw;
+        }
+        if (has_header) {
+            data_start_ = kvstore::detail::kSegmentHeaderSize;
+        } else if (size_ > 0) {
+            checksum_ = kvstore::detail::make_legacy_checksum<K>;
+        }
+    }
+
+    const char* data_ = nullptr;
+    std::streamoff size_ = 0;
+    std::streamoff data_start_ = 0;
+    kvstore::detail::ChecksumFn<K> checksum_ = kvstore::detail::make_checksum<K>;
+};
+
+template <typename Traits>
+std::string BasicKVStore<Traits>::segmentPath(uint32_t file_id) const {
+    if (file_id == 0) {
+        return persistence_file_;
+    }
+    return persistence_file_ + "." + std::to_string(file_id);
+}
+
+// Helper function to read the records of a log file in order. Calls fn for each good
+// record and returns the end of the last good record, stopping at the first corrupted
+// one.
+template <typename Traits>
+std::streamoff BasicKVStore<Traits>::scanLog(const std::string& path, const RecordFn& fn) const {
+    Reader reader(path);
+    typename Reader::Record record;
+    std::streamoff valid_pos = reader.dataStart();
+    while (valid_pos < reader.size()) {
+        size_t record_size = reader.parse(valid_pos, record);
+        if (record_size == 0) {
+            if (!reader.endsAt(valid_pos)) {
+                std::cout << "Bad record at " << valid_pos << std::endl;
+            }
+            break;
+        }
+        if (!record.isMarker()) {
+            fn(record.key, record.value_offset, record.value_length, record.value);
+        }
+        valid_pos += record_size;
+    }
+    return valid_pos;
+}
+
+// Helper function to load one segment into the store_ during restore. The segment is
+// mapped and cut into chunks that worker threads scan in parallel. Every worker but the
+// first starts in the middle of some record, so it slides forward to the first offset
+// where a record and the one after it check out and scans from there, or with
+// fixed-size values just rounds up to the next record. A stitching pass then checks
+// that each chunk picks up exactly where the previous one left off and rescans any
+// chunk whose worker synced onto a bogus boundary. Everything from the
+// first bad record on is dropped, same as a sequential scan. Returns the end of the
+// last good record, and fills hint with the segment's entries if asked to.
+template <typename Traits>
+std::streamoff BasicKVStore<Traits>::recoverSegment(uint32_t file_id, const std::string& path, Hint_T* hint) {
+    struct Entry {
+        K key;
+        uint32_t value_length;  // or kTombstone
+        std::streamoff offset;
+    };
+    struct Chunk {
+        std::streamoff begin;
+        std::streamoff end;
+        std::streamoff first = 0;   // where the scan of this chunk started
+        std::streamoff stop = 0;    // first record boundary at or past end, or the bad record
+        bool bad = false;
+        std::vector<Entry> entries;
+    };
+
+    Reader reader(path);
+    // Scans whole records starting in [pos, chunk.end).
+    auto scan = [&reader](Chunk& chunk, std::streamoff pos) {
+        typename Reader::Record record;
+        chunk.first = pos;
+        chunk.bad = false;
+        chunk.entries.clear();
+        while (pos < chunk.end) {
+            size_t record_size = reader.parse(pos, record);
+            if (record_size == 0) {
+                chunk.bad = true;
+                break;
+            }
+            if (!record.isMarker()) {
+                chunk.entries.push_back({record.key, record.value_length, record.value_offset});
+            }
+            pos += record_size;
+        }
+        chunk.stop = pos;
+    };
+    auto resync = [&reader](std::streamoff pos, std::streamoff end) {
+        if (Layout::kFixed) {
+            // Records of fixed-size values sit a whole number of strides into the data,
+            // so the next one starts at the next multiple.
+            std::streamoff start = reader.dataStart();
+            const std::streamoff stride = Layout::kStride;
+            return std::min(end, start + kvstore::detail::align_up(std::max(pos, start) - start, stride));
+        }
+        typename Reader::Record record;
+        for (; pos < end; pos++) {
+            // Zero runs, like the unused tail of a preallocated segment, go by a byte
+            // at a time instead of a parse at a time.
+            pos = reader.skipZeros(pos, end);
+            if (pos == end) {
+                break;
+            }
+            size_t record_size = reader.parse(pos, record);
+            if (record_size != 0 && (reader.parse(pos + record_size, record) != 0 ||
+                                     reader.endsAt(pos + record_size))) {
+                return pos;
+            }
+        }
+        return end;
+    };
+
+    // Small segments aren't worth the threads.
+    const std::streamoff kMinChunkSize = 1 << 20;
+    size_t num_chunks = options_.recovery_threads ? options_.recovery_threads : std::thread::hardware_concurrency();
+    num_chunks = std::max<size_t>(1, std::min<size_t>(num_chunks, reader.size() / kMinChunkSize));
+    std::vector<Chunk> chunks(num_chunks);
+    for (size_t i = 0; i < num_chunks; i++) {
+        chunks[i].begin = reader.size() * i / num_chunks;
+        chunks[i].end = reader.size() * (i + 1) / num_chunks;
+    }
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < num_chunks; i++) {
+        workers.emplace_back([&, i] { scan(chunks[i], resync(chunks[i].begin, chunks[i].end)); });
+    }
+    scan(chunks[0], reader.dataStart());
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+
+    std::streamoff valid_pos = reader.dataStart();
+    size_t good_chunks = 0;
+    while (good_chunks < num_chunks) {
+        Chunk& chunk = chunks[good_chunks++];
+        if (chunk.first != valid_pos) {
+            scan(chunk, valid_pos);
+        }
+        valid_pos = chunk.stop;
+        if (chunk.bad) {
+            if (!reader.endsAt(valid_pos)) {
+                std::cout << "Bad record at " << valid_pos << std::endl;
+            }
+            break;
+        }
+    }
+
+    // Merging the partial keydirs only needs the forward-only rule that doPut uses, so
+    // it doesn't matter which order the chunks land in.
+    auto apply = [&](size_t first_chunk) {
+        for (size_t i = first_chunk; i < good_chunks; i += num_chunks) {
+            for (const auto& entry : chunks[i].entries) {
+                bool is_deleted = entry.value_length == kTombstone;
+                std::optional<std::string_view> value;
+                if (!is_deleted) {
+                    value = reader.value(entry.offset, entry.value_length);
+                }
+                updateStore(entry.key, makePos(file_id, entry.offset), is_deleted, value);
+            }
+        }
+    };
+    for (size_t i = 1; i < num_chunks; i++) {
+        workers.emplace_back(apply, i);
+    }
+    apply(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    if (hint) {
+        for (size_t i = 0; i < good_chunks; i++) {
+            for (const auto& entry : chunks[i].entries) {
+                (*hint)[entry.key] = {entry.offset, entry.value_length == kTombstone};
+            }
+        }
+    }
+    return valid_pos;
+}
+
+// Helper function to restore the store from the persistence files. Skips any corrupted entries
+// and truncates the files to exclude such corrupt entries.
+template <typename Traits>
+void BasicKVStore<Traits>::restore() {
+    namespace fs = std::filesystem;
+    fs::path base(persistence_file_);
+    fs::path dir = base.has_parent_path() ? base.parent_path() : fs::path(".");
+    std::string prefix = base.filename().string() + ".";
+    if (fs::exists(persistence_file_ + ".shards")) {
+        throw std::runtime_error("Store is sharded, open it with the shard count it was created with");
+    }
+
+    auto ends_with = [](const std::string& str, const std::string& suffix) {
+        return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+    auto parse_id = [](const std::string& str, uint32_t& file_id) {
+        if (str.empty() || str.size() > 9 ||
+            !std::all_of(str.begin(), str.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+            return false;
+        }
+        file_id = std::stoul(str);
+        return true;
+    };
+
+    std::vector<uint32_t> file_ids;
+    std::vector<uint32_t> hint_ids;
+    if (fs::exists(base)) {
+        file_ids.push_back(0);
+    }
+    if (fs::exists(dir)) {
+        for (const auto& entry : fs::directory_iterator(dir)) {
+            std::string name = entry.path().filename().string();
+            if (name.compare(0, prefix.size(), prefix) != 0) {
+                continue;
+            }
+            std::string suffix = name.substr(prefix.size());
+            uint32_t file_id;
+            if (ends_with(suffix, ".compact") || ends_with(suffix, ".tmp")) {
+                // Left behind by a merge or hint write that never got installed.
+                fs::remove(entry.path());
+            } else if (suffix == "hint") {
+                hint_ids.push_back(0);
+            } else if (ends_with(suffix, ".hint") && parse_id(suffix.substr(0, suffix.size() - 5), file_id)) {
+                hint_ids.push_back(file_id);
+            } else if (parse_id(suffix, file_id) && file_id != 0) {
+                file_ids.push_back(file_id);
+            }
+        }
+    }
+    std::sort(file_ids.begin(), file_ids.end());
+
+    // A compacted segment replaces every segment older than it. If we crashed after
+    // installing one but before deleting the segments it replaced, finish the job.
+    auto compacted = std::find_if(file_ids.rbegin(), file_ids.rend(), [](uint32_t file_id) { return file_id % 2 == 1; });
+    if (compacted != file_ids.rend()) {
+        auto first_kept = compacted.base() - 1;
+        for (auto it = file_ids.begin(); it != first_kept; ++it) {
+            fs::remove(segmentPath(*it));
+        }
+        file_ids.erase(file_ids.begin(), first_kept);
+    }
+    for (uint32_t file_id : hint_ids) {
+        if (!std::binary_search(file_ids.begin(), file_ids.end(), file_id)) {
+            fs::remove(hintPath(file_id));
+        }
+    }
+
+    const std::streamoff active_capacity = options_.segment_size + Layout::kMaxRecordSize;
+    const bool preallocated = options_.log_mode != LogMode::kGrowing;
+    // A preallocated segment the store was closed cleanly with ends in an end record.
+    auto ends_cleanly = [](const std::string& path, std::streamoff pos) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw std::runtime_error("Failed to open persistence file");
+        }
+        char header[Layout::kHeaderSize];
+        ssize_t res = pread(fd, header, sizeof(header), pos);
+        close(fd);
+        return res == static_cast<ssize_t>(sizeof(header)) && Reader::isEndRecord(header, res);
+    };
+    LogPos tail = 0;
+    bool have_active = false;
+    for (size_t i = 0; i < file_ids.size(); i++) {
+        uint32_t file_id = file_ids[i];
+        std::string path = segmentPath(file_id);
+        // Appends pick up where the newest regular segment left off, unless it is in
+        // the legacy format. Then it gets sealed and appends go to a new segment.
+        bool last_regular = i + 1 == file_ids.size() && file_id % 2 == 0;
+        bool active = last_regular &&
+                      (fs::file_size(path) == 0 ||
+                       kvstore::detail::has_segment_header(path, kvstore::detail::kSegmentVersionOf<Traits>));
+
+        // Sealed segments can come straight from their hint, only the unhinted
+        // ones need a full scan.
+        std::streamoff valid_pos = fs::file_size(path);
+        if (last_regular || !loadHint(file_id, valid_pos)) {
+            bool make_hint = !active && options_.write_hints;
+            Hint_T entries;
+            valid_pos = recoverSegment(file_id, path, make_hint ? &entries : nullptr);
+            if (last_regular && valid_pos == 0) {
+                // Nothing in it made it, not even the header of a new segment. Start it
+                // over in the current format.
+                active = true;
+                make_hint = false;
+            }
+
+            // truncate file to valid_pos
+            // this helps roll back to the end of the last good record. Writers may
+            // finish their pwrites out of order, but a record is only acknowledged once
+            // every byte before it has been written and synced, so anything past the
+            // first bad record was never acknowledged to a caller. Preallocated
+            // segments keep their size, their data ends at valid_pos either way.
+            std::streamoff file_size = fs::file_size(path);
+            if (file_size != valid_pos && (!preallocated || valid_pos == 0)) {
+                fs::resize_file(path, valid_pos);
+                file_size = valid_pos;
+            }
+            if (active && preallocated && valid_pos > 0 && valid_pos < file_size &&
+                !ends_cleanly(path, valid_pos)) {
+                // We crashed. What lies past the last good record may be records that
+                // were never acknowledged, and appending over the gap in front of them
+                // would bring them back. Fence them off with an end record and leave
+                // the segment be.
+                LogFile file(path, file_id, true, 0, 0);
+                if (!writeEndRecord(file, valid_pos)) {
+                    throw std::runtime_error("Failed to write to persistence file");
+                }
+                active = false;
+                if (options_.write_hints) {
+                    unhinted_.push_back(file_id);
+                }
+            }
+            if (make_hint) {
+                try {
+                    writeHint(file_id, file_size, entries);
+                } catch (const std::exception& e) {
+                    std::cout << "Failed to write hint for segment " << file_id << ": " << e.what() << std::endl;
+                }
+            }
+        }
+
+        auto file = std::make_unique<LogFile>(path, file_id, active, options_.mmap_chunk_size,
+                                              active ? active_capacity : valid_pos);
+        if (active && preallocated &&
+            !file->preallocate(kvstore::detail::align_up(active_capacity, kvstore::detail::kDirectBlockSize), true)) {
+            throw std::runtime_error("Failed to preallocate persistence file");
+        }
+        if (active && valid_pos == 0) {
+            if (!file->writeHeader()) {
+                throw std::runtime_error("Failed to write to persistence file");
+            }
+            valid_pos = kvstore::detail::kSegmentHeaderSize;
+        }
+        if (active) {
+            if (options_.log_mode == LogMode::kDirect) {
+                file->openDirect(*buffer_pool_, valid_pos);
+            }
+            tail = makePos(file_id, valid_pos);
+            have_active = true;
+        } else {
+            file->seal(valid_pos);
+        }
+        file->mapUpTo(valid_pos);
+        segments_.emplace(file_id, std::move(file));
+    }
+
+    if (!have_active) {
+        // Regular segments have even ids, after a compacted or a legacy one.
+        uint32_t file_id = file_ids.empty() ? 0 : file_ids.back() + (file_ids.back() % 2 == 1 ? 1 : 2);
+        auto file = std::make_unique<LogFile>(segmentPath(file_id), file_id, true, options_.mmap_chunk_size,
+                                              active_capacity);
+        if (preallocated &&
+            !file->preallocate(kvstore::detail::align_up(active_capacity, kvstore::detail::kDirectBlockSize), true)) {
+            throw std::runtime_error("Failed to preallocate persistence file");
+        }
+        if (!file->writeHeader()) {
+            throw std::runtime_error("Failed to write to persistence file");
+        }
+        if (options_.log_mode == LogMode::kDirect) {
+            file->openDirect(*buffer_pool_, kvstore::detail::kSegmentHeaderSize);
+        }
+        segments_.emplace(file_id, std::move(file));
+        kvstore::detail::sync_directory(persistence_file_);
+        tail = makePos(file_id, kvstore::detail::kSegmentHeaderSize);
+    }
+
+    tail_ = tail;
+    written_ = tail;
+    durable_ = tail;
+}
+
+// ----------------------------------------------
+// LOG FILE RELATED FUNCTIONS
+// ----------------------------------------------
+
+// Helper function to append a record, header followed by body, to the persistence
+// file. Reserves the record's byte range, writes it and returns the log position
+// where the record starts once it is durable, or right away for kAsync.
+template <typename Traits>
+typename BasicKVStore<Traits>::LogPos BasicKVStore<Traits>::appendToLog(std::string_view header, std::string_view body,
+                                                                        Durability durability) {
+    auto start = std::chrono::steady_clock::now();
+    size_t size = header.size() + body.size();
+    LogPos pos = reserveLog(size);
+    LogFile* file = findSegment(posFile(pos));
+    std::streamoff offset = posOffset(pos);
+    std::streamoff end_offset = offset + size;
+    if (end_offset >= static_cast<std::streamoff>(options_.segment_size)) {
+        // Ours is the record that fills the segment up.
+        rollSegment(*file, end_offset);
+    }
+    bool written = file->write(header, body, offset);
+    bool covered = written || writeSkipRecord(*file, offset, size);
+
+    std::unique_lock<std::mutex> lock(commit_mutex_);
+    if (covered) {
+        markWritten(pos, pos + size);
+    } else {
+        failWrite();
+    }
+    if (!written) {
+        kickAsyncPuts(lock);
+        throw std::runtime_error("Failed to write to persistence file, must fail");
+    }
+    if (durability == Durability::kAsync) {
+        if (written_bytes_ - durable_bytes_ >= options_.flush_bytes) {
+            flush_cv_.notify_one();
+        }
+        lock.unlock();
+        std::call_once(flusher_once_, [this] { flusher_ = std::thread([this] { flushLoop(); }); });
+        metrics_->add(Metrics::kBytesAppended, size);
+        return pos;
+    }
+    if (durability == Durability::kSync) {
+        // Cuts short a leader waiting for its batch to fill up.
+        sync_waiters_++;
+        batch_cv_.notify_one();
+        try {
+            commitOffset(lock, pos + size);
+        } catch (...) {
+            sync_waiters_--;
+            throw;
+        }
+        sync_waiters_--;
+    } else {
+        commitOffset(lock, pos + size);
+    }
+    lock.unlock();
+    metrics_->add(Metrics::kBytesAppended, size);
+    metrics_->record(Metrics::kAppendLatency, start);
+    return pos;
+}
+
+// Reserves size bytes at the tail of the log and returns where they start.
+template <typename Traits>
+typename BasicKVStore<Traits>::LogPos BasicKVStore<Traits>::reserveLog(size_t size) {
+    if (commit_failed_.load(std::memory_order_relaxed)) {
+        throw std::runtime_error("Failed to write to persistence file, must fail");
+    }
+    // The log tail is tracked in user-space, so reserving a spot in the log is a
+    // single fetch_add and the write itself can go out in parallel with everyone
+    // else's.
+    LogPos pos;
+    while (true) {
+        pos = tail_.fetch_add(size, std::memory_order_relaxed);
+        if (posOffset(pos) < static_cast<std::streamoff>(options_.segment_size)) {
+            break;
+        }
+        // The segment is full and whoever crossed the limit is rolling the log over
+        // to a new one. Wait for that and try again there.
+        std::unique_lock<std::mutex> lock(commit_mutex_);
+        commit_cv_.wait(lock, [&] { return posFile(tail_.load()) != posFile(pos) || commit_failed_; });
+        if (commit_failed_) {
+            throw std::runtime_error("Failed to write to persistence file, must fail");
+        }
+    }
+    return pos;
+}
+
+// Covers a reserved range that we failed to write with a skip record so restore()
+// can step over it. Only the header needs to make it, the rest of the hole is never
+// looked at.
+template <typename Traits>
+bool BasicKVStore<Traits>::writeSkipRecord(LogFile& file, std::streamoff offset, uint32_t length) {
+    char header[Layout::kHeaderSize];
+    Layout::encodeHeader(header, kvstore::detail::make_checksum<K>(length, kSkip, std::nullopt), length, kSkip);
+    return file.write(header, sizeof(header), offset);
+}
+
+// Ends the data of a preallocated segment at offset with an end record, and syncs it.
+template <typename Traits>
+bool BasicKVStore<Traits>::writeEndRecord(LogFile& file, std::streamoff offset) {
+    char header[Layout::kHeaderSize];
+    Layout::encodeHeader(header, kvstore::detail::make_checksum<K>(0, kEnd, std::nullopt), 0, kEnd);
+    return file.write(header, sizeof(header), offset) && file.sync(offset + sizeof(header));
+}
+
+// Seals file at end_offset and moves the log tail over to a fresh segment. Writers
+// that reserved space past the end of the full segment are waiting for this to retry.
+template <typename Traits>
+void BasicKVStore<Traits>::rollSegment(LogFile& file, std::streamoff end_offset) {
+    uint32_t next_id = file.id() + 2;
+    const std::streamoff capacity = options_.segment_size + Layout::kMaxRecordSize;
+    std::unique_ptr<LogFile> next;
+    try {
+        bool spare = options_.log_mode != LogMode::kGrowing && takeSpare(next_id);
+        next = std::make_unique<LogFile>(segmentPath(next_id), next_id, true, options_.mmap_chunk_size, capacity);
+        if (!spare) {
+            // Without a spare ready, fallocate alone at least keeps the file from
+            // growing. Zero filling would hold up every writer waiting for the roll.
+            if (options_.log_mode != LogMode::kGrowing &&
+                !next->preallocate(kvstore::detail::align_up(capacity, kvstore::detail::kDirectBlockSize), false)) {
+                throw std::runtime_error("Failed to preallocate segment");
+            }
+            if (!next->writeHeader()) {
+                throw std::runtime_error("Failed to write segment header");
+            }
+        }
+        if (options_.log_mode == LogMode::kDirect) {
+            next->openDirect(*buffer_pool_, kvstore::detail::kSegmentHeaderSize);
+        }
+        kvstore::detail::sync_directory(persistence_file_);
+    } catch (const std::exception& e) {
+        std::cout << "Failed to roll the log: " << e.what() << std::endl;
+        next.reset();
+    }
+    file.seal(end_offset);
+
+    bool rolled = next != nullptr;
+    if (rolled) {
+        tbb::spin_rw_mutex::scoped_lock segments_lock(segments_mutex_, true);
+        segments_.emplace(next_id, std::move(next));
+    }
+
+    std::unique_lock<std::mutex> lock(commit_mutex_);
+    if (!rolled) {
+        commit_failed_ = true;
+    } else {
+        rolled_ends_[file.id()] = end_offset;
+        tail_.store(makePos(next_id, kvstore::detail::kSegmentHeaderSize));
+    }
+    commit_cv_.notify_all();
+    kickAsyncPuts(lock);
+}
+
+// Records that [pos, end_pos) has been written and advances written_ over any
+// ranges that are now contiguous with it, hopping over to the next segment when it
+// reaches the end of a rolled one. Called with commit_mutex_ held.
+template <typename Traits>
+void BasicKVStore<Traits>::markWritten(LogPos pos, LogPos end_pos) {
+    if (pos != written_) {
+        written_ranges_.emplace(pos, end_pos);
+        return;
+    }
+    if (written_bytes_ == durable_bytes_) {
+        unsynced_since_ = std::chrono::steady_clock::now();
+    }
+    written_ = end_pos;
+    written_records_++;
+    written_bytes_ += end_pos - pos;
+    while (true) {
+        auto it = written_ranges_.begin();
+        if (it != written_ranges_.end() && it->first == written_) {
+            written_ = it->second;
+            written_records_++;
+            written_bytes_ += it->second - it->first;
+            written_ranges_.erase(it);
+            continue;
+        }
+        auto rolled = rolled_ends_.find(posFile(written_));
+        if (rolled != rolled_ends_.end() && rolled->second == posOffset(written_)) {
+            written_ = makePos(rolled->first + 2, kvstore::detail::kSegmentHeaderSize);
+            rolled_ends_.erase(rolled);
+            continue;
+        }
+        break;
+    }
+    batch_cv_.notify_one();
+    commit_cv_.notify_all();
+}
+
+// Stops the log after a write left a hole of garbage that no skip record covers.
+// Nobody behind it can become durable, so written_ never moves past it and the log
+// is done taking writes. restore() will cut the log back to the last good record on
+// the next startup. Called with commit_mutex_ held.
+template <typename Traits>
+void BasicKVStore<Traits>::failWrite() {
+    commit_failed_ = true;
+    batch_cv_.notify_one();
+    commit_cv_.notify_all();
+}
+
+// Commit a log position to disk. Blocks until everything before end_pos is durable,
+// either by leading a sync ourselves or by waiting for the current leader.
+template <typename Traits>
+void BasicKVStore<Traits>::commitOffset(std::unique_lock<std::mutex>& lock, LogPos end_pos) {
+    while (durable_ < end_pos) {
+        if (commit_failed_) {
+            throw std::runtime_error("Failed to write to persistence file, must fail");
+        }
+        // Until every write ahead of ours has landed there is nothing we could
+        // sync that would cover us.
+        if (leader_active_ || written_ < end_pos) {
+            commit_cv_.wait(lock);
+            continue;
+        }
+        flushBatch(lock);
+    }
+}
+
+// Runs one round of group commit as the leader. Called with commit_mutex_ held,
+// drops it around the fdatasync so that followers can keep writing the next batch
+// in the meantime.
+template <typename Traits>
+void BasicKVStore<Traits>::flushBatch(std::unique_lock<std::mutex>& lock) {
+    leader_active_ = true;
+    if (options_.max_batch_wait.count() > 0) {
+        batch_cv_.wait_for(lock, options_.max_batch_wait, [this] {
+            return sync_waiters_ > 0 || written_records_ - durable_records_ >= options_.max_batch_size ||
+                   commit_failed_;
+        });
+        if (commit_failed_) {
+            // The log failed while we waited. Whoever we lead finds out in commitOffset.
+            leader_active_ = false;
+            commit_cv_.notify_all();
+            return;
+        }
+    }
+
+    LogPos sync_pos = written_;
+    uint64_t sync_records = written_records_;
+    uint64_t sync_bytes = written_bytes_;
+    uint32_t first_file = posFile(durable_);
+    round_start_ = std::chrono::steady_clock::now();
+    lock.unlock();
+
+    auto sync_start = std::chrono::steady_clock::now();
+    bool ok = syncSegments(first_file, sync_pos);
+    metrics_->record(Metrics::kFsyncLatency, sync_start);
+    if (ok) {
+        segmentsDurable(first_file, sync_pos);
+    }
+
+    lock.lock();
+    finishBatch(ok, sync_pos, sync_records, sync_bytes);
+    kickAsyncPuts(lock);
+}
+
+// Syncs the segments from first_file up to sync_pos. Usually just the active segment,
+// plus the previous one right after a roll.
+template <typename Traits>
+bool BasicKVStore<Traits>::syncSegments(uint32_t first_file, LogPos sync_pos) {
+    for (uint32_t file_id = first_file; file_id <= posFile(sync_pos); file_id += 2) {
+        LogFile* file = findSegment(file_id);
+        if (!file->sync(file_id < posFile(sync_pos) ? file->sealedEnd() : posOffset(sync_pos))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Follow-up work of a group commit round once the segments from first_file up to
+// sync_pos are synced. Only the leader maps new chunks, and there is only one leader
+// at a time.
+template <typename Traits>
+void BasicKVStore<Traits>::segmentsDurable(uint32_t first_file, LogPos sync_pos) {
+    for (uint32_t file_id = first_file; file_id <= posFile(sync_pos); file_id += 2) {
+        LogFile* file = findSegment(file_id);
+        if (file_id < posFile(sync_pos)) {
+            // Sealed and durable, hand it over for a hint file.
+            file->mapUpTo(file->sealedEnd());
+            if (options_.write_hints) {
+                std::lock_guard<std::mutex> background_lock(background_mutex_);
+                unhinted_.push_back(file_id);
+                background_cv_.notify_one();
+            }
+        } else {
+            file->mapUpTo(posOffset(sync_pos));
+        }
+    }
+}
+
+// Ends a group commit round that synced everything up to sync_pos. Called with
+// commit_mutex_ held by whoever led the round.
+template <typename Traits>
+void BasicKVStore<Traits>::finishBatch(bool ok, LogPos sync_pos, uint64_t sync_records, uint64_t sync_bytes) {
+    // Once the log has failed durable_ stays put, whatever this round synced.
+    if (ok && !commit_failed_) {
+        uint64_t batch_size = sync_records - durable_records_;
+        if (sync_bytes > durable_bytes_) {
+            metrics_->record(Metrics::kDurableLag, unsynced_since_);
+        }
+        durable_ = sync_pos;
+        durable_mark_->publish(sync_pos);
+        durable_records_ = sync_records;
+        durable_bytes_ = sync_bytes;
+        // Whatever is left was written after the round picked what to sync.
+        unsynced_since_ = round_start_;
+        commit_stats_.batches++;
+        commit_stats_.records += batch_size;
+        commit_stats_.max_batch_size = std::max(commit_stats_.max_batch_size, batch_size);
+        commit_stats_.fsyncs_saved += batch_size - 1;
+    } else if (!ok) {
+        // After a failed fdatasync the kernel may have dropped the dirty pages, so
+        // we can't tell what is on disk anymore. Stop accepting writes.
+        commit_failed_ = true;
+    }
+    leader_active_ = false;
+    commit_cv_.notify_all();
+}
+
+// Syncs the log behind kAsync writes: every flush_interval while anything written
+// isn't durable, or as soon as flush_bytes of it have piled up. Leads the round like
+// any writer waiting on it would. Makes one last round on the way out.
+template <typename Traits>
+void BasicKVStore<Traits>::flushLoop() {
+    std::unique_lock<std::mutex> lock(commit_mutex_);
+    while (!commit_failed_) {
+        flush_cv_.wait_for(lock, options_.flush_interval, [this] {
+            return stop_flusher_ || written_bytes_ - durable_bytes_ >= options_.flush_bytes;
+        });
+        try {
+            commitOffset(lock, written_);
+        } catch (const std::exception&) {
+            // The log failed. Writers find out for themselves.
+        }
+        if (stop_flusher_) {
+            return;
+        }
+    }
+    flush_cv_.wait(lock, [this] { return stop_flusher_; });
+}
+
+template <typename Traits>
+typename BasicKVStore<Traits>::CommitStats BasicKVStore<Traits>::commitStats() const {
+    if (!shards_.empty()) {
+        CommitStats stats;
+        for (const auto& shard : shards_) {
+            CommitStats part = shard->commitStats();
+            stats.batches += part.batches;
+            stats.records += part.records;
+            stats.max_batch_size = std::max(stats.max_batch_size, part.max_batch_size);
+            stats.fsyncs_saved += part.fsyncs_saved;
+        }
+        return stats;
+    }
+    std::lock_guard<std::mutex> lock(commit_mutex_);
+    return commit_stats_;
+}
+
+// Looks up a segment that can't be deleted while the caller uses it, i.e. one at or
+// past the durable watermark.
+template <typename Traits>
+typename BasicKVStore<Traits>::LogFile* BasicKVStore<Traits>::findSegment(uint32_t file_id) const {
+    tbb::spin_rw_mutex::scoped_lock lock(segments_mutex_, false);
+    return segments_.at(file_id).get();
+}
+
+// Helper function to read a value from a segment from an offset.
+// This offset is expected to point to the length portion of the value that precedes the
+// actual value data.
+// Returns false for a tombstone.
+template <typename Traits>
+bool BasicKVStore<Traits>::getValueFromOffset(const LogFile& file, std::streamoff offset, V& value) const {
+    struct Timer {
+        Metrics& metrics;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ~Timer() { metrics.record(Metrics::kFileReadLatency, start); }
+    } timer{*metrics_};
+    const size_t prefix_size = Layout::kPrefixSize;
+    // Hot data is served straight out of the mapping.
+    size_t record_size;
+    if (const char* record = file.mappedRecord(offset, record_size)) {
+        return decodeValue(file, offset, record, record_size, value);
+    }
+
+    // Otherwise a single pread of the largest possible record picks up the whole
+    // record. Reading past the end of the record is harmless. Records of a kDirect
+    // segment that aren't synced yet are only in its staging buffers.
+    char buf[Layout::kMaxRecordSize];
+    ssize_t res = file.readStaged(offset - prefix_size, buf);
+    if (res < 0) {
+        res = file.read(offset - prefix_size, buf, sizeof(buf));
+    }
+    if (res < 0) {
+        throw std::runtime_error("Failed to read from persistence file");
+    }
+    return decodeValue(file, offset, buf, res, value);
+}
+
+// Decodes the value of the record whose keydir position is offset into value. record
+// points at the record's checksum and has size bytes available. With
+// Options::verify_checksums the record's checksum is checked too, and a value that
+// doesn't match it throws instead of being returned. Returns false for a tombstone.
+template <typename Traits>
+bool BasicKVStore<Traits>::decodeValue(const LogFile& file, std::streamoff offset, const char* record, size_t size,
+                                       V& value) const {
+    const size_t prefix_size = Layout::kPrefixSize;
+    const size_t header_size = Layout::kHeaderSize;
+    if (size < header_size) {
+        throw std::runtime_error("Failed to read from persistence file");
+    }
+    uint32_t checksum;
+    K key;
+    memcpy(&checksum, record, sizeof(checksum));
+    memcpy(&key, record + sizeof(checksum), sizeof(key));
+    kvstore::detail::ChecksumFn<K> checksum_fn =
+        file.legacy() ? kvstore::detail::make_legacy_checksum<K> : kvstore::detail::make_checksum<K>;
+    uint32_t value_length = Traits::kValueSize;
+    if (!Layout::kFixed) {
+        memcpy(&value_length, record + prefix_size, sizeof(value_length));
+    } else if (checksum == checksum_fn(key, kTombstone, std::nullopt)) {
+        // Only its checksum tells a tombstone of fixed-size values apart.
+        value_length = kTombstone;
+    }
+    // Check if it's a tombstone
+    if (value_length == kTombstone) {
+        return false;
+    }
+    if (value_length > kMaxValueSize || size < header_size + value_length) {
+        throw std::runtime_error("Failed to read from persistence file");
+    }
+    std::string_view data(record + header_size, value_length);
+    if (options_.verify_checksums) {
+        if (checksum != checksum_fn(key, value_length, data)) {
+            throw std::runtime_error("Checksum mismatch in segment " + std::to_string(file.id()) + " at offset " +
+                                     std::to_string(offset - prefix_size));
+        }
+    }
+    if (!Traits::decode(data.data(), data.size(), value)) {
+        throw std::runtime_error("Failed to read from persistence file");
+    }
+    return true;
+}
+
+// ----------------------------------------------
+// VALUE CACHE
+// ----------------------------------------------
+// Caches values by the log position of their record. Records are never rewritten in
+// place, so an entry can't go stale: a newer put lands at a new position and the old
+// entry simply stops being looked up until the clock hand gets to it.
+//
+// The cache is split into shards, each with its own lock and its own CLOCK. Hits only
+// take the shard's lock for reading and set the entry's reference bit. New entries
+// start out unreferenced, so a one-off scan only pushes out other entries that were
+// never read twice.
+template <typename Traits>
+class BasicKVStore<Traits>::ValueCache {
+ public:
+    explicit ValueCache(size_t capacity) {
+        // Every shard should fit a good number of the largest values.
+        size_t num_shards = 1;
+        while (num_shards < kMaxShards && capacity / (num_shards * 2) >= 16 * (kMaxValueSize + kEntryOverhead)) {
+            num_shards *= 2;
+        }
+        shards_ = std::vector<Shard>(num_shards);
+        for (auto& shard : shards_) {
+            shard.capacity = capacity / num_shards;
+        }
+    }
+
+    // Copies the value at pos into value, reusing its buffer, if it is cached.
+    bool lookup(LogPos pos, V& value) {
+        Shard& shard = shardFor(pos);
+        tbb::spin_rw_mutex::scoped_lock lock(shard.mutex, false);
+        auto it = shard.index.find(pos);
+        if (it == shard.index.end()) {
+            shard.misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        Slot& slot = shard.slots[it->second];
+        slot.referenced.store(true, std::memory_order_relaxed);
+        shard.hits.fetch_add(1, std::memory_order_relaxed);
+        value = slot.value;
+        return true;
+    }
+
+    void insert(LogPos pos, const V& value) {
+        Shard& shard = shardFor(pos);
+        size_t charge = Traits::bytes(value).size() + kEntryOverhead;
+        if (charge > shard.capacity) {
+            return;
+        }
+        tbb::spin_rw_mutex::scoped_lock lock(shard.mutex, true);
+        if (shard.index.count(pos)) {
+            // Another reader missed on the same record and beat us to it.
+            return;
+        }
+        while (shard.bytes + charge > shard.capacity) {
+            // Sweep until we find something that hasn't been read since the hand last
+            // passed it. Terminates within two laps since the hand clears bits as it goes.
+            size_t index = shard.hand;
+            Slot& slot = shard.slots[index];
+            shard.hand = (shard.hand + 1) % shard.slots.size();
+            if (!slot.used) {
+                continue;
+            }
+            if (slot.referenced.exchange(false, std::memory_order_relaxed)) {
+                continue;
+            }
+            shard.index.erase(slot.pos);
+            shard.bytes -= Traits::bytes(slot.value).size() + kEntryOverhead;
+            slot.used = false;
+            slot.value = V();
+            shard.free_slots.push_back(index);
+            shard.evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+        size_t index;
+        if (!shard.free_slots.empty()) {
+            index = shard.free_slots.back();
+            shard.free_slots.pop_back();
+        } else {
+            index = shard.slots.size();
+            shard.slots.emplace_back();
+        }
+        Slot& slot = shard.slots[index];
+        slot.pos = pos;
+        slot.value = value;
+        slot.used = true;
+        slot.referenced.store(false, std::memory_order_relaxed);
+        shard.index.emplace(pos, index);
+        shard.bytes += charge;
+    }
+
+    CacheStats stats() const {
+        CacheStats stats;
+        for (const auto& shard : shards_) {
+            stats.hits += shard.hits.load(std::memory_order_relaxed);
+            stats.misses += shard.misses.load(std::memory_order_relaxed);
+            stats.evictions += shard.evictions.load(std::memory_order_relaxed);
+            tbb::spin_rw_mutex::scoped_lock lock(shard.mutex, false);
+            stats.entries += shard.index.size();
+            stats.bytes += shard.bytes;
+        }
+        return stats;
+    }
+
+ private:
+    static const size_t kMaxShards = 64;
+    // Rough cost of an entry on top of its value: the slot and the index node.
+    static const size_t kEntryOverhead = 96;
+
+    struct Slot {
+        LogPos pos = 0;
+        V value;
+        bool used = false;
+        std::atomic<bool> referenced{false};
+    };
+
+    // Kept on separate cache lines so the shards' counters and locks don't bounce.
+    struct alignas(64) Shard {
+        mutable tbb::spin_rw_mutex mutex;
+        std::unordered_map<LogPos, size_t> index;
+        std::deque<Slot> slots;  // a deque so that slots don't move as it grows
+        std::vector<size_t> free_slots;
+        size_t hand = 0;
+        size_t bytes = 0;
+        size_t capacity = 0;
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+        std::atomic<uint64_t> evictions{0};
+    };
+
+    Shard& shardFor(LogPos pos) {
+        // Fibonacci hashing; record offsets alone are spread too unevenly to pick a shard.
+        return shards_[(pos * 0x9E3779B97F4A7C15ull) >> 32 & (shards_.size() - 1)];
+    }
+
+    std::vector<Shard> shards_;
+};
+
+template <typename Traits>
+typename BasicKVStore<Traits>::CacheStats BasicKVStore<Traits>::cacheStats() const {
+    if (!shards_.empty()) {
+        CacheStats stats;
+        for (const auto& shard : shards_) {
+            CacheStats part = shard->cacheStats();
+            stats.hits += part.hits;
+            stats.misses += part.misses;
+            stats.evictions += part.evictions;
+            stats.entries += part.entries;
+            stats.bytes += part.bytes;
+        }
+        return stats;
+    }
+    return value_cache_ ? value_cache_->stats() : CacheStats();
+}
+
+// A sharded store adds up its shards' stats and its own counters, which count the
+// calls that span shards rather than going to one shard's public method.
+template <typename Traits>
+typename BasicKVStore<Traits>::Stats BasicKVStore<Traits>::stats() const {
+    std::vector<const BasicKVStore*> logs;  // the stores that own a log
+    std::vector<const Metrics*> metrics{metrics_.get()};
+    if (shards_.empty()) {
+        logs.push_back(this);
+    }
+    for (const auto& shard : shards_) {
+        logs.push_back(shard.get());
+        metrics.push_back(shard->metrics_.get());
+    }
+    auto total = [&](typename Metrics::Counter counter) {
+        uint64_t sum = 0;
+        for (const Metrics* m : metrics) {
+            sum += m->total(counter);
+        }
+        return sum;
+    };
+
+    Stats stats;
+    stats.puts = total(Metrics::kPuts);
+    stats.removes = total(Metrics::kRemoves);
+    stats.writes = total(Metrics::kWrites);
+    stats.gets = total(Metrics::kGets);
+    stats.multi_gets = total(Metrics::kMultiGets);
+    stats.scans = total(Metrics::kScans);
+    stats.async_puts = total(Metrics::kAsyncPuts);
+    stats.async_gets = total(Metrics::kAsyncGets);
+    stats.bytes_appended = total(Metrics::kBytesAppended);
+    stats.append_latency = Metrics::latency(metrics, Metrics::kAppendLatency);
+    stats.fsync_latency = Metrics::latency(metrics, Metrics::kFsyncLatency);
+    stats.file_read_latency = Metrics::latency(metrics, Metrics::kFileReadLatency);
+    stats.file_reads = stats.file_read_latency.count;
+    stats.durable_lag = Metrics::latency(metrics, Metrics::kDurableLag);
+    auto now = std::chrono::steady_clock::now();
+    for (const BasicKVStore* log : logs) {
+        {
+            std::lock_guard<std::mutex> lock(log->commit_mutex_);
+            uint64_t unsynced_bytes = log->written_bytes_ - log->durable_bytes_;
+            stats.unsynced_bytes += unsynced_bytes;
+            if (unsynced_bytes > 0) {
+                stats.unsynced_age = std::max<std::chrono::nanoseconds>(stats.unsynced_age, now - log->unsynced_since_);
+            }
+        }
+        uint64_t log_bytes = 0;
+        {
+            tbb::spin_rw_mutex::scoped_lock lock(log->segments_mutex_, false);
+            stats.segments += log->segments_.size();
+            for (const auto& segment : log->segments_) {
+                log_bytes += segment.second->size();
+            }
+        }
+        uint64_t records = log->metrics_->total(Metrics::kLogRecords);
+        uint64_t dead_records = std::min(log->metrics_->total(Metrics::kDeadRecords), records);
+        uint64_t dead_bytes = records ? static_cast<uint64_t>(static_cast<double>(log_bytes) * dead_records / records) : 0;
+        stats.log_bytes += log_bytes;
+        stats.dead_bytes += dead_bytes;
+        // Every shard opens every snapshot, so any one of them has the count.
+        stats.snapshots = log->snapshots_->openCount();
+        stats.snapshot_versions += log->snapshots_->versionCount();
+    }
+    stats.live_bytes = stats.log_bytes - stats.dead_bytes;
+    stats.keys = total(Metrics::kKeys);
+    stats.tombstones = total(Metrics::kTombstones);
+    stats.inline_values = total(Metrics::kInlineValues);
+    stats.commits = commitStats();
+    stats.cache = cacheStats();
+    if (stats.cache.hits + stats.cache.misses > 0) {
+        stats.cache_hit_rate = static_cast<double>(stats.cache.hits) / (stats.cache.hits + stats.cache.misses);
+    }
+    stats.restore_duration = restore_duration_;
+    return stats;
+}
+
+template <typename Traits>
+std::string BasicKVStore<Traits>::Stats::toText() const {
+    std::ostringstream out;
+    auto counter = [&](const char* name, uint64_t value) {
+        out << "# TYPE kvstore_" << name << " counter\n" << "kvstore_" << name << " " << value << "\n";
+    };
+    auto gauge = [&](const char* name, double value) {
+        out << "# TYPE kvstore_" << name << " gauge\n" << "kvstore_" << name << " " << value << "\n";
+    };
+    auto summary = [&](const char* name, const LatencyStats& latency) {
+        std::string metric = std::string("kvstore_") + name + "_seconds";
+        out << "# TYPE " << metric << " summary\n";
+        out << metric << "{quantile=\"0.5\"} " << latency.p50 / 1e9 << "\n";
+        out << metric << "{quantile=\"0.99\"} " << latency.p99 / 1e9 << "\n";
+        out << metric << "{quantile=\"0.999\"} " << latency.p999 / 1e9 << "\n";
+        out << metric << "{quantile=\"1\"} " << latency.max / 1e9 << "\n";
+        out << metric << "_sum " << latency.mean * latency.count / 1e9 << "\n";
+        out << metric << "_count " << latency.count << "\n";
+    };
+    counter("puts_total", puts);
+    counter("removes_total", removes);
+    counter("writes_total", writes);
+    counter("gets_total", gets);
+    counter("multi_gets_total", multi_gets);
+    counter("scans_total", scans);
+    counter("async_puts_total", async_puts);
+    counter("async_gets_total", async_gets);
+    counter("file_reads_total", file_reads);
+    counter("appended_bytes_total", bytes_appended);
+    summary("append_latency", append_latency);
+    summary("fsync_latency", fsync_latency);
+    summary("file_read_latency", file_read_latency);
+    gauge("unsynced_bytes", unsynced_bytes);
+    gauge("unsynced_age_seconds", std::chrono::duration<double>(unsynced_age).count());
+    summary("durable_lag", durable_lag);
+    gauge("segments", segments);
+    gauge("log_bytes", log_bytes);
+    gauge("live_bytes", live_bytes);
+    gauge("dead_bytes", dead_bytes);
+    gauge("keys", keys);
+    gauge("tombstones", tombstones);
+    gauge("inline_values", inline_values);
+    counter("commit_batches_total", commits.batches);
+    counter("commit_records_total", commits.records);
+    gauge("commit_max_batch_size", commits.max_batch_size);
+    counter("commit_fsyncs_saved_total", commits.fsyncs_saved);
+    counter("cache_hits_total", cache.hits);
+    counter("cache_misses_total", cache.misses);
+    counter("cache_evictions_total", cache.evictions);
+    gauge("cache_entries", cache.entries);
+    gauge("cache_bytes", cache.bytes);
+    gauge("cache_hit_rate", cache_hit_rate);
+    gauge("restore_duration_seconds", std::chrono::duration<double>(restore_duration).count());
+    gauge("snapshots", snapshots);
+    gauge("snapshot_versions", snapshot_versions);
+    return out.str();
+}
+
+// ----------------------------------------------
+// ASYNC I/O
+// ----------------------------------------------
+// getAsync and putAsync hand their disk I/O to an AsyncIo backend and get called back
+// on one of its threads once it is done. The io_uring backend keeps a single ring with
+// one thread reaping completions; the fallback runs blocking syscalls on a small
+// thread pool. Either way completion callbacks are run one at a time per thread and
+// must not block.
+template <typename Traits>
+class BasicKVStore<Traits>::AsyncIo {
+ public:
+    // Gets the number of bytes transferred, or -errno.
+    using Done = std::function<void(ssize_t res)>;
+
+    virtual ~AsyncIo() = default;
+
+    // Reads up to size bytes at offset.
+    virtual void read(int fd, char* buf, size_t size, std::streamoff offset, Done done) = 0;
+    // Writes all of buf at offset. done gets 0 on success.
+    virtual void write(int fd, const char* buf, size_t size, std::streamoff offset, Done done) = 0;
+    // fdatasyncs every file in fds. done gets 0 once all of them are synced.
+    virtual void sync(const std::vector<int>& fds, Done done) = 0;
+    // Runs fn on a completion thread.
+    virtual void post(std::function<void()> fn) = 0;
+};
+
+template <typename Traits>
+class BasicKVStore<Traits>::ThreadPoolIo : public BasicKVStore<Traits>::AsyncIo {
+ public:
+    using typename AsyncIo::Done;
+
+    explicit ThreadPoolIo(size_t threads) {
+        for (size_t i = 0; i < std::max<size_t>(threads, 1); i++) {
+            workers_.emplace_back([this] { run(); });
+        }
+    }
+
+    // Runs everything still queued, including whatever that queues, before returning.
+    ~ThreadPoolIo() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    void read(int fd, char* buf, size_t size, std::streamoff offset, Done done) override {
+        post([=, done = std::move(done)] {
+            ssize_t res;
+            do {
+                res = pread(fd, buf, size, offset);
+            } while (res < 0 && errno == EINTR);
+            done(res < 0 ? -errno : res);
+        });
+    }
+
+    void write(int fd, const char* buf, size_t size, std::streamoff offset, Done done) override {
+        post([=, done = std::move(done)] { done(kvstore::detail::pwrite_fully(fd, buf, size, offset) ? 0 : -errno); });
+    }
+
+    void sync(const std::vector<int>& fds, Done done) override {
+        post([fds, done = std::move(done)] {
+            for (int fd : fds) {
+                if (fdatasync(fd) != 0) {
+                    done(-errno);
+                    return;
+                }
+            }
+            done(0);
+        });
+    }
+
+    void post(std::function<void()> fn) override {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push_back(std::move(fn));
+        }
+        cv_.notify_one();
+    }
+
+ private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            std::function<void()> fn = std::move(queue_.front());
+            queue_.pop_front();
+            lock.unlock();
+            fn();
+            lock.lock();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> queue_;
+    bool stop_ = false;
+    std::vector<std::thread> workers_;
+};
+
+#ifdef KVSTORE_HAVE_IO_URING
+// A bare-bones io_uring: the raw syscalls and the two rings shared with the kernel,
+// no liburing. Every submission carries a heap-allocated Op in its user_data that
+// the reaper thread runs and frees when the completion shows up. A NOP with no Op
+// tells the reaper to exit.
+template <typename Traits>
+class BasicKVStore<Traits>::IoUring : public BasicKVStore<Traits>::AsyncIo {
+ public:
+    using typename AsyncIo::Done;
+
+    // Returns nullptr if the kernel doesn't have io_uring (or it is disabled), or is
+    // too old to have plain reads and writes in it.
+    static std::unique_ptr<IoUring> create(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int fd = syscall(__NR_io_uring_setup, std::max(entries, 1u), &params);
+        if (fd < 0) {
+            return nullptr;
+        }
+        // RW_CUR_POS came with IORING_OP_READ/WRITE in 5.6. NODROP keeps completions
+        // from getting lost when the completion queue fills up.
+        const uint32_t required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS;
+        if ((params.features & required) != required) {
+            close(fd);
+            return nullptr;
+        }
+        size_t ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+                                    params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        void* ring = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                          IORING_OFF_SQ_RING);
+        if (ring == MAP_FAILED) {
+            close(fd);
+            return nullptr;
+        }
+        size_t sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                          IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            munmap(ring, ring_size);
+            close(fd);
+            return nullptr;
+        }
+        return std::unique_ptr<IoUring>(new IoUring(fd, params, ring, ring_size, sqes, sqes_size));
+    }
+
+    // Waits for everything in flight, including what completions submit in turn.
+    ~IoUring() override {
+        {
+            std::unique_lock<std::mutex> lock(inflight_mutex_);
+            inflight_cv_.wait(lock, [this] { return inflight_ == 0; });
+        }
+        io_uring_sqe stop;
+        prepare(stop, IORING_OP_NOP, -1, nullptr, 0, 0);
+        stop.user_data = 0;
+        submit(&stop, 1);
+        reaper_.join();
+        munmap(sqes_, sqes_size_);
+        munmap(ring_, ring_size_);
+        close(fd_);
+    }
+
+    void read(int fd, char* buf, size_t size, std::streamoff offset, Done done) override {
+        io_uring_sqe sqe;
+        prepare(sqe, IORING_OP_READ, fd, buf, size, offset);
+        sqe.user_data = track(std::move(done));
+        submit(&sqe, 1);
+    }
+
+    void write(int fd, const char* buf, size_t size, std::streamoff offset, Done done) override {
+        io_uring_sqe sqe;
+        prepare(sqe, IORING_OP_WRITE, fd, buf, size, offset);
+        sqe.user_data = track([=, done = std::move(done)](ssize_t res) mutable {
+            if (res == -EINTR || res == -EAGAIN) {
+                res = 0;
+            } else if (res == 0) {
+                res = -EIO;
+            }
+            if (res < 0) {
+                done(res);
+            } else if (static_cast<size_t>(res) < size) {
+                // Short write, go again with the rest.
+                write(fd, buf + res, size - res, offset + res, std::move(done));
+            } else {
+                done(0);
+            }
+        });
+        submit(&sqe, 1);
+    }
+
+    // The fdatasyncs go out side by side. The last one to complete reports the first
+    // error, if any.
+    void sync(const std::vector<int>& fds, Done done) override {
+        if (fds.empty()) {
+            done(0);
+            return;
+        }
+        struct Pending {
+            std::atomic<size_t> remaining;
+            std::atomic<ssize_t> error{0};
+            Done done;
+        };
+        auto pending = std::make_shared<Pending>();
+        pending->remaining = fds.size();
+        pending->done = std::move(done);
+        std::vector<io_uring_sqe> sqes(fds.size());
+        for (size_t i = 0; i < fds.size(); i++) {
+            prepare(sqes[i], IORING_OP_FSYNC, fds[i], nullptr, 0, 0);
+            sqes[i].fsync_flags = IORING_FSYNC_DATASYNC;
+            sqes[i].user_data = track([pending](ssize_t res) {
+                ssize_t expected = 0;
+                if (res < 0) {
+                    pending->error.compare_exchange_strong(expected, res);
+                }
+                if (pending->remaining.fetch_sub(1) == 1) {
+                    pending->done(pending->error.load());
+                }
+            });
+        }
+        submit(sqes.data(), sqes.size());
+    }
+
+    void post(std::function<void()> fn) override {
+        io_uring_sqe sqe;
+        prepare(sqe, IORING_OP_NOP, -1, nullptr, 0, 0);
+        sqe.user_data = track([fn = std::move(fn)](ssize_t) { fn(); });
+        submit(&sqe, 1);
+    }
+
+ private:
+    struct Op {
+        Done done;
+    };
+
+    IoUring(int fd, const io_uring_params& params, void* ring, size_t ring_size, void* sqes, size_t sqes_size)
+        : fd_(fd), ring_(static_cast<char*>(ring)), ring_size_(ring_size),
+          sqes_(static_cast<io_uring_sqe*>(sqes)), sqes_size_(sqes_size) {
+        sq_head_ = reinterpret_cast<uint32_t*>(ring_ + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<uint32_t*>(ring_ + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<uint32_t*>(ring_ + params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        sq_array_ = reinterpret_cast<uint32_t*>(ring_ + params.sq_off.array);
+        cq_head_ = reinterpret_cast<uint32_t*>(ring_ + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<uint32_t*>(ring_ + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<uint32_t*>(ring_ + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(ring_ + params.cq_off.cqes);
+        reaper_ = std::thread([this] { reap(); });
+    }
+
+    static void prepare(io_uring_sqe& sqe, uint8_t opcode, int fd, const void* buf, size_t size,
+                        std::streamoff offset) {
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = opcode;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(buf);
+        sqe.len = size;
+        sqe.off = offset;
+    }
+
+    uint64_t track(Done done) {
+        {
+            std::lock_guard<std::mutex> lock(inflight_mutex_);
+            inflight_++;
+        }
+        Op* op = new Op{std::move(done)};
+#if defined(__SANITIZE_THREAD__)
+        // The op reaches the reaper through the kernel, which TSan can't see.
+        __tsan_release(op);
+#endif
+        return reinterpret_cast<uint64_t>(op);
+    }
+
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+        return syscall(__NR_io_uring_enter, fd_, to_submit, min_complete, flags, nullptr, 0);
+    }
+
+    // Copies the entries into the submission queue and has the kernel consume them.
+    void submit(const io_uring_sqe* entries, size_t count) {
+        std::lock_guard<std::mutex> lock(submit_mutex_);
+        uint32_t tail = *sq_tail_;
+        size_t queued = 0;
+        for (size_t i = 0; i < count; i++) {
+            while (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+                flush(queued);
+            }
+            uint32_t index = tail & sq_mask_;
+            sqes_[index] = entries[i];
+            sq_array_[index] = index;
+            tail++;
+            __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+            queued++;
+        }
+        while (queued > 0) {
+            flush(queued);
+        }
+    }
+
+    // Submits what is queued. Transient errors (the completion queue overflowing, say)
+    // leave queued as is for the caller to try again.
+    void flush(size_t& queued) {
+        int res = enter(queued, 0, 0);
+        if (res >= 0) {
+            queued -= res;
+            return;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            throw std::runtime_error("io_uring_enter failed");
+        }
+        std::this_thread::yield();
+    }
+
+    void reap() {
+        std::vector<std::pair<uint64_t, int32_t>> completions;
+        while (true) {
+            int res = enter(0, 1, IORING_ENTER_GETEVENTS);
+            if (res < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            // Copy the completions out and hand their slots back before running any of
+            // them, they may submit more.
+            completions.clear();
+            uint32_t head = *cq_head_;
+            uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++) {
+                const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+                completions.emplace_back(cqe.user_data, cqe.res);
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+            bool stop = false;
+            for (const auto& completion : completions) {
+                if (completion.first == 0) {
+                    stop = true;
+                    continue;
+                }
+                Op* op = reinterpret_cast<Op*>(completion.first);
+#if defined(__SANITIZE_THREAD__)
+                __tsan_acquire(op);
+#endif
+                op->done(completion.second);
+                delete op;
+                std::lock_guard<std::mutex> lock(inflight_mutex_);
+                if (--inflight_ == 0) {
+                    inflight_cv_.notify_all();
+                }
+            }
+            if (stop) {
+                return;
+            }
+        }
+    }
+
+    int fd_;
+    char* ring_;
+    size_t ring_size_;
+    io_uring_sqe* sqes_;
+    size_t sqes_size_;
+    uint32_t* sq_head_;
+    uint32_t* sq_tail_;
+    uint32_t sq_mask_;
+    uint32_t sq_entries_;
+    uint32_t* sq_array_;
+    uint32_t* cq_head_;
+    uint32_t* cq_tail_;
+    uint32_t cq_mask_;
+    io_uring_cqe* cqes_;
+
+    std::mutex submit_mutex_;
+    std::mutex inflight_mutex_;
+    std::condition_variable inflight_cv_;
+    size_t inflight_ = 0;
+    std::thread reaper_;
+};
+#endif
+
+// Sets up the async backend on first use, so stores that never call the async API
+// don't pay for the threads.
+template <typename Traits>
+typename BasicKVStore<Traits>::AsyncIo& BasicKVStore<Traits>::asyncIo() const {
+    std::call_once(async_once_, [this] {
+#ifdef KVSTORE_HAVE_IO_URING
+        // kDirect writes and syncs the log itself, see kickAsyncPuts.
+        if (options_.use_io_uring && options_.log_mode != LogMode::kDirect) {
+            async_io_ = IoUring::create(options_.io_uring_entries);
+        }
+#endif
+        if (!async_io_) {
+            async_io_ = std::make_unique<ThreadPoolIo>(options_.async_threads);
+        }
+    });
+    return *async_io_;
+}
+
+// Moves the putAsync records along after the watermarks changed. Completes the ones
+// that are durable now, or all of them once the log has failed, and starts a group
+// commit round on the async backend if there are more waiting and nobody is leading
+// one. Called with commit_mutex_ held; drops it while handing work to the backend,
+// which may run completions on this very thread.
+template <typename Traits>
+void BasicKVStore<Traits>::kickAsyncPuts(std::unique_lock<std::mutex>& lock) {
+    if (async_puts_.empty()) {
+        return;
+    }
+    std::vector<AsyncPut> done;
+    auto end = commit_failed_ ? async_puts_.end() : async_puts_.upper_bound(durable_);
+    for (auto it = async_puts_.begin(); it != end; ++it) {
+        done.push_back(std::move(it->second));
+    }
+    async_puts_.erase(async_puts_.begin(), end);
+
+    bool lead = !leader_active_ && !commit_failed_ && !async_puts_.empty() && written_ > durable_;
+    LogPos sync_pos = written_;
+    uint64_t sync_records = written_records_;
+    uint64_t sync_bytes = written_bytes_;
+    uint32_t first_file = posFile(durable_);
+    if (lead) {
+        leader_active_ = true;
+        round_start_ = std::chrono::steady_clock::now();
+    }
+    bool failed = commit_failed_;
+    lock.unlock();
+
+    for (auto& put : done) {
+        async_io_->post([this, failed, put = std::move(put)] {
+            std::exception_ptr error;
+            if (failed) {
+                error = std::make_exception_ptr(std::runtime_error("Failed to write to persistence file, must fail"));
+            } else {
+                const size_t header_size = Layout::kHeaderSize;
+                std::optional<std::string_view> value;
+                if (!put.is_deleted) {
+                    value = std::string_view(put.record->data() + header_size, put.record->size() - header_size);
+                }
+                updateStore(put.key, put.value_pos, put.is_deleted, value);
+                metrics_->add(Metrics::kBytesAppended, put.record->size());
+                metrics_->record(Metrics::kAppendLatency, put.start);
+            }
+            snapshots_->leave(put.epoch);
+            put.callback(error);
+            std::lock_guard<std::mutex> lock(commit_mutex_);
+            async_puts_pending_--;
+            commit_cv_.notify_all();
+        });
+    }
+    if (lead) {
+        auto sync_start = std::chrono::steady_clock::now();
+        typename AsyncIo::Done synced = [this, first_file, sync_pos, sync_records, sync_bytes,
+                                         sync_start](ssize_t res) {
+            metrics_->record(Metrics::kFsyncLatency, sync_start);
+            bool ok = res == 0;
+            if (ok) {
+                segmentsDurable(first_file, sync_pos);
+            }
+            std::unique_lock<std::mutex> lock(commit_mutex_);
+            finishBatch(ok, sync_pos, sync_records, sync_bytes);
+            kickAsyncPuts(lock);
+        };
+        if (options_.log_mode == LogMode::kDirect) {
+            // The staged blocks have to go out first. This is the thread pool, where
+            // blocking on a sync is what its sync() does anyway.
+            async_io_->post([this, first_file, sync_pos, synced = std::move(synced)] {
+                synced(syncSegments(first_file, sync_pos) ? 0 : -EIO);
+            });
+        } else {
+            std::vector<int> fds;
+            for (uint32_t file_id = first_file; file_id <= posFile(sync_pos); file_id += 2) {
+                fds.push_back(findSegment(file_id)->fd());
+            }
+            async_io_->sync(fds, std::move(synced));
+        }
+    }
+    lock.lock();
+}
+
+// ----------------------------------------------
+// HINT FILES
+// ----------------------------------------------
+// A hint file holds the keydir entries a segment contributes, one per key, so that
+// restore() can load the keydir without reading every value in the segment. Layout:
+//
+// | magic | segment size | entry count | key1 | offset1 | key2 | offset2 | ... | checksum |
+//
+// where offsets are 64-bit with the top bit set for tombstones, segment size is the
+// size of the segment the hint was made from and checksum covers everything before
+// it. A hint that doesn't check out or doesn't match its segment's size is ignored.
+
+namespace kvstore::detail {
+
+inline const uint32_t kHintMagic = 0x4B564831;  // "KVH1"
+inline const uint64_t kHintTombstoneBit = uint64_t(1) << 63;
+
+// FNV-1a, only needs to catch torn or stale hint files.
+inline uint32_t hint_checksum(const char* data, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ static_cast<uint8_t>(data[i])) * 16777619u;
+    }
+    return hash;
+}
+
+}  // namespace kvstore::detail
+
+template <typename Traits>
+std::string BasicKVStore<Traits>::hintPath(uint32_t file_id) const {
+    return segmentPath(file_id) + ".hint";
+}
+
+// Writes the hint for a sealed segment. Goes through a temporary file and a rename so
+// that a crash never leaves a half written hint behind under the real name.
+template <typename Traits>
+void BasicKVStore<Traits>::writeHint(uint32_t file_id, std::streamoff segment_size, const Hint_T& entries) const {
+    std::string data;
+    uint64_t size = segment_size;
+    uint64_t count = entries.size();
+    data.reserve(sizeof(kvstore::detail::kHintMagic) + sizeof(size) + sizeof(count) +
+                 entries.size() * (sizeof(K) + sizeof(uint64_t)) + sizeof(uint32_t));
+    data.append(reinterpret_cast<const char*>(&kvstore::detail::kHintMagic), sizeof(kvstore::detail::kHintMagic));
+    data.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    data.append(reinterpret_cast<const char*>(&count), sizeof(count));
+    for (const auto& entry : entries) {
+        uint64_t offset = entry.second.offset | (entry.second.is_deleted ? kvstore::detail::kHintTombstoneBit : 0);
+        data.append(reinterpret_cast<const char*>(&entry.first), sizeof(entry.first));
+        data.append(reinterpret_cast<const char*>(&offset), sizeof(offset));
+    }
+    uint32_t checksum = kvstore::detail::hint_checksum(data.data(), data.size());
+    data.append(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+
+    std::string path = hintPath(file_id);
+    std::string tmp_path = path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        throw std::runtime_error("Failed to open hint file");
+    }
+    bool ok = kvstore::detail::pwrite_fully(fd, data.data(), data.size(), 0) && fdatasync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::filesystem::remove(tmp_path);
+        throw std::runtime_error("Failed to write hint file");
+    }
+}
+
+// Loads a segment's keydir entries from its hint file. Returns false, without
+// touching the keydir, if there is no usable hint.
+template <typename Traits>
+bool BasicKVStore<Traits>::loadHint(uint32_t file_id, std::streamoff segment_size) {
+    std::ifstream in(hintPath(file_id), std::ios::binary);
+    if (!in.is_open()) {
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    const size_t header_size = sizeof(kvstore::detail::kHintMagic) + 2 * sizeof(uint64_t);
+    const size_t entry_size = sizeof(K) + sizeof(uint64_t);
+    uint32_t magic, checksum;
+    uint64_t size, count;
+    if (data.size() < header_size + sizeof(checksum)) {
+        return false;
+    }
+    memcpy(&magic, data.data(), sizeof(magic));
+    memcpy(&size, data.data() + sizeof(magic), sizeof(size));
+    memcpy(&count, data.data() + sizeof(magic) + sizeof(size), sizeof(count));
+    if (magic != kvstore::detail::kHintMagic || size != static_cast<uint64_t>(segment_size) ||
+        count != (data.size() - header_size - sizeof(checksum)) / entry_size ||
+        data.size() != header_size + count * entry_size + sizeof(checksum)) {
+        return false;
+    }
+    memcpy(&checksum, data.data() + data.size() - sizeof(checksum), sizeof(checksum));
+    if (checksum != kvstore::detail::hint_checksum(data.data(), data.size() - sizeof(checksum))) {
+        return false;
+    }
+
+    const char* entry = data.data() + header_size;
+    for (uint64_t i = 0; i < count; i++, entry += entry_size) {
+        K key;
+        uint64_t offset;
+        memcpy(&key, entry, sizeof(key));
+        memcpy(&offset, entry + sizeof(key), sizeof(offset));
+        const uint64_t tombstone_bit = kvstore::detail::kHintTombstoneBit;
+        updateStore(key, makePos(file_id, offset & ~tombstone_bit), (offset & tombstone_bit) != 0);
+    }
+    return true;
+}
+
+// Writes hints for the segments the group commit leader handed us as they got
+// sealed.
+template <typename Traits>
+void BasicKVStore<Traits>::writePendingHints() {
+    std::vector<uint32_t> file_ids;
+    {
+        std::lock_guard<std::mutex> lock(background_mutex_);
+        file_ids.swap(unhinted_);
+    }
+    // Keeps the segments from being merged away while we read them.
+    std::lock_guard<std::mutex> compaction_lock(compaction_mutex_);
+    for (uint32_t file_id : file_ids) {
+        std::streamoff segment_size;
+        {
+            tbb::spin_rw_mutex::scoped_lock lock(segments_mutex_, false);
+            auto it = segments_.find(file_id);
+            if (it == segments_.end()) {
+                continue;
+            }
+            // Preallocated segments are larger than their data.
+            segment_size = it->second->size();
+        }
+        Hint_T entries;
+        scanLog(segmentPath(file_id), [&](K key, std::streamoff value_offset, uint32_t value_length, std::string_view) {
+            entries[key] = {value_offset, value_length == kTombstone};
+        });
+        try {
+            writeHint(file_id, segment_size, entries);
+        } catch (const std::exception& e) {
+            std::cout << "Failed to write hint for segment " << file_id << ": " << e.what() << std::endl;
+        }
+    }
+}
+
+// ----------------------------------------------
+// COMPACTION
+// ----------------------------------------------
+
+// Folds every sealed segment into one compacted segment. Live records are copied in
+// log order, overwritten records are dropped, and so are tombstones since every record
+// they could shadow is part of the merge. The keydir is then pointed at the copies,
+// but only for keys it still has at the copied record (or earlier), so puts that land
+// during the merge win.
+template <typename Traits>
+void BasicKVStore<Traits>::compact() {
+    if (!shards_.empty()) {
+        // Each shard merges its own log, all of them in parallel.
+        std::vector<std::thread> threads;
+        std::vector<std::exception_ptr> errors(shards_.size());
+        for (size_t i = 0; i < shards_.size(); i++) {
+            threads.emplace_back([this, i, &errors] {
+                try {
+                    shards_[i]->compact();
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        for (const auto& error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+        return;
+    }
+    std::lock_guard<std::mutex> compaction_lock(compaction_mutex_);
+    if (snapshots_->openCount() > 0 || options_.follower) {
+        // A follower's log is the primary's to compact.
+        return;
+    }
+
+    // Everything in a segment before the one the durable watermark is in is sealed
+    // and on disk.
+    uint32_t durable_file;
+    {
+        std::lock_guard<std::mutex> lock(commit_mutex_);
+        durable_file = posFile(durable_);
+    }
+    std::vector<uint32_t> inputs;
+    {
+        tbb::spin_rw_mutex::scoped_lock lock(segments_mutex_, false);
+        for (const auto& segment : segments_) {
+            if (segment.first >= durable_file) {
+                break;
+            }
+            inputs.push_back(segment.first);
+        }
+    }
+    // The compacted segment takes the odd id right above the newest input, so there
+    // needs to be a regular segment to fold in.
+    if (inputs.empty() || inputs.back() % 2 == 1) {
+        return;
+    }
+    uint32_t output_id = inputs.back() + 1;
+    std::string output_path = segmentPath(output_id);
+    std::string tmp_path = output_path + ".compact";
+    int out_fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd == -1) {
+        throw std::runtime_error("Failed to open compaction file");
+    }
+
+    // What to do with the keydir entry of each record we looked at, in log order.
+    struct Move {
+        K key;
+        LogPos from;
+        std::streamoff to;
+        bool is_deleted;
+        bool dropped;
+    };
+    std::vector<Move> moves;
+    std::string buffer;
+    kvstore::detail::encode_segment_header(buffer, kvstore::detail::kSegmentVersionOf<Traits>);
+    std::streamoff output_size = 0;
+    bool ok = true;
+    const size_t kFlushSize = 1 << 20;
+    auto start = std::chrono::steady_clock::now();
+    auto flush = [&]() {
+        ok = ok && !stop_background_ &&
+             kvstore::detail::pwrite_fully(out_fd, buffer.data(), buffer.size(), output_size);
+        output_size += buffer.size();
+        buffer.clear();
+        if (options_.compaction_bytes_per_sec > 0) {
+            // Sleep off however far ahead of the allowed rate we are.
+            std::this_thread::sleep_until(start + std::chrono::microseconds(
+                output_size * 1000000 / options_.compaction_bytes_per_sec));
+        }
+    };
+
+    uint64_t scanned_records = 0;
+    for (uint32_t file_id : inputs) {
+        scanLog(segmentPath(file_id), [&](K key, std::streamoff value_offset, uint32_t value_length, std::string_view value) {
+            scanned_records++;
+            LogPos pos = makePos(file_id, value_offset);
+            bool current = false;
+            if (LogPos live = store_->find(key).pos) {
+                if (live > pos) {
+                    // Overwritten, this is the garbage we're here for.
+                    return;
+                }
+                current = live == pos;
+            }
+            // Otherwise the record is newer than the keydir. It belongs to a put
+            // that is durable but hasn't updated the keydir yet, so keep it.
+            if (value_length == kTombstone && current) {
+                moves.push_back({key, pos, 0, true, true});
+                return;
+            }
+            std::streamoff record_offset = output_size + buffer.size();
+            bool is_deleted = value_length == kTombstone;
+            auto checksum = is_deleted ? kvstore::detail::make_checksum<K>(key, kTombstone, std::nullopt)
+                                       : kvstore::detail::make_checksum<K>(key, value_length, value);
+            Layout::encode(buffer, checksum, key, value_length, is_deleted ? std::string_view() : value);
+            moves.push_back({key, pos, record_offset + static_cast<std::streamoff>(Layout::kPrefixSize), is_deleted,
+                             false});
+            if (buffer.size() >= kFlushSize) {
+                flush();
+            }
+        });
+    }
+    flush();
+    ok = ok && fdatasync(out_fd) == 0;
+    close(out_fd);
+    if (!ok) {
+        std::filesystem::remove(tmp_path);
+        if (stop_background_) {
+            return;
+        }
+        throw std::runtime_error("Failed to write compaction file");
+    }
+
+    // A snapshot that opened meanwhile may need the inputs. Otherwise no snapshot can
+    // open until they're gone, since it could see positions the swap is about to move.
+    std::unique_lock<std::mutex> snapshots_lock = snapshots_->lockOutSnapshots();
+    if (!snapshots_lock.owns_lock()) {
+        std::filesystem::remove(tmp_path);
+        return;
+    }
+
+    // Once the rename lands restore() treats the compacted segment as replacing
+    // everything older than it, even if we crash before deleting the inputs.
+    if (rename(tmp_path.c_str(), output_path.c_str()) != 0) {
+        std::filesystem::remove(tmp_path);
+        throw std::runtime_error("Failed to install compaction file");
+    }
+    kvstore::detail::sync_directory(persistence_file_);
+    if (options_.write_hints) {
+        Hint_T entries;
+        for (const auto& move : moves) {
+            if (!move.dropped) {
+                entries[move.key] = {move.to, move.is_deleted};
+            }
+        }
+        try {
+            writeHint(output_id, output_size, entries);
+        } catch (const std::exception& e) {
+            std::cout << "Failed to write hint for segment " << output_id << ": " << e.what() << std::endl;
+        }
+    }
+    auto output = std::make_unique<LogFile>(output_path, output_id, false, options_.mmap_chunk_size, output_size);
+    output->seal(output_size);
+    output->mapUpTo(output_size);
+    {
+        tbb::spin_rw_mutex::scoped_lock lock(segments_mutex_, true);
+        segments_.emplace(output_id, std::move(output));
+    }
+
+    uint64_t dropped_tombstones = 0;
+    for (const auto& move : moves) {
+        LogPos to = makePos(output_id, move.to);
+        dropped_tombstones += move.dropped;
+        typename KeyDir::Change change = store_->update(move.key, [&](typename KeyDir::Entry entry) {
+            if (entry.pos == 0) {
+                // Only a dropped tombstone of ours takes keys out of the keydir, so this
+                // is a put that hasn't made it to the keydir yet. It will see the copy
+                // and back off.
+                return move.dropped ? entry : typename KeyDir::Entry{to, move.is_deleted};
+            }
+            if (move.dropped) {
+                return entry.pos == move.from ? typename KeyDir::Entry() : entry;
+            }
+            // Copies are made in log order, so a key already pointing at an earlier copy
+            // moves forward too.
+            bool behind = (posFile(entry.pos) <= inputs.back() && entry.pos <= move.from) ||
+                          (posFile(entry.pos) == output_id && entry.pos < to);
+            if (!behind) {
+                return entry;
+            }
+            typename KeyDir::Entry moved{to, move.is_deleted};
+            // An inline value only goes along if it is the copied record's.
+            if (entry.pos == move.from && entry.hasInline()) {
+                moved.setInline(entry.inlineValue());
+            }
+            return moved;
+        });
+        metrics_->countChange(change);
+    }
+    // Every record that didn't get copied is gone from the log, and all of them were
+    // garbage except for the tombstones we dropped.
+    uint64_t copied_records = moves.size() - dropped_tombstones;
+    metrics_->add(Metrics::kLogRecords, -static_cast<int64_t>(scanned_records - copied_records));
+    metrics_->add(Metrics::kDeadRecords, -static_cast<int64_t>(scanned_records - moves.size()));
+
+    // Nothing in the keydir points at the inputs anymore. Readers that looked them up
+    // before the swap retry against the keydir.
+    std::vector<std::unique_ptr<LogFile>> retired;
+    {
+        tbb::spin_rw_mutex::scoped_lock lock(segments_mutex_, true);
+        for (uint32_t file_id : inputs) {
+            auto it = segments_.find(file_id);
+            retired.push_back(std::move(it->second));
+            segments_.erase(it);
+        }
+    }
+    for (const auto& file : retired) {
+        // Async reads that got to the segment before the swap are still on it.
+        while (file->pinned()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        std::filesystem::remove(file->path());
+        std::filesystem::remove(hintPath(file->id()));
+    }
+    kvstore::detail::sync_directory(persistence_file_);
+}
+
+// Background worker. Writes hints for segments as soon as they are sealed and durable
+// and, every compaction_interval, compacts once enough sealed segments have piled up
+// and enough of the log is garbage.
+template <typename Traits>
+void BasicKVStore<Traits>::backgroundLoop() {
+    const bool compaction_enabled = options_.compaction_interval.count() > 0;
+    auto next_compaction = std::chrono::steady_clock::now() + options_.compaction_interval;
+    auto has_work = [this] { return stop_background_ || !unhinted_.empty() || spare_wanted_ != 0; };
+
+    std::unique_lock<std::mutex> lock(background_mutex_);
+    while (!stop_background_) {
+        if (compaction_enabled) {
+            background_cv_.wait_until(lock, next_compaction, has_work);
+        } else {
+            background_cv_.wait(lock, has_work);
+        }
+        if (stop_background_) {
+            break;
+        }
+        lock.unlock();
+
+        prepareSpare();
+        writePendingHints();
+
+        if (compaction_enabled && std::chrono::steady_clock::now() >= next_compaction) {
+            next_compaction = std::chrono::steady_clock::now() + options_.compaction_interval;
+            uint32_t durable_file;
+            {
+                std::lock_guard<std::mutex> commit_lock(commit_mutex_);
+                durable_file = posFile(durable_);
+            }
+            size_t sealed = 0;
+            {
+                tbb::spin_rw_mutex::scoped_lock segments_lock(segments_mutex_, false);
+                for (const auto& segment : segments_) {
+                    sealed += segment.first < durable_file;
+                }
+            }
+            // A merge copies every live record, so it waits until enough of the log is
+            // garbage for that to pay off.
+            uint64_t records = metrics_->total(Metrics::kLogRecords);
+            uint64_t dead_records = std::min(metrics_->total(Metrics::kDeadRecords), records);
+            if (sealed >= options_.compaction_min_segments &&
+                dead_records >= options_.compaction_min_dead_ratio * records) {
+                try {
+                    compact();
+                } catch (const std::exception& e) {
+                    std::cout << "Compaction failed: " << e.what() << std::endl;
+                }
+            }
+        }
+        lock.lock();
+    }
+}
+
+// Installs the spare segment as file_id if prepareSpare has it ready, and asks for the
+// one after it either way. Returns false if the caller has to create the segment.
+template <typename Traits>
+bool BasicKVStore<Traits>::takeSpare(uint32_t file_id) {
+    uint32_t spare;
+    {
+        std::lock_guard<std::mutex> lock(background_mutex_);
+        spare = spare_ready_;
+        spare_ready_ = 0;
+        spare_wanted_ = file_id + 2;
+    }
+    background_cv_.notify_one();
+    std::string spare_path = segmentPath(spare) + ".tmp";
+    if (spare == file_id && rename(spare_path.c_str(), segmentPath(file_id).c_str()) == 0) {
+        return true;
+    }
+    if (spare != 0) {
+        std::error_code ec;
+        std::filesystem::remove(spare_path, ec);
+    }
+    return false;
+}
+
+// Preallocates and zero fills the segment the next roll wants under a temporary name,
+// header and all, so that the roll only has to rename it into place. A spare the log
+// rolled past before it was done is thrown away.
+template <typename Traits>
+void BasicKVStore<Traits>::prepareSpare() {
+    uint32_t file_id;
+    {
+        std::lock_guard<std::mutex> lock(background_mutex_);
+        file_id = spare_wanted_;
+        spare_wanted_ = 0;
+    }
+    if (file_id == 0) {
+        return;
+    }
+    std::string path = segmentPath(file_id) + ".tmp";
+    const std::streamoff capacity = options_.segment_size + Layout::kMaxRecordSize;
+    bool ok;
+    try {
+        LogFile file(path, file_id, true, 0, 0);
+        ok = file.preallocate(kvstore::detail::align_up(capacity, kvstore::detail::kDirectBlockSize), true) &&
+             file.writeHeader();
+    } catch (const std::exception&) {
+        ok = false;
+    }
+    std::lock_guard<std::mutex> lock(background_mutex_);
+    if (!ok || spare_wanted_ > file_id) {
+        // The roll makes do without, it doesn't need to know.
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+        return;
+    }
+    spare_ready_ = file_id;
+}
+
+// ----------------------------------------------
+// FOLLOWERS
+// ----------------------------------------------
+// A follower is a read-only store that tails the log of a primary on the same machine.
+// The primary publishes how far its log is durable through a small mapped file, and the
+// follower never reads past that, so it can't apply a record that a crash of the primary
+// would take back. Segments are read through descriptors the follower keeps open, which
+// lets it finish a segment the primary's merger has deleted meanwhile. Once it is past
+// every input of a merge it points its keydir at the compacted segment and lets the
+// inputs go.
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the durable mark is shared between processes");
+
+// The end of the durable part of a primary's log, in a file of its own that the primary
+// maps for writing and its followers map for reading. Publishing it is a store to shared
+// memory, not a syscall.
+template <typename Traits>
+class BasicKVStore<Traits>::DurableMark {
+ public:
+    DurableMark(const std::string& path, bool writable) {
+        int fd = writable ? open(path.c_str(), O_RDWR | O_CREAT, 0644) : open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw std::runtime_error(writable ? "Failed to open durable mark" : "Store has no primary to follow");
+        }
+        struct stat st;
+        bool ok = writable ? ftruncate(fd, sizeof(uint64_t)) == 0
+                           : fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(uint64_t));
+        void* addr = ok ? mmap(nullptr, sizeof(uint64_t), writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+                               fd, 0)
+                        : MAP_FAILED;
+        close(fd);
+        if (addr == MAP_FAILED) {
+            throw std::runtime_error("Failed to map durable mark");
+        }
+        mark_ = static_cast<std::atomic<uint64_t>*>(addr);
+    }
+    ~DurableMark() { munmap(mark_, sizeof(uint64_t)); }
+
+    void publish(LogPos pos) { mark_->store(pos, std::memory_order_release); }
+    LogPos load() const { return mark_->load(std::memory_order_acquire); }
+
+ private:
+    std::atomic<uint64_t>* mark_;
+};
+
+// The ids of the segments the log is made of right now, oldest first: the newest
+// compacted segment, if any, and the regular segments after it. Unlike restore() this
+// leaves every file alone, they are the primary's.
+template <typename Traits>
+std::vector<uint32_t> BasicKVStore<Traits>::segmentIds() const {
+    namespace fs = std::filesystem;
+    fs::path base(persistence_file_);
+    fs::path dir = base.has_parent_path() ? base.parent_path() : fs::path(".");
+    std::string prefix = base.filename().string() + ".";
+
+    std::vector<uint32_t> file_ids;
+    std::error_code error;
+    if (fs::exists(base, error)) {
+        file_ids.push_back(0);
+    }
+    // The primary creates and deletes segments while we look.
+    for (fs::directory_iterator it(dir, error), end; !error && it != end; it.increment(error)) {
+        std::string name = it->path().filename().string();
+        if (name.compare(0, prefix.size(), prefix) != 0) {
+            continue;
+        }
+        std::string suffix = name.substr(prefix.size());
+        if (!suffix.empty() && suffix.size() <= 9 &&
+            std::all_of(suffix.begin(), suffix.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+            if (uint32_t file_id = std::stoul(suffix)) {
+                file_ids.push_back(file_id);
+            }
+        }
+    }
+    if (error) {
+        throw std::runtime_error("Failed to list persistence directory");
+    }
+    std::sort(file_ids.begin(), file_ids.end());
+    auto compacted = std::find_if(file_ids.rbegin(), file_ids.rend(), [](uint32_t file_id) { return file_id % 2 == 1; });
+    if (compacted != file_ids.rend()) {
+        file_ids.erase(file_ids.begin(), compacted.base() - 1);
+    }
+    return file_ids;
+}
+
+// Maps the primary's durable mark, opens the segments its log is made of and applies
+// them up to the mark.
+template <typename Traits>
+void BasicKVStore<Traits>::openFollower() {
+    if (std::filesystem::exists(persistence_file_ + ".shards")) {
+        throw std::runtime_error("Store is sharded, follow each of its shards");
+    }
+    durable_mark_ = std::make_unique<DurableMark>(persistence_file_ + ".durable", false);
+    std::vector<uint32_t> file_ids = segmentIds();
+    if (file_ids.empty()) {
+        throw std::runtime_error("Store has no primary to follow");
+    }
+    uint32_t first_id = file_ids.front();
+    if (first_id % 2 == 1) {
+        // The keydir starts out based on the compacted segment.
+        std::string path = segmentPath(first_id);
+        auto file = std::make_unique<LogFile>(path, first_id, false, options_.mmap_chunk_size,
+                                              std::filesystem::file_size(path));
+        segments_.emplace(first_id, std::move(file));
+        follow_base_ = first_id;
+    }
+    follow_pos_ = makePos(first_id, 0);
+    openNewSegments(first_id);
+    follow();
+}
+
+// Opens the regular segments from from_id on that the follower hasn't opened yet.
+// Returns the id of the newest compacted segment, or 0 if there is none.
+template <typename Traits>
+uint32_t BasicKVStore<Traits>::openNewSegments(uint32_t from_id) {
+    const std::streamoff active_capacity = options_.segment_size + Layout::kMaxRecordSize;
+    uint32_t compacted_id = 0;
+    for (uint32_t file_id : segmentIds()) {
+        if (file_id % 2 == 1) {
+            compacted_id = file_id;
+            continue;
+        }
+        if (file_id < from_id) {
+            continue;
+        }
+        {
+            tbb::spin_rw_mutex::scoped_lock lock(segments_mutex_, false);
+            if (segments_.count(file_id) != 0) {
+                continue;
+            }
+        }
+        std::string path = segmentPath(file_id);
+        std::unique_ptr<LogFile> file;
+        try {
+            file = std::make_unique<LogFile>(path, file_id, false, options_.mmap_chunk_size, active_capacity);
+        } catch (const std::runtime_error&) {
+            if (std::filesystem::exists(path)) {
+                throw;
+            }
+            // Merged away since we looked. follow() finds out if it needed it.
+            continue;
+        }
+        tbb::spin_rw_mutex::scoped_lock lock(segments_mutex_, true);
+        segments_.emplace(file_id, std::move(file));
+    }
+    return compacted_id;
+}
+
+// Applies the primary's log from follow_pos_ up to its durable mark. Called with
+// follow_mutex_ held.
+template <typename Traits>
+void BasicKVStore<Traits>::follow() {
+    LogPos durable = durable_mark_->load();
+    while (follow_pos_ < durable) {
+        uint32_t file_id = posFile(follow_pos_);
+        LogFile* file = findSegment(file_id);
+        // The primary has moved on from segments before the one the mark is in, so those
+        // end at their last good record. Anywhere else a bad record is corruption.
+        bool sealed = posFile(durable) > file_id;
+        std::streamoff end = sealed ? file->size() : posOffset(durable);
+        std::streamoff offset = posOffset(follow_pos_);
+        {
+            typename Snapshots::Writer writer(*snapshots_);
+            if (offset == 0 && sealed && loadHint(file_id, end)) {
+                offset = end;
+            } else {
+                Reader reader(file->fd(), end);
+                offset = std::max(offset, reader.dataStart());
+                typename Reader::Record record;
+                while (offset < end) {
+                    size_t size = reader.parse(offset, record);
+                    if (size == 0) {
+                        break;
+                    }
+                    if (!record.isMarker()) {
+                        bool is_deleted = record.value_length == kTombstone;
+                        updateStore(record.key, makePos(file_id, record.value_offset), is_deleted,
+                                    is_deleted ? std::nullopt : std::optional<std::string_view>(record.value));
+                    }
+                    offset += size;
+                }
+                if (!sealed && offset < end) {
+                    throw std::runtime_error("Corrupted record in the primary's log");
+                }
+            }
+        }
+        file->mapUpTo(offset);
+
+        LogPos pos = makePos(file_id, offset);
+        if (sealed) {
+            file->seal(offset);
+            // Regular segments have even ids, after a compacted or a legacy one.
+            uint32_t next_id = file_id + (file_id % 2 == 1 ? 1 : 2);
+            uint32_t compacted_id = openNewSegments(next_id);
+            if (compacted_id > follow_base_ && compacted_id <= file_id + 1) {
+                // Every input of that merge is applied.
+                rebase(compacted_id);
+            }
+            if (follow_base_ != 0 && segments_.begin()->first < follow_base_) {
+                retireReplaced();
+            }
+            {
+                tbb::spin_rw_mutex::scoped_lock lock(segments_mutex_, false);
+                if (segments_.count(next_id) == 0) {
+                    throw std::runtime_error("Follower fell behind a merge on the primary, reopen it");
+                }
+            }
+            pos = makePos(next_id, 0);
+        }
+        follow_pos_ = pos;
+        std::lock_guard<std::mutex> lock(commit_mutex_);
+        tail_ = pos;
+        written_ = pos;
+        durable_ = pos;
+        commit_cv_.notify_all();
+    }
+}
+
+// Points the keydir entries into the segments a compacted segment replaced at its
+// copies instead, so that those segments can be let go. Called with follow_mutex_ held
+// once every one of them is applied.
+template <typename Traits>
+void BasicKVStore<Traits>::rebase(uint32_t compacted_id) {
+    // Same as for a merge, no snapshot may see the entries move.
+    std::unique_lock<std::mutex> snapshots_lock = snapshots_->lockOutSnapshots();
+    if (!snapshots_lock.owns_lock()) {
+        return;
+    }
+    std::string path = segmentPath(compacted_id);
+    std::error_code error;
+    std::streamoff size = std::filesystem::file_size(path, error);
+    std::unique_ptr<LogFile> file;
+    try {
+        file = error ? nullptr
+                     : std::make_unique<LogFile>(path, compacted_id, false, options_.mmap_chunk_size, size);
+    } catch (const std::runtime_error&) {
+        if (std::filesystem::exists(path)) {
+            throw;
+        }
+    }
+    if (!file) {
+        // A newer merge replaced it already, we rebase onto that one later.
+        return;
+    }
+    file->seal(size);
+    file->mapUpTo(size);
+
+    // A merge may copy more than one record of a key, in log order, when it raced
+    // with puts. The last copy is the record the follower has.
+    Hint_T copies;
+    Reader reader(file->fd(), size);
+    typename Reader::Record record;
+    std::streamoff offset = reader.dataStart();
+    while (size_t record_size = reader.parse(offset, record)) {
+        if (!record.isMarker()) {
+            copies[record.key] = {record.value_offset, record.value_length == kTombstone};
+        }
+        offset += record_size;
+    }
+    {
+        tbb::spin_rw_mutex::scoped_lock lock(segments_mutex_, true);
+        segments_.emplace(compacted_id, std::move(file));
+    }
+    for (const auto& copy : copies) {
+        LogPos to = makePos(compacted_id, copy.second.offset);
+        typename KeyDir::Change change = store_->update(copy.first, [&](typename KeyDir::Entry entry) {
+            // Entries past the merge's inputs are newer than the copy.
+            if (entry.pos == 0 || posFile(entry.pos) >= compacted_id) {
+                return entry;
+            }
+            typename KeyDir::Entry moved{to, copy.second.is_deleted};
+            if (entry.hasInline()) {
+                moved.setInline(entry.inlineValue());
+            }
+            return moved;
+        });
+        metrics_->countChange(change);
+    }
+    follow_base_ = compacted_id;
+}
+
+// Lets go of the segments older than follow_base_ once no keydir entry points into
+// them. Entries that still do belong to tombstones the merge dropped, which can go too,
+// or to keys the primary overwrote before it merged with a record the follower hasn't
+// applied yet, which hold the segments back until it has.
+template <typename Traits>
+void BasicKVStore<Traits>::retireReplaced() {
+    std::unique_lock<std::mutex> snapshots_lock = snapshots_->lockOutSnapshots();
+    if (!snapshots_lock.owns_lock()) {
+        return;
+    }
+    bool stragglers = false;
+    std::vector<K> tombstones;
+    store_->scan(0, ~K(0), [&](K key, typename KeyDir::Entry entry) {
+        if (posFile(entry.pos) < follow_base_) {
+            if (entry.is_deleted) {
+                tombstones.push_back(key);
+            } else {
+                stragglers = true;
+            }
+        }
+        return true;
+    });
+    for (K key : tombstones) {
+        typename KeyDir::Change change = store_->update(key, [&](typename KeyDir::Entry entry) {
+            return entry.is_deleted && posFile(entry.pos) < follow_base_ ? typename KeyDir::Entry() : entry;
+        });
+        metrics_->countChange(change);
+    }
+    if (stragglers) {
+        return;
+    }
+
+    std::vector<std::unique_ptr<LogFile>> retired;
+    {
+        tbb::spin_rw_mutex::scoped_lock lock(segments_mutex_, true);
+        while (segments_.begin()->first < follow_base_) {
+            retired.push_back(std::move(segments_.begin()->second));
+            segments_.erase(segments_.begin());
+        }
+    }
+    for (const auto& file : retired) {
+        // Async reads that got to the segment before the swap are still on it.
+        while (file->pinned()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
+
+template <typename Traits>
+uint64_t BasicKVStore<Traits>::catchUp() {
+    if (!options_.follower) {
+        throw std::runtime_error("Store is not a follower");
+    }
+    std::lock_guard<std::mutex> lock(follow_mutex_);
+    if (follow_error_) {
+        std::rethrow_exception(follow_error_);
+    }
+    try {
+        follow();
+    } catch (...) {
+        follow_error_ = std::current_exception();
+        std::lock_guard<std::mutex> commit_lock(commit_mutex_);
+        follow_stopped_ = true;
+        commit_cv_.notify_all();
+        throw;
+    }
+    return durableEnd();
+}
+
+// Background worker of a follower. Catches up every follow_interval until the follower
+// can't follow anymore.
+template <typename Traits>
+void BasicKVStore<Traits>::followLoop() {
+    std::unique_lock<std::mutex> lock(background_mutex_);
+    while (!stop_background_) {
+        background_cv_.wait_for(lock, options_.follow_interval, [this] { return stop_background_.load(); });
+        if (stop_background_) {
+            break;
+        }
+        lock.unlock();
+        try {
+            catchUp();
+        } catch (const std::exception& e) {
+            std::cout << "Follower stopped: " << e.what() << std::endl;
+            return;
+        }
+        lock.lock();
+    }
+}
+
+// ----------------------------------------------------------------------------------------
+
+// Helper function to commit a key-value pair to the database.
+template <typename Traits>
+void BasicKVStore<Traits>::doPut(K key, std::optional<std::string_view> value, Durability durability) {
+    typename Snapshots::Writer writer(*snapshots_);
+    uint32_t value_size = value ? value->size() : kTombstone;
+    // The header is encoded on the stack and goes out with the value in one pwritev,
+    // so a put doesn't allocate.
+    // A tombstone of fixed-size values goes out padded to the stride.
+    char header[Layout::kStride] = {};
+    Layout::encodeHeader(header, kvstore::detail::make_checksum<K>(key, value_size, value), key, value_size);
+    // Unless the caller asked for kAsync, only returns once the record is durable,
+    // so the store_ never points readers at data that could still be lost.
+    LogPos record_pos = appendToLog(std::string_view(header, value ? Layout::kHeaderSize : Layout::kStride),
+                                    value.value_or(std::string_view()), durability);
+    LogPos value_pos = record_pos + Layout::kPrefixSize;
+    updateStore(key, value_pos, !value, value);
+}
+
+// Points key at the record whose value is at value_pos, unless the store_ already
+// points somewhere later in the log.
+// value is the put's value if the caller has it at hand, to keep inline if it's small.
+template <typename Traits>
+void BasicKVStore<Traits>::updateStore(K key, LogPos value_pos, bool is_deleted,
+                                       std::optional<std::string_view> value) {
+    typename KeyDir::Entry entry{value_pos, is_deleted};
+    if (value && options_.inline_value_bytes > 0 && value->size() <= options_.inline_value_bytes) {
+        entry.setInline(*value);
+    }
+    // Someone else may have appended to the log after us and updated the store_
+    // already. Let's respect the log's ordering.
+    typename KeyDir::Change change = snapshots_->advance(*store_, key, entry);
+    metrics_->countChange(change);
+    metrics_->add(Metrics::kLogRecords);
+    // Whichever of the two records lost is garbage now.
+    if (change.before.pos != 0) {
+        metrics_->add(Metrics::kDeadRecords);
+    }
+}
+
+// Keeps value, just read from pos, inline in key's entry if it's small enough and the
+// entry still points at pos. Entries loaded from hint files or moved by a merge come
+// without their values, this fills them in on their first read.
+template <typename Traits>
+void BasicKVStore<Traits>::inlineValue(K key, LogPos pos, std::string_view value) const {
+    if (options_.inline_value_bytes == 0 || value.size() > options_.inline_value_bytes) {
+        return;
+    }
+    typename KeyDir::Change change = store_->update(key, [&](typename KeyDir::Entry entry) {
+        if (entry.pos == pos && !entry.is_deleted && !entry.hasInline()) {
+            entry.setInline(value);
+        }
+        return entry;
+    });
+    metrics_->countChange(change);
+}
+
+// Reads the value at each of refs into values[ref.index]. The reads go in log order so
+// that they sweep through the segments instead of jumping around. Returns the indexes
+// of the refs whose segment got merged away since the caller looked at the keydir.
+template <typename Traits>
+std::vector<size_t> BasicKVStore<Traits>::readValues(std::vector<ValueRef>& refs,
+                                                     std::vector<std::optional<V>>& values) const {
+    std::sort(refs.begin(), refs.end(), [](const ValueRef& a, const ValueRef& b) { return a.pos < b.pos; });
+    std::vector<size_t> retries;
+    tbb::spin_rw_mutex::scoped_lock lock(segments_mutex_, false);
+    for (const auto& ref : refs) {
+        V value;
+        if (value_cache_ && value_cache_->lookup(ref.pos, value)) {
+            values[ref.index] = std::move(value);
+            continue;
+        }
+        auto it = segments_.find(posFile(ref.pos));
+        if (it == segments_.end()) {
+            retries.push_back(ref.index);
+            continue;
+        }
+        if (getValueFromOffset(*it->second, posOffset(ref.pos), value)) {
+            if (value_cache_) {
+                value_cache_->insert(ref.pos, value);
+            }
+            values[ref.index] = std::move(value);
+        }
+    }
+    return retries;
+}
+
+// get() as of position at.
+template <typename Traits>
+std::optional<typename BasicKVStore<Traits>::V> BasicKVStore<Traits>::getAt(K key, LogPos at) const {
+    V value;
+    if (!getAt(key, at, value)) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+// get() as of position at, into value. Doesn't allocate unless value's buffer has to
+// grow (or the value cache takes a copy).
+template <typename Traits>
+bool BasicKVStore<Traits>::getAt(K key, LogPos at, V& value) const {
+    while (true) {
+        typename KeyDir::Entry location = snapshots_->find(*store_, key, at);
+        if (location.pos == 0 || location.is_deleted) {
+            return false;
+        }
+        if (location.hasInline()) {
+            Traits::decode(location.inline_value, location.inline_size, value);
+            return true;
+        }
+        LogPos pos = location.pos;
+        if (value_cache_ && value_cache_->lookup(pos, value)) {
+            return true;
+        }
+        tbb::spin_rw_mutex::scoped_lock lock(segments_mutex_, false);
+        auto it = segments_.find(posFile(pos));
+        if (it != segments_.end()) {
+            bool found = getValueFromOffset(*it->second, posOffset(pos), value);
+            lock.release();
+            if (found) {
+                inlineValue(key, pos, Traits::bytes(value));
+                if (value_cache_) {
+                    value_cache_->insert(pos, value);
+                }
+            }
+            return found;
+        }
+        // The segment got merged away after we looked at the keydir, which points
+        // at the compacted copy by now. Snapshots keep merges from happening.
+    }
+}
+
+// multiGet() as of position at.
+template <typename Traits>
+std::vector<std::optional<typename BasicKVStore<Traits>::V>>
+BasicKVStore<Traits>::multiGetAt(const std::vector<K>& keys, LogPos at) const {
+    std::vector<std::optional<V>> values(keys.size());
+    std::vector<ValueRef> refs;
+    refs.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        typename KeyDir::Entry location = snapshots_->find(*store_, keys[i], at);
+        if (location.hasInline() && !location.is_deleted) {
+            Traits::decode(location.inline_value, location.inline_size, values[i].emplace());
+        } else if (location.pos != 0 && !location.is_deleted) {
+            refs.push_back({location.pos, i});
+        }
+    }
+    for (size_t index : readValues(refs, values)) {
+        values[index] = getAt(keys[index], at);
+    }
+    return values;
+}
+
+// scan() as of cut at.
+template <typename Traits>
+void BasicKVStore<Traits>::scanAt(K lo, K hi, const Cut& at,
+                                  const std::function<bool(K key, const V& value)>& fn) const {
+    std::vector<std::pair<K, V>> batch;
+    bool more = lo <= hi;
+    while (more) {
+        batch.clear();
+        more = nextBatch(lo, hi, at, batch);
+        for (const auto& [key, value] : batch) {
+            if (!fn(key, value)) {
+                return;
+            }
+        }
+    }
+}
+
+// Appends the next limit live keys from [lo, hi] and their values as of position at
+// to out, in key order, and moves lo past them. Returns false once the range is used
+// up. The keys come from one walk of the keydir and their values from one sweep
+// through the log. Keys that were added after at are in the keydir but resolve to no
+// entry, and ones that were removed since stay in the keydir while snapshots are open.
+template <typename Traits>
+bool BasicKVStore<Traits>::scanBatch(K& lo, K hi, LogPos at, size_t limit, std::vector<std::pair<K, V>>& out) const {
+    std::vector<K> keys;
+    std::vector<ValueRef> refs;
+    std::vector<std::pair<size_t, V>> inline_values;
+    bool more = false;
+    store_->scan(lo, hi, [&](K key, typename KeyDir::Entry entry) {
+        if (keys.size() == limit) {
+            // Start the next batch here, which also keeps lo from wrapping past hi.
+            lo = key;
+            more = true;
+            return false;
+        }
+        if (at != kLatest) {
+            entry = snapshots_->find(*store_, key, at);
+        }
+        if (entry.pos != 0 && !entry.is_deleted) {
+            if (entry.hasInline()) {
+                inline_values.emplace_back(keys.size(), V());
+                Traits::decode(entry.inline_value, entry.inline_size, inline_values.back().second);
+            } else {
+                refs.push_back({entry.pos, keys.size()});
+            }
+            keys.push_back(key);
+        }
+        return true;
+    });
+    std::vector<std::optional<V>> values(keys.size());
+    for (const auto& [index, value] : inline_values) {
+        values[index] = value;
+    }
+    for (size_t index : readValues(refs, values)) {
+        values[index] = getAt(keys[index], at);
+    }
+    for (size_t i = 0; i < keys.size(); i++) {
+        // Removed since we looked at the keydir.
+        if (values[i]) {
+            out.emplace_back(keys[i], std::move(*values[i]));
+        }
+    }
+    return more;
+}
+
+// ----------------------------------------------
+// SHARDS
+// ----------------------------------------------
+
+// Holds the batch across shards that is being written, if any, so that restore() can
+// finish it after a crash. The entry is laid out like a batch in the log: a batch
+// header record, whose checksum covers the records, followed by the batch's records.
+// The file is empty while no such batch is in flight.
+template <typename Traits>
+class BasicKVStore<Traits>::Journal {
+public:
+    explicit Journal(const std::string& path) : path_(path) {
+        fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ == -1) {
+            throw std::runtime_error("Failed to open batch journal");
+        }
+    }
+
+    ~Journal() { close(fd_); }
+
+    // The records of the batch in the journal, unless there is none or the crash tore
+    // it, in which case none of it got written to the shards either.
+    std::optional<std::string> pending() const {
+        std::ifstream in(path_, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        typename Reader::Record header;
+        size_t header_size = Reader::parse(data.data(), data.size(), 0, header, kvstore::detail::make_checksum<K>);
+        if (!header_size || header.value_length != kBatch) {
+            return std::nullopt;
+        }
+        return data.substr(header_size, header.key);
+    }
+
+    // Makes the batch durable in the journal before any shard sees it.
+    void begin(const std::string& records) {
+        if (in_flight_) {
+            // The last one failed half way, and finishing it is up to restore().
+            throw std::runtime_error("An earlier batch across shards failed, reopen the store");
+        }
+        uint32_t length = records.size();
+        std::string data;
+        data.reserve(Layout::kStride + length);
+        uint32_t checksum = kvstore::detail::make_checksum<K>(length, kBatch, std::string_view(records));
+        Layout::encode(data, checksum, length, kBatch, std::string_view());
+        data += records;
+        if (!kvstore::detail::pwrite_fully(fd_, data.data(), data.size(), 0) || fdatasync(fd_) != 0) {
+            throw std::runtime_error("Failed to write batch journal");
+        }
+        in_flight_ = true;
+    }
+
+    // Called once every shard has its part durably.
+    void clear() {
+        if (ftruncate(fd_, 0) != 0 || fdatasync(fd_) != 0) {
+            throw std::runtime_error("Failed to clear batch journal");
+        }
+        in_flight_ = false;
+    }
+
+private:
+    std::string path_;
+    int fd_;
+    bool in_flight_ = false;
+};
+
+// Opens the shard stores, all of them restoring in parallel, and finishes the batch
+// across shards that a crash interrupted, if any.
+template <typename Traits>
+void BasicKVStore<Traits>::openShards() {
+    namespace fs = std::filesystem;
+    // Keys find their shard by hash, so the shard count can't change once there is
+    // data. It is kept next to the shards to catch opening with another one.
+    std::string manifest_path = persistence_file_ + ".shards";
+    std::ifstream manifest(manifest_path);
+    if (manifest.is_open()) {
+        size_t shards = 0;
+        manifest >> shards;
+        if (shards != options_.shards) {
+            throw std::runtime_error("Store was created with " + std::to_string(shards) + " shards");
+        }
+    } else {
+        fs::path base(persistence_file_);
+        fs::path dir = base.has_parent_path() ? base.parent_path() : fs::path(".");
+        std::string prefix = base.filename().string() + ".";
+        bool unsharded = fs::exists(base);
+        if (fs::exists(dir)) {
+            for (const auto& entry : fs::directory_iterator(dir)) {
+                std::string name = entry.path().filename().string();
+                unsharded |= name.size() > prefix.size() && name.compare(0, prefix.size(), prefix) == 0 &&
+                             std::all_of(name.begin() + prefix.size(), name.end(), [](char c) { return c >= '0' && c <= '9'; });
+            }
+        }
+        if (unsharded) {
+            throw std::runtime_error("Store was created without shards");
+        }
+        std::string data = std::to_string(options_.shards) + "\n";
+        std::string tmp_path = manifest_path + ".tmp";
+        int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            throw std::runtime_error("Failed to open shard manifest");
+        }
+        bool ok = kvstore::detail::pwrite_fully(fd, data.data(), data.size(), 0) && fdatasync(fd) == 0;
+        close(fd);
+        if (!ok || rename(tmp_path.c_str(), manifest_path.c_str()) != 0) {
+            fs::remove(tmp_path);
+            throw std::runtime_error("Failed to write shard manifest");
+        }
+    }
+    journal_ = std::make_unique<Journal>(persistence_file_ + ".journal");
+    kvstore::detail::sync_directory(persistence_file_);
+
+    // The shards split the resources the options hand the store.
+    Options shard_options = options_;
+    shard_options.shards = 1;
+    shard_options.value_cache_bytes = options_.value_cache_bytes / options_.shards;
+    shard_options.async_threads = std::max<size_t>(1, options_.async_threads / options_.shards);
+    size_t recovery_threads = options_.recovery_threads ? options_.recovery_threads
+                                                        : std::max(1u, std::thread::hardware_concurrency());
+    shard_options.recovery_threads = std::max<size_t>(1, recovery_threads / options_.shards);
+    shards_.resize(options_.shards);
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors(options_.shards);
+    for (size_t i = 0; i < options_.shards; i++) {
+        threads.emplace_back([this, i, &shard_options, &errors] {
+            try {
+                shards_[i] = std::make_unique<BasicKVStore>(persistence_file_ + ".shard" + std::to_string(i),
+                                                            shard_options);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    if (auto records = journal_->pending()) {
+        // Any part of the batch may or may not have made it, so all of it is written
+        // again. It lands after whatever raced with it, which is fine since it never
+        // returned.
+        WriteBatch batch;
+        batch.records_ = std::move(*records);
+        for (size_t offset = 0; offset < batch.records_.size();) {
+            typename Reader::Record record;
+            size_t record_size = Reader::parse(batch.records_.data(), batch.records_.size(), offset, record,
+                                               kvstore::detail::make_checksum<K>);
+            if (record_size == 0 || record.isMarker()) {
+                throw std::runtime_error("Corrupt batch journal");
+            }
+            batch.ops_.push_back({record.key, static_cast<size_t>(record.value_offset),
+                                  record.value_length == kTombstone});
+            offset += record_size;
+        }
+        writeParts(batch);
+    }
+    journal_->clear();
+}
+
+// The shard a key lives in. Part of the on-disk format: Fibonacci hashing, then the
+// high bits scaled down to the shard count.
+template <typename Traits>
+size_t BasicKVStore<Traits>::shardOf(K key) const {
+    uint64_t hash = (static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ull) >> 32;
+    return (hash * shards_.size()) >> 32;
+}
+
+// Writes each shard's part of batch as a batch of its own, all of them in parallel.
+template <typename Traits>
+void BasicKVStore<Traits>::writeParts(const WriteBatch& batch) {
+    const size_t prefix_size = Layout::kPrefixSize;
+    std::vector<WriteBatch> parts(shards_.size());
+    for (size_t i = 0; i < batch.ops_.size(); i++) {
+        const typename WriteBatch::Op& op = batch.ops_[i];
+        size_t begin = op.value_offset - prefix_size;
+        size_t end = i + 1 < batch.ops_.size() ? batch.ops_[i + 1].value_offset - prefix_size : batch.records_.size();
+        WriteBatch& part = parts[shardOf(op.key)];
+        part.ops_.push_back({op.key, part.records_.size() + prefix_size, op.is_deleted});
+        part.records_.append(batch.records_, begin, end - begin);
+    }
+    std::vector<std::future<void>> writes;
+    for (size_t i = 0; i < parts.size(); i++) {
+        if (!parts[i].ops_.empty()) {
+            writes.push_back(std::async(std::launch::async, [this, i, &parts] {
+                // The journal gets cleared once this returns, so the part has to be
+                // durable by then.
+                shards_[i]->appendBatch(parts[i], Durability::kGroupCommit);
+            }));
+        }
+    }
+    std::exception_ptr error;
+    for (auto& write : writes) {
+        try {
+            write.get();
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+// Opens a snapshot in every shard from shard on. Each one's open() waits for its
+// writers in flight and then calls in to open the next, so that the innermost call
+// finds every shard drained. It reads all the durable watermarks at one instant, so
+// a write that returned before another started is never in the snapshot without it.
+template <typename Traits>
+void BasicKVStore<Traits>::openShardSnapshots(size_t shard, Cut& cut) const {
+    if (shard == shards_.size()) {
+        std::vector<std::unique_lock<std::mutex>> locks;
+        for (const auto& s : shards_) {
+            locks.emplace_back(s->commit_mutex_);
+        }
+        for (size_t i = 0; i < shards_.size(); i++) {
+            cut[i] = shards_[i]->durable_;
+        }
+        return;
+    }
+    shards_[shard]->snapshots_->open([this, shard, &cut] {
+        openShardSnapshots(shard + 1, cut);
+        return cut[shard];
+    });
+}
+
+// multiGet() across the shards as of cut at: each shard reads its keys in one sweep.
+template <typename Traits>
+std::vector<std::optional<typename BasicKVStore<Traits>::V>>
+BasicKVStore<Traits>::multiGetShards(const std::vector<K>& keys, const Cut& at) const {
+    std::vector<std::vector<K>> shard_keys(shards_.size());
+    std::vector<std::vector<size_t>> shard_indexes(shards_.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        size_t shard = shardOf(keys[i]);
+        shard_keys[shard].push_back(keys[i]);
+        shard_indexes[shard].push_back(i);
+    }
+    std::vector<std::optional<V>> values(keys.size());
+    for (size_t shard = 0; shard < shards_.size(); shard++) {
+        if (shard_keys[shard].empty()) {
+            continue;
+        }
+        auto shard_values = shards_[shard]->multiGetAt(shard_keys[shard], cutPos(at, shard));
+        for (size_t i = 0; i < shard_values.size(); i++) {
+            values[shard_indexes[shard][i]] = std::move(shard_values[i]);
+        }
+    }
+    return values;
+}
+
+// scanBatch() of the one log, or across the shards, as of cut at. Each shard scans its
+// share of a batch, and only the keys below the first key some shard stopped at are
+// kept since past it that shard hasn't looked yet.
+template <typename Traits>
+bool BasicKVStore<Traits>::nextBatch(K& lo, K hi, const Cut& at, std::vector<std::pair<K, V>>& out) const {
+    if (shards_.empty()) {
+        return scanBatch(lo, hi, cutPos(at, 0), kScanBatch, out);
+    }
+    size_t limit = kScanBatch / shards_.size() + 1;
+    size_t first = out.size();
+    bool more = false;
+    K stop = 0;
+    for (size_t i = 0; i < shards_.size(); i++) {
+        K next = lo;
+        if (shards_[i]->scanBatch(next, hi, cutPos(at, i), limit, out)) {
+            stop = more ? std::min(stop, next) : next;
+            more = true;
+        }
+    }
+    auto by_key = [](const std::pair<K, V>& a, const std::pair<K, V>& b) { return a.first < b.first; };
+    std::sort(out.begin() + first, out.end(), by_key);
+    if (more) {
+        auto end = std::lower_bound(out.begin() + first, out.end(), stop,
+                                    [](const std::pair<K, V>& entry, K key) { return entry.first < key; });
+        out.erase(end, out.end());
+        lo = stop;
+    }
+    return more;
+}
+
+// ----------------------------------------------
+// PUBLIC FUNCTIONS
+// ----------------------------------------------
+
+
+// Public API to store a key-value pair.
+template <typename Traits>
+void BasicKVStore<Traits>::put(K key, ValueArg value) {
+    put(key, value, options_.durability);
+}
+
+template <typename Traits>
+void BasicKVStore<Traits>::put(K key, ValueArg value, Durability durability) {
+    if (options_.follower) {
+        throw std::runtime_error("Store is a follower, write to its primary");
+    }
+    if (!shards_.empty()) {
+        shards_[shardOf(key)]->put(key, value, durability);
+        return;
+    }
+    std::string_view bytes = Traits::bytes(value);
+    if (bytes.size() > kMaxValueSize) {
+        throw std::runtime_error("Value size exceeds maximum allowed");
+    }
+    metrics_->add(Metrics::kPuts);
+    doPut(key, bytes, durability);
+}
+
+// Public API to commit a batch of puts and removes.
+template <typename Traits>
+void BasicKVStore<Traits>::write(const WriteBatch& batch) {
+    write(batch, options_.durability);
+}
+
+template <typename Traits>
+void BasicKVStore<Traits>::write(const WriteBatch& batch, Durability durability) {
+    if (options_.follower) {
+        throw std::runtime_error("Store is a follower, write to its primary");
+    }
+    if (batch.ops_.empty()) {
+        return;
+    }
+    if (!shards_.empty()) {
+        size_t shard = shardOf(batch.ops_.front().key);
+        if (std::all_of(batch.ops_.begin(), batch.ops_.end(),
+                        [&](const typename WriteBatch::Op& op) { return shardOf(op.key) == shard; })) {
+            shards_[shard]->write(batch, durability);
+            return;
+        }
+        metrics_->add(Metrics::kWrites);
+        if (batch.records_.size() > std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("WriteBatch too large");
+        }
+        std::lock_guard<std::mutex> lock(batch_mutex_);
+        journal_->begin(batch.records_);
+        writeParts(batch);
+        journal_->clear();
+        return;
+    }
+    metrics_->add(Metrics::kWrites);
+    if (batch.records_.size() > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("WriteBatch too large");
+    }
+    appendBatch(batch, durability);
+}
+
+// Helper function to commit a batch to the log and point the keydir at its records.
+template <typename Traits>
+void BasicKVStore<Traits>::appendBatch(const WriteBatch& batch, Durability durability) {
+    // A header record carrying the length and checksum of the whole batch goes in
+    // front of it. restore() drops the batch as a whole unless all of it is intact.
+    uint32_t length = batch.records_.size();
+    char header[Layout::kStride] = {};
+    uint32_t checksum = kvstore::detail::make_checksum<K>(length, kBatch, std::string_view(batch.records_));
+    Layout::encodeHeader(header, checksum, length, kBatch);
+    typename Snapshots::Writer writer(*snapshots_);
+    LogPos records_pos =
+        appendToLog(std::string_view(header, sizeof(header)), batch.records_, durability) + Layout::kStride;
+    for (const auto& op : batch.ops_) {
+        std::optional<std::string_view> value;
+        if (!op.is_deleted) {
+            uint32_t value_length = Traits::kValueSize;
+            if (!Layout::kFixed) {
+                memcpy(&value_length, batch.records_.data() + op.value_offset, sizeof(value_length));
+            }
+            value = std::string_view(batch.records_.data() + op.value_offset + Layout::kLengthSize, value_length);
+        }
+        updateStore(op.key, records_pos + op.value_offset, op.is_deleted, value);
+    }
+}
+
+template <typename Traits>
+void BasicKVStore<Traits>::WriteBatch::put(K key, ValueArg value) {
+    std::string_view bytes = Traits::bytes(value);
+    if (bytes.size() > kMaxValueSize) {
+        throw std::runtime_error("Value size exceeds maximum allowed");
+    }
+    ops_.push_back({key, records_.size() + Layout::kPrefixSize, false});
+    Layout::encode(records_, kvstore::detail::make_checksum<K>(key, bytes.size(), bytes), key, bytes.size(), bytes);
+}
+
+template <typename Traits>
+void BasicKVStore<Traits>::WriteBatch::remove(K key) {
+    ops_.push_back({key, records_.size() + Layout::kPrefixSize, true});
+    Layout::encode(records_, kvstore::detail::make_checksum<K>(key, kTombstone, std::nullopt), key, kTombstone,
+                   std::string_view());
+}
+
+template <typename Traits>
+void BasicKVStore<Traits>::WriteBatch::clear() {
+    records_.clear();
+    ops_.clear();
+}
+
+// Public API to retrieve a value by key.
+template <typename Traits>
+std::optional<typename BasicKVStore<Traits>::V> BasicKVStore<Traits>::get(K key) const {
+    if (!shards_.empty()) {
+        return shards_[shardOf(key)]->get(key);
+    }
+    metrics_->add(Metrics::kGets);
+    return getAt(key, kLatest);
+}
+
+template <typename Traits>
+bool BasicKVStore<Traits>::get(K key, V& value) const {
+    if (!shards_.empty()) {
+        return shards_[shardOf(key)]->get(key, value);
+    }
+    metrics_->add(Metrics::kGets);
+    return getAt(key, kLatest, value);
+}
+
+// Public API to retrieve several values at once.
+template <typename Traits>
+std::vector<std::optional<typename BasicKVStore<Traits>::V>>
+BasicKVStore<Traits>::multiGet(const std::vector<K>& keys) const {
+    metrics_->add(Metrics::kMultiGets);
+    return shards_.empty() ? multiGetAt(keys, kLatest) : multiGetShards(keys, Cut());
+}
+
+// Public API to walk the live keys in a range in key order.
+template <typename Traits>
+void BasicKVStore<Traits>::scan(K lo, K hi, const std::function<bool(K key, const V& value)>& fn) const {
+    metrics_->add(Metrics::kScans);
+    scanAt(lo, hi, Cut(), fn);
+}
+
+template <typename Traits>
+typename BasicKVStore<Traits>::Iterator BasicKVStore<Traits>::iterate(K lo, K hi) const {
+    metrics_->add(Metrics::kScans);
+    return Iterator(*this, lo, hi, Cut());
+}
+
+template <typename Traits>
+BasicKVStore<Traits>::Iterator::Iterator(const BasicKVStore& store, K lo, K hi, std::vector<uint64_t> at)
+    : store_(&store), next_(lo), hi_(hi), at_(std::move(at)), more_(lo <= hi) {
+    fill();
+}
+
+template <typename Traits>
+void BasicKVStore<Traits>::Iterator::next() {
+    if (++index_ == batch_.size()) {
+        fill();
+    }
+}
+
+template <typename Traits>
+void BasicKVStore<Traits>::Iterator::fill() {
+    batch_.clear();
+    index_ = 0;
+    // A batch can come back empty if all its keys got removed before their values
+    // were read.
+    while (batch_.empty() && more_) {
+        more_ = store_->nextBatch(next_, hi_, at_, batch_);
+    }
+}
+
+// Public API to make every write that has returned durable.
+template <typename Traits>
+void BasicKVStore<Traits>::flush() {
+    if (shards_.empty()) {
+        waitDurable(logEnd());
+        return;
+    }
+    std::vector<std::future<void>> flushes;
+    for (auto& shard : shards_) {
+        flushes.push_back(std::async(std::launch::async, [&shard] { shard->flush(); }));
+    }
+    for (auto& flush : flushes) {
+        flush.get();
+    }
+}
+
+template <typename Traits>
+uint64_t BasicKVStore<Traits>::logEnd() const {
+    if (!shards_.empty()) {
+        throw std::runtime_error("A sharded store has no single log end, use flush()");
+    }
+    // Reserved ranges included, so it covers writes that are still going too.
+    return tail_.load();
+}
+
+template <typename Traits>
+void BasicKVStore<Traits>::waitDurable(uint64_t end) {
+    if (!shards_.empty()) {
+        throw std::runtime_error("A sharded store has no single log end, use flush()");
+    }
+    std::unique_lock<std::mutex> lock(commit_mutex_);
+    if (options_.follower) {
+        // Nothing to sync here, the wait is for catchUp() to get to end.
+        commit_cv_.wait(lock, [&] { return durable_ >= end || follow_stopped_; });
+        if (durable_ < end) {
+            throw std::runtime_error("Follower stopped following its primary");
+        }
+        return;
+    }
+    commitOffset(lock, end);
+}
+
+template <typename Traits>
+uint64_t BasicKVStore<Traits>::durableEnd() const {
+    if (!shards_.empty()) {
+        throw std::runtime_error("A sharded store has no single log end, use flush()");
+    }
+    std::lock_guard<std::mutex> lock(commit_mutex_);
+    return durable_;
+}
+
+// Public API to open a snapshot.
+template <typename Traits>
+std::unique_ptr<typename BasicKVStore<Traits>::Snapshot> BasicKVStore<Traits>::snapshot() const {
+    // kAsync writes that returned are only in the snapshot once durable.
+    const_cast<BasicKVStore*>(this)->flush();
+    if (!shards_.empty()) {
+        // Either all of a batch that spans shards is in the snapshot or none of it.
+        std::lock_guard<std::mutex> lock(batch_mutex_);
+        Cut cut(shards_.size());
+        openShardSnapshots(0, cut);
+        return std::unique_ptr<Snapshot>(new Snapshot(*this, std::move(cut)));
+    }
+    LogPos pos = snapshots_->open([this] {
+        std::lock_guard<std::mutex> lock(commit_mutex_);
+        return durable_;
+    });
+    return std::unique_ptr<Snapshot>(new Snapshot(*this, {pos}));
+}
+
+template <typename Traits>
+BasicKVStore<Traits>::Snapshot::~Snapshot() {
+    if (store_->shards_.empty()) {
+        store_->snapshots_->close(positions_[0]);
+        return;
+    }
+    for (size_t i = 0; i < store_->shards_.size(); i++) {
+        store_->shards_[i]->snapshots_->close(positions_[i]);
+    }
+}
+
+template <typename Traits>
+std::optional<typename BasicKVStore<Traits>::V> BasicKVStore<Traits>::Snapshot::get(K key) const {
+    store_->metrics_->add(Metrics::kGets);
+    if (store_->shards_.empty()) {
+        return store_->getAt(key, positions_[0]);
+    }
+    size_t shard = store_->shardOf(key);
+    return store_->shards_[shard]->getAt(key, positions_[shard]);
+}
+
+template <typename Traits>
+std::vector<std::optional<typename BasicKVStore<Traits>::V>>
+BasicKVStore<Traits>::Snapshot::multiGet(const std::vector<K>& keys) const {
+    store_->metrics_->add(Metrics::kMultiGets);
+    if (store_->shards_.empty()) {
+        return store_->multiGetAt(keys, positions_[0]);
+    }
+    return store_->multiGetShards(keys, positions_);
+}
+
+template <typename Traits>
+void BasicKVStore<Traits>::Snapshot::scan(K lo, K hi, const std::function<bool(K key, const V& value)>& fn) const {
+    store_->metrics_->add(Metrics::kScans);
+    store_->scanAt(lo, hi, positions_, fn);
+}
+
+template <typename Traits>
+typename BasicKVStore<Traits>::Iterator BasicKVStore<Traits>::Snapshot::iterate(K lo, K hi) const {
+    store_->metrics_->add(Metrics::kScans);
+    return Iterator(*store_, lo, hi, positions_);
+}
+
+// Public API to retrieve a value by key without blocking on disk reads.
+template <typename Traits>
+void BasicKVStore<Traits>::getAsync(K key, GetCallback callback) const {
+    if (!shards_.empty()) {
+        shards_[shardOf(key)]->getAsync(key, std::move(callback));
+        return;
+    }
+    metrics_->add(Metrics::kAsyncGets);
+    std::optional<V> value;
+    std::exception_ptr error;
+    try {
+        AsyncIo& io = asyncIo();
+        while (true) {
+            typename KeyDir::Entry location = store_->find(key);
+            if (location.pos == 0 || location.is_deleted) {
+                break;
+            }
+            if (location.hasInline()) {
+                Traits::decode(location.inline_value, location.inline_size, value.emplace());
+                break;
+            }
+            LogPos pos = location.pos;
+            V cached;
+            if (value_cache_ && value_cache_->lookup(pos, cached)) {
+                value = std::move(cached);
+                break;
+            }
+            std::streamoff offset = posOffset(pos);
+            const size_t prefix_size = Layout::kPrefixSize;
+            const LogFile* file;
+            {
+                tbb::spin_rw_mutex::scoped_lock lock(segments_mutex_, false);
+                auto it = segments_.find(posFile(pos));
+                if (it == segments_.end()) {
+                    // Merged away since we looked at the keydir, try again.
+                    continue;
+                }
+                file = it->second.get();
+                // Mapped records are as good as in memory, no need to go async.
+                size_t record_size;
+                if (file->mappedRecord(offset, record_size)) {
+                    V data;
+                    if (getValueFromOffset(*file, offset, data)) {
+                        if (value_cache_) {
+                            value_cache_->insert(pos, data);
+                        }
+                        value = std::move(data);
+                    }
+                    break;
+                }
+                if (file->staged(offset - prefix_size)) {
+                    // So are records still staged for an O_DIRECT write.
+                    V data;
+                    if (getValueFromOffset(*file, offset, data)) {
+                        if (value_cache_) {
+                            value_cache_->insert(pos, data);
+                        }
+                        value = std::move(data);
+                    }
+                    break;
+                }
+                file->pin();
+            }
+
+            // Same single read of the largest possible record as getValueFromOffset.
+            size_t size = Layout::kMaxRecordSize;
+            std::shared_ptr<char[]> buf(new char[size]);
+            auto read_start = std::chrono::steady_clock::now();
+            try {
+                io.read(file->fd(), buf.get(), size, offset - prefix_size,
+                        [this, file, pos, offset, buf, callback, read_start](ssize_t res) {
+                            metrics_->record(Metrics::kFileReadLatency, read_start);
+                            std::optional<V> value;
+                            std::exception_ptr error;
+                            try {
+                                if (res < 0) {
+                                    throw std::runtime_error("Failed to read from persistence file");
+                                }
+                                V data;
+                                if (decodeValue(*file, offset, buf.get(), res, data)) {
+                                    if (value_cache_) {
+                                        value_cache_->insert(pos, data);
+                                    }
+                                    value = std::move(data);
+                                }
+                            } catch (...) {
+                                error = std::current_exception();
+                            }
+                            file->unpin();
+                            callback(std::move(value), error);
+                        });
+            } catch (...) {
+                file->unpin();
+                throw;
+            }
+            return;
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+    callback(std::move(value), error);
+}
+
+template <typename Traits>
+std::future<std::optional<typename BasicKVStore<Traits>::V>> BasicKVStore<Traits>::getAsync(K key) const {
+    auto promise = std::make_shared<std::promise<std::optional<V>>>();
+    auto future = promise->get_future();
+    getAsync(key, [promise](std::optional<V> value, std::exception_ptr error) {
+        if (error) {
+            promise->set_exception(error);
+        } else {
+            promise->set_value(std::move(value));
+        }
+    });
+    return future;
+}
+
+// Public API to store a key-value pair without blocking on the write or the sync.
+template <typename Traits>
+void BasicKVStore<Traits>::putAsync(K key, V value, PutCallback callback) {
+    if (options_.follower) {
+        throw std::runtime_error("Store is a follower, write to its primary");
+    }
+    if (!shards_.empty()) {
+        shards_[shardOf(key)]->putAsync(key, std::move(value), std::move(callback));
+        return;
+    }
+    std::string_view bytes = Traits::bytes(value);
+    if (bytes.size() > kMaxValueSize) {
+        throw std::runtime_error("Value size exceeds maximum allowed");
+    }
+    metrics_->add(Metrics::kAsyncPuts);
+    doPutAsync(key, bytes, std::move(callback));
+}
+
+template <typename Traits>
+std::future<void> BasicKVStore<Traits>::putAsync(K key, V value) {
+    auto promise = std::make_shared<std::promise<void>>();
+    auto future = promise->get_future();
+    putAsync(key, std::move(value), [promise](std::exception_ptr error) {
+        if (error) {
+            promise->set_exception(error);
+        } else {
+            promise->set_value();
+        }
+    });
+    return future;
+}
+
+// Public API to remove a key without blocking on the write or the sync.
+template <typename Traits>
+void BasicKVStore<Traits>::removeAsync(K key, PutCallback callback) {
+    if (options_.follower) {
+        throw std::runtime_error("Store is a follower, write to its primary");
+    }
+    if (!shards_.empty()) {
+        shards_[shardOf(key)]->removeAsync(key, std::move(callback));
+        return;
+    }
+    metrics_->add(Metrics::kRemoves);
+    if (!exists(key)) {
+        // Same as remove, nothing to write.
+        callback(nullptr);
+        return;
+    }
+    doPutAsync(key, std::nullopt, std::move(callback));
+}
+
+template <typename Traits>
+std::future<void> BasicKVStore<Traits>::removeAsync(K key) {
+    auto promise = std::make_shared<std::promise<void>>();
+    auto future = promise->get_future();
+    removeAsync(key, [promise](std::exception_ptr error) {
+        if (error) {
+            promise->set_exception(error);
+        } else {
+            promise->set_value();
+        }
+    });
+    return future;
+}
+
+// Helper function to commit a key-value pair, or a tombstone for key if value is
+// empty, to the database through the async backend.
+template <typename Traits>
+void BasicKVStore<Traits>::doPutAsync(K key, std::optional<std::string_view> value, PutCallback callback) {
+    auto start = std::chrono::steady_clock::now();
+    uint32_t value_size = value ? value->size() : kTombstone;
+    auto checksum = kvstore::detail::make_checksum<K>(key, value_size, value);
+    auto record = std::make_shared<std::string>();
+    record->reserve(Layout::recordSize(value_size));
+    Layout::encode(*record, checksum, key, value_size, value.value_or(std::string_view()));
+    bool is_deleted = !value;
+    AsyncIo& io = asyncIo();
+
+    {
+        std::lock_guard<std::mutex> lock(commit_mutex_);
+        async_puts_pending_++;
+    }
+    // Stays registered until the completion has updated the keydir.
+    unsigned epoch = snapshots_->enter();
+    LogPos pos;
+    try {
+        pos = reserveLog(record->size());
+    } catch (...) {
+        snapshots_->leave(epoch);
+        std::lock_guard<std::mutex> lock(commit_mutex_);
+        async_puts_pending_--;
+        commit_cv_.notify_all();
+        throw;
+    }
+    LogFile* file = findSegment(posFile(pos));
+    std::streamoff offset = posOffset(pos);
+    std::streamoff end_offset = offset + record->size();
+    if (end_offset >= static_cast<std::streamoff>(options_.segment_size)) {
+        // Ours is the record that fills the segment up. Rolling it over here rather
+        // than on the completion thread keeps other writers from waiting on our write.
+        rollSegment(*file, end_offset);
+    }
+
+    // From here on the outcome goes to the callback, just like it would with put
+    // once the record's range is reserved.
+    typename AsyncIo::Done done = [this, file, pos, offset, key, is_deleted, record, start, epoch,
+                                   callback = std::move(callback)](ssize_t res) mutable {
+        bool written = res == 0;
+        bool covered = written || writeSkipRecord(*file, offset, record->size());
+        std::unique_lock<std::mutex> lock(commit_mutex_);
+        if (covered) {
+            markWritten(pos, pos + record->size());
+        } else {
+            failWrite();
+        }
+        if (written) {
+            LogPos value_pos = pos + Layout::kPrefixSize;
+            async_puts_.emplace(pos + record->size(),
+                                AsyncPut{key, value_pos, is_deleted, record, start, std::move(callback), epoch});
+            kickAsyncPuts(lock);
+            return;
+        }
+        kickAsyncPuts(lock);
+        lock.unlock();
+        snapshots_->leave(epoch);
+        callback(std::make_exception_ptr(std::runtime_error("Failed to write to persistence file, must fail")));
+        lock.lock();
+        async_puts_pending_--;
+        commit_cv_.notify_all();
+    };
+    try {
+        if (file->direct()) {
+            // Only staged, nothing to wait for.
+            done(file->write(record->data(), record->size(), offset) ? 0 : -EIO);
+        } else {
+            io.write(file->fd(), record->data(), record->size(), offset, done);
+        }
+    } catch (...) {
+        // The range is ours either way, so it has to be accounted for.
+        done(-EIO);
+    }
+}
+
+// Public API to check whether a key has a live value.
+template <typename Traits>
+bool BasicKVStore<Traits>::exists(K key) const {
+    if (!shards_.empty()) {
+        return shards_[shardOf(key)]->exists(key);
+    }
+    typename KeyDir::Entry location = store_->find(key);
+    return location.pos != 0 && !location.is_deleted;
+}
+
+// Public API to remove a key from the store. Space is reclaimed once the
+// tombstone is compacted.
+template <typename Traits>
+void BasicKVStore<Traits>::remove(K key) {
+    remove(key, options_.durability);
+}
+
+template <typename Traits>
+void BasicKVStore<Traits>::remove(K key, Durability durability) {
+    if (options_.follower) {
+        throw std::runtime_error("Store is a follower, write to its primary");
+    }
+    // There are two main ways to go about this. Either write a tombstone tuple or
+    // do an in-place erase of the key from the store_. The first option is easy to
+    // reason about while allowing for concurrency at the cost of extra memory and
+    // storage. The second option would be more space-efficient but be more complex
+    // to implement correctly. If a remove is called concurrently with a put on the same
+    // key and the key's log message ends up before the tombstone, then care must be taken
+    // to make sure that the put does not write its entry to store_ after the key is erased
+    // from store_ by the call to remove(). One solution to this would be to hold a mutex
+    // on the data file from file append to when store_.erase is called. This would
+    // block other put and remove operations.
+    // We go with the in-memory tombstone approach. compact() gets rid of tombstones
+    // from the store_ once every record they could shadow has been merged away.
+
+    if (!shards_.empty()) {
+        shards_[shardOf(key)]->remove(key, durability);
+        return;
+    }
+    metrics_->add(Metrics::kRemoves);
+    if (exists(key)) {
+        // Could be the case that we append a redundant tombstone entry into the WAL. It could
+        // also be the case that the tuple detected by the exists call is different from the tuple
+        // deleted by the following line but that's fine.
+        doPut(key, std::nullopt, durability);
+    }
+
+    // If the key didn't exist then it's as if we executed the remove at the timepoint exists(key)
+    // read at.
+}
+
+#undef KVSTORE_HAVE_IO_URING
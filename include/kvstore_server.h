@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "kvstore.h"
+
+// TCP front end for a KVStore speaking a subset of the Redis protocol (RESP):
+// GET, SET, DEL, MGET, PING, INFO and QUIT. Keys are decimal 32-bit integers.
+//
+// Every reactor thread runs its own epoll loop over its own listening socket
+// (SO_REUSEPORT, so the kernel spreads connections over them) and the
+// connections it accepted. Requests are read and parsed in bulk, so a client
+// can pipeline as many as it likes; replies go out in request order. Reads and
+// writes go through getAsync/putAsync/removeAsync, so a reactor never blocks
+// on the disk, and writes from all connections share group commit rounds.
+class KVServer {
+public:
+    struct Options {
+        std::string host = "127.0.0.1";
+        // Zero picks a free port, see port().
+        uint16_t port = 6380;
+        // Reactor threads. Zero uses one per core.
+        size_t reactors = 0;
+        // Requests a connection can have in flight before the server stops
+        // reading from it until replies have gone out.
+        size_t max_pipeline = 1024;
+    };
+
+    // Starts serving store right away. Throws if it can't listen on the
+    // address.
+    KVServer(KVStore& store, const Options& options);
+    // Stops, see stop().
+    ~KVServer();
+
+    // The port the server listens on.
+    uint16_t port() const { return port_; }
+
+    // Closes every connection and waits for the requests in flight to finish.
+    void stop();
+
+private:
+    class Reactor;
+    struct Connection;
+
+    KVStore& store_;
+    Options options_;
+    uint16_t port_ = 0;
+    std::vector<std::unique_ptr<Reactor>> reactors_;
+    std::vector<std::thread> threads_;
+    std::atomic<bool> stopped_{false};
+};
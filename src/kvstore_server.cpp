@@ -0,0 +1,756 @@
+#include "kvstore_server.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+
+// ----------------------------------------------
+// PROTOCOL
+// ----------------------------------------------
+// Requests are RESP arrays of bulk strings, as sent by redis-cli and the client
+// libraries: *<n>\r\n followed by n times $<length>\r\n<bytes>\r\n. Inline requests,
+// a line of space separated words, work too so that the server can be poked with nc.
+
+// Largest request element we accept. Values are at most 4 KiB anyway.
+static const size_t kMaxBulkLength = 1 << 20;
+static const size_t kMaxArgs = 1 << 16;
+
+// Reads the \r\n terminated line starting at pos. Returns false if it isn't all there.
+static bool read_line(const std::string& in, size_t& pos, std::string_view& line) {
+    size_t end = in.find("\r\n", pos);
+    if (end == std::string::npos) {
+        return false;
+    }
+    line = std::string_view(in).substr(pos, end - pos);
+    pos = end + 2;
+    return true;
+}
+
+static bool parse_size(std::string_view text, size_t& value) {
+    if (text.empty() || text.size() > 10) {
+        return false;
+    }
+    value = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        value = value * 10 + (c - '0');
+    }
+    return true;
+}
+
+// Parses the request at pos into args, which point into in. Returns 1 and moves pos
+// past the request if it is complete, 0 if more bytes are needed, and -1 if it is
+// malformed.
+static int parse_request(const std::string& in, size_t& pos, std::vector<std::string_view>& args) {
+    size_t p = pos;
+    std::string_view line;
+    if (!read_line(in, p, line)) {
+        return in.size() - pos > kMaxBulkLength ? -1 : 0;
+    }
+    if (line.empty() || line[0] != '*') {
+        for (size_t start = 0; start < line.size();) {
+            size_t end = std::min(line.find(' ', start), line.size());
+            if (end > start) {
+                args.push_back(line.substr(start, end - start));
+            }
+            start = end + 1;
+        }
+        pos = p;
+        return 1;
+    }
+    size_t count;
+    if (!parse_size(line.substr(1), count) || count > kMaxArgs) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!read_line(in, p, line)) {
+            return 0;
+        }
+        size_t length;
+        if (line.empty() || line[0] != '$' || !parse_size(line.substr(1), length) || length > kMaxBulkLength) {
+            return -1;
+        }
+        if (in.size() - p < length + 2) {
+            return 0;
+        }
+        if (in.compare(p + length, 2, "\r\n") != 0) {
+            return -1;
+        }
+        args.push_back(std::string_view(in).substr(p, length));
+        p += length + 2;
+    }
+    pos = p;
+    return 1;
+}
+
+static bool parse_key(std::string_view text, KVStore::K& key) {
+    size_t value;
+    if (!parse_size(text, value) || value > std::numeric_limits<KVStore::K>::max()) {
+        return false;
+    }
+    key = static_cast<KVStore::K>(value);
+    return true;
+}
+
+static bool is_command(std::string_view arg, const char* name) {
+    return arg.size() == strlen(name) && strncasecmp(arg.data(), name, arg.size()) == 0;
+}
+
+static std::string error_reply(const std::string& message) {
+    return "-ERR " + message + "\r\n";
+}
+
+// Appends a bulk string reply for value, or a null one, to parts. The value itself
+// becomes a part of its own so it goes out without being copied again.
+static void append_bulk(std::vector<std::string>& parts, std::optional<KVStore::V> value) {
+    if (!value) {
+        parts.push_back("$-1\r\n");
+        return;
+    }
+    parts.push_back("$" + std::to_string(value->size()) + "\r\n");
+    parts.push_back(std::move(*value));
+    parts.push_back("\r\n");
+}
+
+// ----------------------------------------------
+// CONNECTIONS
+// ----------------------------------------------
+struct KVServer::Connection {
+    // A reply, possibly still waiting on the store. It is kept as a list of parts so
+    // that values can be sent straight from the strings the store handed back.
+    struct Reply {
+        bool ready = false;
+        std::vector<std::string> parts;
+    };
+
+    explicit Connection(int fd) : fd(fd) {}
+
+    int fd;
+    std::string in;              // bytes received
+    size_t parsed = 0;           // of in, turned into requests
+    std::deque<Reply> replies;   // in request order
+    uint64_t first_seq = 0;      // sequence number of replies.front()
+    size_t front_sent = 0;       // bytes of replies.front() already sent
+    size_t writes = 0;           // SETs and DELs waiting on the store
+    bool blocked = false;        // holding a request back until the writes are done
+    uint32_t events = 0;         // what the connection is registered for with epoll
+    bool closing = false;        // close once the replies are out
+    bool closed = false;
+};
+
+// ----------------------------------------------
+// REACTOR
+// ----------------------------------------------
+// One event loop thread. Owns its listening socket and every connection accepted on
+// it; store callbacks, which run on the store's I/O threads, hand their results back
+// through post().
+class KVServer::Reactor {
+    // The reactor whose run() is on this thread's stack, if any.
+    static thread_local Reactor* current_reactor;
+
+ public:
+    Reactor(KVServer& server, int listen_fd) : server_(server), store_(server.store_), listen_fd_(listen_fd) {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd_ == -1 || event_fd_ == -1) {
+            throw std::runtime_error("Failed to set up reactor");
+        }
+        watch(listen_fd_, EPOLLIN, EPOLL_CTL_ADD);
+        watch(event_fd_, EPOLLIN, EPOLL_CTL_ADD);
+    }
+
+    ~Reactor() {
+        for (auto& [fd, conn] : connections_) {
+            ::close(fd);
+            conn->closed = true;
+        }
+        ::close(listen_fd_);
+        ::close(event_fd_);
+        ::close(epoll_fd_);
+    }
+
+    void run() {
+        current_reactor = this;
+        epoll_event events[128];
+        while (!stopping_.load(std::memory_order_acquire)) {
+            int n = epoll_wait(epoll_fd_, events, 128, -1);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("epoll_wait failed");
+            }
+            for (int i = 0; i < n; i++) {
+                int fd = events[i].data.fd;
+                if (fd == listen_fd_) {
+                    acceptConnections();
+                    continue;
+                }
+                if (fd == event_fd_) {
+                    uint64_t count;
+                    while (read(event_fd_, &count, sizeof(count)) > 0) {
+                    }
+                    continue;
+                }
+                auto it = connections_.find(fd);
+                if (it == connections_.end()) {
+                    continue;
+                }
+                std::shared_ptr<Connection> conn = it->second;
+                if (events[i].events & EPOLLIN) {
+                    readRequests(conn);
+                } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    closeConnection(conn);
+                }
+                if (!conn->closed && (events[i].events & EPOLLOUT)) {
+                    dirty_.push_back(conn);
+                }
+            }
+            runPosted();
+        }
+    }
+
+    // Makes run() return. Callable from any thread.
+    void stop() {
+        stopping_.store(true, std::memory_order_release);
+        wake();
+    }
+
+    // Runs fn on the reactor thread. Callable from any thread, including the reactor's
+    // own, where fn is queued until the current batch of events is handled.
+    void post(std::function<void()> fn) {
+        if (current_reactor == this) {
+            local_posted_.push_back(std::move(fn));
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(posted_mutex_);
+            posted_.push_back(std::move(fn));
+        }
+        wake();
+    }
+
+    // Store calls whose callback hasn't returned yet.
+    size_t pending() const { return pending_.load(std::memory_order_acquire); }
+
+ private:
+    void wake() {
+        uint64_t one = 1;
+        ssize_t res = write(event_fd_, &one, sizeof(one));
+        (void)res;  // only fails when the counter is already way past zero
+    }
+
+    void watch(int fd, uint32_t events, int op) {
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd_, op, fd, &event) != 0 && op != EPOLL_CTL_DEL) {
+            throw std::runtime_error("epoll_ctl failed");
+        }
+    }
+
+    void acceptConnections() {
+        while (true) {
+            int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd == -1) {
+                // EAGAIN once the backlog is empty. Anything else is about that one
+                // connection, which the client will notice.
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                return;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            auto conn = std::make_shared<Connection>(fd);
+            conn->events = EPOLLIN;
+            watch(fd, conn->events, EPOLL_CTL_ADD);
+            connections_.emplace(fd, std::move(conn));
+        }
+    }
+
+    // Runs what the store callbacks posted, then sends the replies that became ready.
+    // Batching them up this way turns a pipeline's worth of replies into one sendmsg.
+    void runPosted() {
+        while (true) {
+            std::vector<std::function<void()>> posted;
+            posted.swap(local_posted_);
+            {
+                std::lock_guard<std::mutex> lock(posted_mutex_);
+                if (posted.empty()) {
+                    posted.swap(posted_);
+                } else {
+                    std::move(posted_.begin(), posted_.end(), std::back_inserter(posted));
+                    posted_.clear();
+                }
+            }
+            std::vector<std::shared_ptr<Connection>> dirty;
+            dirty.swap(dirty_);
+            if (posted.empty() && dirty.empty()) {
+                return;
+            }
+            for (auto& fn : posted) {
+                fn();
+            }
+            std::move(dirty_.begin(), dirty_.end(), std::back_inserter(dirty));
+            dirty_.clear();
+            std::sort(dirty.begin(), dirty.end());
+            dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+            for (auto& conn : dirty) {
+                if (!conn->closed) {
+                    sendReplies(conn);
+                }
+            }
+        }
+    }
+
+    void readRequests(const std::shared_ptr<Connection>& conn) {
+        const size_t kReadSize = 16 << 10;
+        while (!conn->closed && wantsRequests(conn)) {
+            size_t old_size = conn->in.size();
+            conn->in.resize(old_size + kReadSize);
+            ssize_t n = recv(conn->fd, &conn->in[old_size], kReadSize, 0);
+            conn->in.resize(old_size + std::max<ssize_t>(n, 0));
+            if (n > 0) {
+                handleRequests(conn);
+                continue;
+            }
+            if (n == 0) {
+                // The client is done sending. Answer what it sent, then hang up.
+                conn->closing = true;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                closeConnection(conn);
+                return;
+            }
+            break;
+        }
+        dirty_.push_back(conn);
+    }
+
+    // Whether the connection should take on more requests.
+    bool wantsRequests(const std::shared_ptr<Connection>& conn) const {
+        return !conn->closing && !conn->blocked && conn->replies.size() < server_.options_.max_pipeline;
+    }
+
+    // Turns the complete requests in conn's input into replies, up to max_pipeline
+    // replies outstanding.
+    void handleRequests(const std::shared_ptr<Connection>& conn) {
+        std::vector<std::string_view> args;
+        while (wantsRequests(conn)) {
+            args.clear();
+            size_t pos = conn->parsed;
+            int res = parse_request(conn->in, pos, args);
+            if (res == 0) {
+                break;
+            }
+            // Writes only show up in the keydir once they are durable, so a request
+            // that reads has to wait for the writes sent before it on the connection.
+            // Leaving it in the buffer also stops reading until they are done.
+            if (res > 0 && conn->writes > 0 && !args.empty() &&
+                (is_command(args[0], "GET") || is_command(args[0], "MGET") || is_command(args[0], "DEL"))) {
+                conn->blocked = true;
+                break;
+            }
+            conn->parsed = pos;
+            conn->replies.emplace_back();
+            if (res < 0) {
+                conn->closing = true;
+                reply(conn, conn->replies.size() - 1, error_reply("Protocol error"));
+                break;
+            }
+            if (!args.empty()) {
+                handleRequest(conn, conn->first_seq + conn->replies.size() - 1, args);
+            } else {
+                // A blank inline line. Nothing to answer.
+                conn->replies.pop_back();
+            }
+        }
+        // The requests are done with their views into the buffer.
+        if (conn->parsed == conn->in.size()) {
+            conn->in.clear();
+            conn->parsed = 0;
+        } else if (conn->parsed > (1 << 16)) {
+            conn->in.erase(0, conn->parsed);
+            conn->parsed = 0;
+        }
+    }
+
+    void handleRequest(const std::shared_ptr<Connection>& conn, uint64_t seq, const std::vector<std::string_view>& args) {
+        size_t index = seq - conn->first_seq;
+        std::string_view command = args[0];
+        std::vector<KVStore::K> keys;
+        size_t first_key = 1;
+        size_t key_count = 0;
+        if (is_command(command, "GET") || is_command(command, "DEL") || is_command(command, "MGET") ||
+            is_command(command, "SET")) {
+            bool single = is_command(command, "GET") || is_command(command, "SET");
+            size_t want = is_command(command, "SET") ? 3 : 2;
+            if (single ? args.size() != want : args.size() < want) {
+                reply(conn, index, error_reply("wrong number of arguments for '" + std::string(command) + "' command"));
+                return;
+            }
+            key_count = single ? 1 : args.size() - 1;
+            keys.resize(key_count);
+            for (size_t i = 0; i < key_count; i++) {
+                if (!parse_key(args[first_key + i], keys[i])) {
+                    reply(conn, index, error_reply("key is not a 32-bit unsigned integer"));
+                    return;
+                }
+            }
+        }
+
+        // Set once the request is counted in pending_ and left to its callback, so a
+        // refusal only takes back what was added. MGET and DEL hand their refusals
+        // to the callbacks instead.
+        bool counted = false;
+        try {
+            if (is_command(command, "GET")) {
+                pending_++;
+                counted = true;
+                store_.getAsync(keys[0], [this, conn, seq](std::optional<KVStore::V> value, std::exception_ptr error) {
+                    std::vector<std::string> parts;
+                    if (error) {
+                        parts.push_back(error_reply(describe(error)));
+                    } else {
+                        append_bulk(parts, std::move(value));
+                    }
+                    complete(conn, seq, std::move(parts));
+                });
+            } else if (is_command(command, "SET")) {
+                if (args[2].size() > 4096) {
+                    reply(conn, index, error_reply("value is larger than 4096 bytes"));
+                    return;
+                }
+                conn->writes++;
+                pending_++;
+                counted = true;
+                store_.putAsync(keys[0], KVStore::V(args[2]), [this, conn, seq](std::exception_ptr error) {
+                    complete(conn, seq, {error ? error_reply(describe(error)) : "+OK\r\n"}, true);
+                });
+            } else if (is_command(command, "MGET")) {
+                auto gather = std::make_shared<Gather>(keys.size());
+                pending_++;
+                for (size_t i = 0; i < keys.size(); i++) {
+                    KVStore::GetCallback done = [this, conn, seq, gather, i](std::optional<KVStore::V> value,
+                                                                             std::exception_ptr error) {
+                        gather->values[i] = std::move(value);
+                        gather->errors[i] = error;
+                        if (gather->remaining.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+                            return;
+                        }
+                        std::vector<std::string> parts{"*" + std::to_string(gather->values.size()) + "\r\n"};
+                        for (size_t j = 0; j < gather->values.size(); j++) {
+                            if (gather->errors[j]) {
+                                parts = {error_reply(describe(gather->errors[j]))};
+                                break;
+                            }
+                            append_bulk(parts, std::move(gather->values[j]));
+                        }
+                        complete(conn, seq, std::move(parts));
+                    };
+                    // The other keys' callbacks are already out, so a refusal has
+                    // to go through this key's callback rather than the catch below.
+                    try {
+                        store_.getAsync(keys[i], done);
+                    } catch (const std::exception&) {
+                        done(std::nullopt, std::current_exception());
+                    }
+                }
+            } else if (is_command(command, "DEL")) {
+                // Like Redis, DEL answers with the number of keys that were there,
+                // counting a key named twice once.
+                std::sort(keys.begin(), keys.end());
+                keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+                auto gather = std::make_shared<Gather>(keys.size());
+                size_t existed = 0;
+                for (KVStore::K key : keys) {
+                    existed += store_.exists(key);
+                }
+                conn->writes++;
+                pending_++;
+                for (size_t i = 0; i < keys.size(); i++) {
+                    KVStore::PutCallback done = [this, conn, seq, gather, i, existed](std::exception_ptr error) {
+                        gather->errors[i] = error;
+                        if (gather->remaining.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+                            return;
+                        }
+                        std::string result = ":" + std::to_string(existed) + "\r\n";
+                        for (const auto& e : gather->errors) {
+                            if (e) {
+                                result = error_reply(describe(e));
+                                break;
+                            }
+                        }
+                        complete(conn, seq, {std::move(result)}, true);
+                    };
+                    try {
+                        store_.removeAsync(keys[i], done);
+                    } catch (const std::exception&) {
+                        done(std::current_exception());
+                    }
+                }
+            } else if (is_command(command, "PING")) {
+                reply(conn, index, args.size() > 1 ? "$" + std::to_string(args[1].size()) + "\r\n" +
+                                                         std::string(args[1]) + "\r\n"
+                                                   : "+PONG\r\n");
+            } else if (is_command(command, "INFO")) {
+                std::vector<std::string> parts;
+                append_bulk(parts, store_.stats().toText());
+                conn->replies[index].parts = std::move(parts);
+                conn->replies[index].ready = true;
+            } else if (is_command(command, "QUIT")) {
+                conn->closing = true;
+                reply(conn, index, "+OK\r\n");
+            } else {
+                reply(conn, index, error_reply("unknown command '" + std::string(command) + "'"));
+            }
+        } catch (const std::exception& e) {
+            // The store refused the request up front, e.g. because the log has failed.
+            if (counted) {
+                conn->writes -= is_command(command, "SET");
+                pending_--;
+            }
+            reply(conn, index, error_reply(e.what()));
+        }
+    }
+
+    // Results of a request that fans out over several keys.
+    struct Gather {
+        explicit Gather(size_t n) : values(n), errors(n), remaining(n) {}
+        std::vector<std::optional<KVStore::V>> values;
+        std::vector<std::exception_ptr> errors;
+        std::atomic<size_t> remaining;
+    };
+
+    static std::string describe(std::exception_ptr error) {
+        try {
+            std::rethrow_exception(error);
+        } catch (const std::exception& e) {
+            return e.what();
+        } catch (...) {
+            return "internal error";
+        }
+    }
+
+    // Fills in a reply that is ready right away.
+    void reply(const std::shared_ptr<Connection>& conn, size_t index, std::string text) {
+        conn->replies[index].parts.push_back(std::move(text));
+        conn->replies[index].ready = true;
+    }
+
+    // Called from a store callback, on whatever thread that runs on, with write set for
+    // SETs and DELs. Must be the last thing the callback does.
+    void complete(const std::shared_ptr<Connection>& conn, uint64_t seq, std::vector<std::string> parts,
+                  bool write = false) {
+        post([this, conn, seq, write, parts = std::move(parts)]() mutable {
+            if (write && --conn->writes == 0) {
+                conn->blocked = false;
+            }
+            if (conn->closed) {
+                return;
+            }
+            Connection::Reply& reply = conn->replies[seq - conn->first_seq];
+            reply.parts = std::move(parts);
+            reply.ready = true;
+            dirty_.push_back(conn);
+        });
+        pending_.fetch_sub(1, std::memory_order_release);
+    }
+
+    // Sends every ready reply at the front of the queue, as far as the socket takes
+    // them, then picks up reading again if the pipeline had filled up.
+    void sendReplies(const std::shared_ptr<Connection>& conn) {
+        const size_t kMaxIov = std::min(IOV_MAX, 1024);
+        std::vector<iovec> iov;
+        while (!conn->replies.empty() && conn->replies.front().ready) {
+            iov.clear();
+            size_t skip = conn->front_sent;
+            for (auto it = conn->replies.begin(); it != conn->replies.end() && it->ready && iov.size() < kMaxIov; ++it) {
+                for (std::string& part : it->parts) {
+                    if (skip >= part.size()) {
+                        skip -= part.size();
+                        continue;
+                    }
+                    iov.push_back({&part[skip], part.size() - skip});
+                    skip = 0;
+                    if (iov.size() == kMaxIov) {
+                        break;
+                    }
+                }
+            }
+            msghdr msg{};
+            msg.msg_iov = iov.data();
+            msg.msg_iovlen = iov.size();
+            ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                closeConnection(conn);
+                return;
+            }
+            // Drop the replies that are all the way out.
+            size_t sent = conn->front_sent + n;
+            while (!conn->replies.empty() && conn->replies.front().ready) {
+                size_t size = 0;
+                for (const auto& part : conn->replies.front().parts) {
+                    size += part.size();
+                }
+                if (sent < size) {
+                    break;
+                }
+                sent -= size;
+                conn->replies.pop_front();
+                conn->first_seq++;
+            }
+            conn->front_sent = sent;
+        }
+
+        bool backlog = !conn->replies.empty() && conn->replies.front().ready;
+        if (conn->closing && conn->replies.empty()) {
+            closeConnection(conn);
+            return;
+        }
+        if (wantsRequests(conn) && conn->parsed < conn->in.size()) {
+            // Requests that were held back while the pipeline was full or writes
+            // were in flight.
+            handleRequests(conn);
+            if (!conn->replies.empty() && conn->replies.front().ready) {
+                dirty_.push_back(conn);
+            }
+        }
+        uint32_t events = (backlog ? uint32_t(EPOLLOUT) : 0) | (wantsRequests(conn) ? uint32_t(EPOLLIN) : 0);
+        if (events != conn->events) {
+            conn->events = events;
+            watch(conn->fd, events, EPOLL_CTL_MOD);
+        }
+    }
+
+    void closeConnection(const std::shared_ptr<Connection>& conn) {
+        if (conn->closed) {
+            return;
+        }
+        watch(conn->fd, 0, EPOLL_CTL_DEL);
+        ::close(conn->fd);
+        conn->closed = true;
+        connections_.erase(conn->fd);
+    }
+
+    KVServer& server_;
+    KVStore& store_;
+    int listen_fd_;
+    int epoll_fd_ = -1;
+    int event_fd_ = -1;
+    std::atomic<bool> stopping_{false};
+    std::atomic<size_t> pending_{0};
+    std::unordered_map<int, std::shared_ptr<Connection>> connections_;
+    std::vector<std::shared_ptr<Connection>> dirty_;  // have replies to send
+    std::vector<std::function<void()>> local_posted_;  // posted from the reactor thread
+    std::mutex posted_mutex_;
+    std::vector<std::function<void()>> posted_;  // posted from other threads
+};
+
+thread_local KVServer::Reactor* KVServer::Reactor::current_reactor = nullptr;
+
+// ----------------------------------------------
+// SERVER
+// ----------------------------------------------
+// Opens a listening socket on host:port that other sockets can share the port with.
+static int listen_on(const std::string& host, uint16_t port) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+        throw std::runtime_error("Invalid listen address " + host);
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        throw std::runtime_error("Failed to create socket");
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Failed to listen on " + host + ":" + std::to_string(port) + ": " + strerror(errno));
+    }
+    return fd;
+}
+
+KVServer::KVServer(KVStore& store, const Options& options) : store_(store), options_(options) {
+    if (options_.reactors == 0) {
+        options_.reactors = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (options_.max_pipeline == 0) {
+        options_.max_pipeline = 1;
+    }
+    port_ = options_.port;
+    for (size_t i = 0; i < options_.reactors; i++) {
+        int fd = listen_on(options_.host, port_);
+        if (port_ == 0) {
+            // Everyone else joins the port the kernel picked for the first socket.
+            sockaddr_in addr{};
+            socklen_t len = sizeof(addr);
+            getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len);
+            port_ = ntohs(addr.sin_port);
+        }
+        try {
+            reactors_.push_back(std::make_unique<Reactor>(*this, fd));
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+    }
+    for (auto& reactor : reactors_) {
+        threads_.emplace_back([&reactor] { reactor->run(); });
+    }
+}
+
+KVServer::~KVServer() {
+    stop();
+}
+
+void KVServer::stop() {
+    if (stopped_.exchange(true)) {
+        return;
+    }
+    for (auto& reactor : reactors_) {
+        reactor->stop();
+    }
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+    // Store callbacks still in flight post to the reactors, so those have to stay
+    // around until every callback has returned.
+    for (auto& reactor : reactors_) {
+        while (reactor->pending() > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    reactors_.clear();
+}
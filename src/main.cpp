@@ -7,6 +7,8 @@ void printHelp() {
               << "  put <key> <value> - Store a key-value pair\n"
               << "  get <key>         - Retrieve a value by key\n"
               << "  del <key>         - Delete a key-value pair\n"
+              << "  scan <lo> <hi>    - List the keys in [lo, hi] and their values\n"
+              << "  stats             - Dump the store's metrics\n"
               << "  help              - Show this help message\n"
               << "  exit              - Exit the program\n";
 }
@@ -41,6 +43,15 @@ int main(int argc, char* argv[]) {
             KVStore::K key;
             std::cin >> key;
             store.remove(key);
+        } else if (cmd == "scan") {
+            KVStore::K lo, hi;
+            std::cin >> lo >> hi;
+            store.scan(lo, hi, [](KVStore::K key, const KVStore::V& value) {
+                std::cout << key << " " << value << std::endl;
+                return true;
+            });
+        } else if (cmd == "stats") {
+            std::cout << store.stats().toText();
         } else {
             std::cout << "Unknown command. Type 'help' for more information.\n";
         }
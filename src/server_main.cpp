@@ -0,0 +1,98 @@
+#include <csignal>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include "../include/kvstore.h"
+#include "../include/kvstore_server.h"
+
+// Serves a store over the Redis protocol until SIGINT or SIGTERM.
+
+static void printUsage() {
+    std::cout << "Usage: kvstore_server [options]\n"
+              << "  --path P              store file (kvstore.db)\n"
+              << "  --host H              address to listen on (127.0.0.1)\n"
+              << "  --port N              port to listen on, 0 for any (6380)\n"
+              << "  --reactors N          event loop threads, 0 is one per core (0)\n"
+              << "  --max-pipeline N      requests in flight per connection (1024)\n"
+              << "  --batch-wait-us N     Options::max_batch_wait (0)\n"
+              << "  --cache-bytes N       Options::value_cache_bytes (0)\n"
+              << "  --keydir hash|paged|open  Options::keydir (hash)\n"
+              << "  --shards N            Options::shards, 0 is one per core (1)\n"
+              << "  --follow P            serve a read-only follower of the store at P\n";
+}
+
+int main(int argc, char* argv[]) {
+    std::string path = "kvstore.db";
+    KVServer::Options server_options;
+    KVStore::Options store_options;
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--help" || arg == "-h") {
+                printUsage();
+                return 0;
+            }
+            if (i + 1 >= argc) {
+                throw std::invalid_argument(arg + " needs a value");
+            }
+            std::string value = argv[++i];
+            if (arg == "--path") {
+                path = value;
+            } else if (arg == "--host") {
+                server_options.host = value;
+            } else if (arg == "--port") {
+                server_options.port = static_cast<uint16_t>(std::stoul(value));
+            } else if (arg == "--reactors") {
+                server_options.reactors = std::stoul(value);
+            } else if (arg == "--max-pipeline") {
+                server_options.max_pipeline = std::stoul(value);
+            } else if (arg == "--batch-wait-us") {
+                store_options.max_batch_wait = std::chrono::microseconds(std::stoul(value));
+            } else if (arg == "--cache-bytes") {
+                store_options.value_cache_bytes = std::stoul(value);
+            } else if (arg == "--follow") {
+                path = value;
+                store_options.follower = true;
+            } else if (arg == "--shards") {
+                store_options.shards = std::stoul(value);
+            } else if (arg == "--keydir") {
+                if (value == "hash") {
+                    store_options.keydir = KVStore::KeyDirType::kHashMap;
+                } else if (value == "paged") {
+                    store_options.keydir = KVStore::KeyDirType::kPagedArray;
+                } else if (value == "open") {
+                    store_options.keydir = KVStore::KeyDirType::kOpenAddressing;
+                } else {
+                    throw std::invalid_argument("unknown keydir " + value);
+                }
+            } else {
+                throw std::invalid_argument("unknown option " + arg);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        printUsage();
+        return 1;
+    }
+
+    // Block the signals before any thread starts so that only sigwait sees them.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    try {
+        KVStore store(path, store_options);
+        KVServer server(store, server_options);
+        std::cout << "Serving " << path << " on " << server_options.host << ":" << server.port() << std::endl;
+        int signal;
+        sigwait(&signals, &signal);
+        std::cout << "Shutting down" << std::endl;
+        server.stop();
+    } catch (const std::exception& e) {
+        std::cerr << "Server failed: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
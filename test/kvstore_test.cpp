@@ -1,15 +1,73 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
+#include <future>
 #include <iostream>
 #include <string>
+#include <cstring>
 #include <filesystem>
+#include <fstream>
 #include <thread>
 #include <vector>
 #include "../include/kvstore.h"
+#include "../include/kvstore_impl.h"
+#include "../include/kvstore_server.h"
 
 #define TEST(name) void name(); std::cout << "Running " << #name << "... "; name(); std::cout << "PASSED" << std::endl;
 #define ASSERT(condition) if (!(condition)) { std::cout << "assertion failed: " << #condition << "on line " << __LINE__ << std::endl; std::abort(); }
 
 static const std::string kTestFile = "test_persistence.db";
 
+// Counts the allocations made on the current thread while count_allocations is set.
+static thread_local bool count_allocations = false;
+static thread_local size_t allocations = 0;
+
+void* operator new(size_t size) {
+    if (count_allocations) {
+        allocations++;
+    }
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+// Removes path along with every segment and leftover file next to it.
+static void remove_store_files(const std::string& path) {
+    std::filesystem::remove(path);
+    for (const auto& entry : std::filesystem::directory_iterator(".")) {
+        if (entry.path().filename().string().rfind(path + ".", 0) == 0) {
+            std::filesystem::remove(entry.path());
+        }
+    }
+}
+
+static uintmax_t store_disk_usage(const std::string& path) {
+    uintmax_t total = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(".")) {
+        auto name = entry.path().filename().string();
+        if (name == path || name.rfind(path + ".", 0) == 0) {
+            total += entry.file_size();
+        }
+    }
+    return total;
+}
+
 void test_in_memory_operations() {
     // Remove test file if it exists
     std::filesystem::remove(kTestFile);
@@ -121,11 +179,2142 @@ void test_concurrency() {
     }
 }
 
+void test_group_commit() {
+    std::filesystem::remove(kTestFile);
+
+    KVStore::Options options;
+    options.max_batch_size = 64;
+    options.max_batch_wait = std::chrono::microseconds(200);
+    const int num_threads = 32;
+    const int num_puts = 20000;
+    {
+        KVStore store(kTestFile, options);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < num_threads; i++) {
+            threads.emplace_back([&store, i]() {
+                for (int j = 0; j < num_puts / num_threads; j++) {
+                    auto k = i * num_puts / num_threads + j;
+                    store.put(k, "value" + std::to_string(k));
+                    // A put is only acknowledged once durable and visible.
+                    ASSERT(store.get(k) == "value" + std::to_string(k));
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        auto stats = store.commitStats();
+        std::cout << stats.batches << " batches for " << stats.records << " records, largest "
+                  << stats.max_batch_size << ", " << stats.fsyncs_saved << " fsyncs saved" << std::endl;
+        ASSERT(stats.records == num_puts);
+        ASSERT(stats.batches <= stats.records);
+        ASSERT(stats.fsyncs_saved == stats.records - stats.batches);
+
+        // A key can come back after being removed.
+        store.remove(0);
+        ASSERT(!store.get(0));
+        store.put(0, "again");
+        ASSERT(store.get(0) == "again");
+    }
+
+    {
+        KVStore store(kTestFile, options);
+        ASSERT(store.get(0) == "again");
+        for (int i = 1; i < num_puts; i++) {
+            ASSERT(store.get(i) == "value" + std::to_string(i));
+        }
+    }
+    std::filesystem::remove(kTestFile);
+
+    // max_batch_size ends a leader's wait early rather than capping the round: once
+    // that many records are written the leader syncs them without sitting out
+    // max_batch_wait.
+    options.max_batch_size = 4;
+    options.max_batch_wait = std::chrono::seconds(10);
+    {
+        KVStore store(kTestFile, options);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (uint32_t i = 0; i < options.max_batch_size; i++) {
+            threads.emplace_back([&store, i]() { store.put(i, "value" + std::to_string(i)); });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        ASSERT(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+        auto stats = store.commitStats();
+        ASSERT(stats.batches == 1);
+        ASSERT(stats.max_batch_size == options.max_batch_size);
+    }
+    std::filesystem::remove(kTestFile);
+}
+
+void test_truncate_bad_tail() {
+    std::filesystem::remove(kTestFile);
+    {
+        KVStore store(kTestFile);
+        store.put(1, "value1");
+        store.put(2, "value2");
+    }
+    auto good_size = std::filesystem::file_size(kTestFile);
+    {
+        // Simulate a torn write at the end of the log.
+        std::ofstream out(kTestFile, std::ios::binary | std::ios::app);
+        out << "garbage";
+    }
+    {
+        KVStore store(kTestFile);
+        ASSERT(std::filesystem::file_size(kTestFile) == good_size);
+        ASSERT(store.get(1) == "value1");
+        ASSERT(store.get(2) == "value2");
+        store.put(3, "value3");
+    }
+    KVStore store(kTestFile);
+    ASSERT(store.get(1) == "value1");
+    ASSERT(store.get(2) == "value2");
+    ASSERT(store.get(3) == "value3");
+    std::filesystem::remove(kTestFile);
+}
+
+// Makes writes to any file past limit bytes fail, or lifts that again with
+// RLIM_INFINITY.
+static void limit_file_size(rlim_t limit) {
+    rlimit rl;
+    getrlimit(RLIMIT_FSIZE, &rl);
+    rl.rlim_cur = std::min(limit, rl.rlim_max);
+    setrlimit(RLIMIT_FSIZE, &rl);
+}
+
+void test_failed_writes() {
+    // Writes past the limit fail with EFBIG instead of killing us.
+    signal(SIGXFSZ, SIG_IGN);
+    remove_store_files(kTestFile);
+    KVStore::Options options;
+    options.compaction_interval = std::chrono::milliseconds(0);
+    options.segment_size = 4 << 10;
+    const std::string value(100, 'v');
+    const size_t record_size = 12 + value.size();
+
+    // A write that fails after reserving its range leaves a skip record behind, which
+    // restore() steps over to the records after it.
+    {
+        KVStore store(kTestFile, options);
+        store.put(1, value);
+        // Room for the header of the next record but not its value.
+        limit_file_size(std::filesystem::file_size(kTestFile) + 12);
+        bool threw = false;
+        try {
+            store.put(2, value);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        limit_file_size(RLIM_INFINITY);
+        ASSERT(threw);
+        store.put(3, value);
+        ASSERT(!store.get(2) && store.get(3) == value);
+    }
+    {
+        KVStore store(kTestFile, options);
+        ASSERT(store.get(1) == value && !store.get(2) && store.get(3) == value);
+        store.put(4, value);
+    }
+    {
+        KVStore store(kTestFile, options);
+        ASSERT(store.get(3) == value && store.get(4) == value);
+    }
+    remove_store_files(kTestFile);
+
+    // When the skip record fails too, nothing past the hole can become durable, not
+    // even for a leader that was already holding out max_batch_wait when it failed.
+    options.max_batch_wait = std::chrono::seconds(1);
+    std::streamoff hole;
+    uint32_t key = 0;
+    {
+        KVStore store(kTestFile, options);
+        while (std::filesystem::file_size(kTestFile) + 2 * record_size < options.segment_size) {
+            store.put(key++, value, KVStore::Durability::kSync);
+        }
+        std::thread leader([&store, &value, key] {
+            try {
+                store.put(key, value);
+            } catch (const std::runtime_error&) {
+            }
+        });
+        while (std::filesystem::file_size(kTestFile) < key * record_size + 12 + record_size) {
+            std::this_thread::yield();
+        }
+        hole = std::filesystem::file_size(kTestFile);
+        limit_file_size(hole);
+        // Fills up the segment, so the store rolls over before the write fails.
+        auto failed = store.putAsync(key + 1, value);
+        bool threw = false;
+        try {
+            failed.get();
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        limit_file_size(RLIM_INFINITY);
+        ASSERT(threw);
+        leader.join();
+        ASSERT(store.durableEnd() < store.logEnd());
+        threw = false;
+        try {
+            store.put(key + 2, value);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        ASSERT(threw);
+    }
+    {
+        KVStore store(kTestFile, options);
+        ASSERT(std::filesystem::file_size(kTestFile) == static_cast<uintmax_t>(hole));
+        for (uint32_t i = 0; i < key; i++) {
+            ASSERT(store.get(i) == value);
+        }
+        ASSERT(!store.get(key + 1) && !store.get(key + 2));
+    }
+    remove_store_files(kTestFile);
+}
+
+void test_mmap_reads() {
+    std::filesystem::remove(kTestFile);
+
+    KVStore::Options options;
+    options.mmap_chunk_size = 4096;
+    const int num_keys = 2000;
+    {
+        // Values of assorted sizes so that plenty of records straddle chunks.
+        KVStore store(kTestFile, options);
+        for (int i = 0; i < num_keys; i++) {
+            store.put(i, std::string(i % 97, 'a' + i % 26));
+            ASSERT(store.get(i) == std::string(i % 97, 'a' + i % 26));
+        }
+        for (int i = 0; i < num_keys; i++) {
+            ASSERT(store.get(i) == std::string(i % 97, 'a' + i % 26));
+        }
+    }
+
+    // Reopen so that everything restored gets mapped up front.
+    KVStore store(kTestFile, options);
+    for (int i = 0; i < num_keys; i++) {
+        ASSERT(store.get(i) == std::string(i % 97, 'a' + i % 26));
+    }
+    store.put(0, "new");
+    ASSERT(store.get(0) == "new");
+    std::filesystem::remove(kTestFile);
+}
+
+void test_segments_and_compaction() {
+    remove_store_files(kTestFile);
+
+    KVStore::Options options;
+    options.segment_size = 4096;
+    options.mmap_chunk_size = 4096;
+    options.compaction_interval = std::chrono::milliseconds(0);
+    options.compaction_bytes_per_sec = 0;
+    const int num_keys = 300;
+    auto expected = [](int key, int round) {
+        return "value" + std::to_string(key) + "-" + std::to_string(round) + std::string(key % 40, 'x');
+    };
+    {
+        KVStore store(kTestFile, options);
+        for (int round = 0; round < 3; round++) {
+            for (int i = 0; i < num_keys; i++) {
+                store.put(i, expected(i, round));
+            }
+        }
+        for (int i = 0; i < num_keys; i += 2) {
+            store.remove(i);
+        }
+        // Leave a merge that never got installed lying around, restore cleans it up.
+        std::ofstream(kTestFile + ".9999.compact") << "junk";
+
+        auto before = store_disk_usage(kTestFile);
+        store.compact();
+        auto after = store_disk_usage(kTestFile);
+        std::cout << "compacted " << before << " bytes down to " << after << "... ";
+        ASSERT(after < before / 2);
+        for (int i = 0; i < num_keys; i++) {
+            ASSERT(i % 2 == 0 ? !store.get(i) : store.get(i) == expected(i, 2));
+        }
+
+        // Puts that land during a merge win over the records it copies.
+        std::atomic<bool> done{false};
+        std::thread merger([&]() {
+            while (!done) {
+                store.compact();
+            }
+        });
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([&store, &expected, t]() {
+                for (int i = t; i < num_keys; i += 4) {
+                    store.put(i, expected(i, 3));
+                    ASSERT(store.get(i) == expected(i, 3));
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        done = true;
+        merger.join();
+        for (int i = 0; i < num_keys; i++) {
+            ASSERT(store.get(i) == expected(i, 3));
+        }
+        for (int i = 0; i < num_keys; i += 3) {
+            store.remove(i);
+        }
+        store.compact();
+    }
+
+    KVStore store(kTestFile, options);
+    ASSERT(!std::filesystem::exists(kTestFile + ".9999.compact"));
+    for (int i = 0; i < num_keys; i++) {
+        ASSERT(i % 3 == 0 ? !store.get(i) : store.get(i) == expected(i, 3));
+    }
+    remove_store_files(kTestFile);
+
+    // The background merger leaves a log that is mostly live alone, since a merge would
+    // copy nearly all of it to reclaim little, and merges once half of it is garbage.
+    options.compaction_interval = std::chrono::milliseconds(5);
+    options.compaction_min_segments = 1;
+    auto compacted = [] {
+        for (const auto& entry : std::filesystem::directory_iterator(".")) {
+            std::string name = entry.path().filename().string();
+            std::string id = name.substr(std::min(name.size(), kTestFile.size() + 1));
+            if (name.rfind(kTestFile + ".", 0) == 0 && !id.empty() &&
+                std::all_of(id.begin(), id.end(), [](char c) { return c >= '0' && c <= '9'; }) &&
+                std::stoul(id) % 2 == 1) {
+                return true;
+            }
+        }
+        return false;
+    };
+    {
+        KVStore store(kTestFile, options);
+        for (int i = 0; i < num_keys; i++) {
+            store.put(i, expected(i, 0));
+        }
+        for (int i = 0; i < num_keys / 4; i++) {
+            store.put(i, expected(i, 1));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        ASSERT(!compacted());
+        for (int i = 0; i < num_keys; i++) {
+            store.put(i, expected(i, 2));
+        }
+        for (int i = 0; i < 200 && !compacted(); i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        ASSERT(compacted());
+        for (int i = 0; i < num_keys; i++) {
+            ASSERT(store.get(i) == expected(i, 2));
+        }
+    }
+    remove_store_files(kTestFile);
+}
+
+void test_hint_files() {
+    remove_store_files(kTestFile);
+
+    KVStore::Options options;
+    options.segment_size = 4096;
+    options.compaction_interval = std::chrono::milliseconds(0);
+    const int num_keys = 500;
+    {
+        KVStore store(kTestFile, options);
+        for (int i = 0; i < num_keys; i++) {
+            store.put(i, "value" + std::to_string(i) + std::string(i % 50, 'h'));
+        }
+        for (int i = 0; i < num_keys; i += 5) {
+            store.remove(i);
+        }
+    }
+    auto check = [&](KVStore& store) {
+        for (int i = 0; i < num_keys; i++) {
+            ASSERT(i % 5 == 0 ? !store.get(i) : store.get(i) == "value" + std::to_string(i) + std::string(i % 50, 'h'));
+        }
+    };
+
+    // Every sealed segment has a hint by the time the store has been reopened once.
+    std::string first_hint = kTestFile + ".hint";
+    {
+        KVStore store(kTestFile, options);
+        check(store);
+    }
+    ASSERT(std::filesystem::exists(first_hint));
+    {
+        KVStore store(kTestFile, options);
+        check(store);
+        store.compact();
+        check(store);
+    }
+
+    // A corrupt hint falls back to scanning the segment.
+    std::string hint;
+    for (const auto& entry : std::filesystem::directory_iterator(".")) {
+        auto name = entry.path().filename().string();
+        if (name.rfind(kTestFile + ".", 0) == 0 && name.size() > 5 && name.compare(name.size() - 5, 5, ".hint") == 0) {
+            hint = name;
+        }
+    }
+    ASSERT(!hint.empty());
+    {
+        std::fstream file(hint, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(30);
+        file.put('\xff');
+    }
+    KVStore store(kTestFile, options);
+    check(store);
+    remove_store_files(kTestFile);
+}
+
+void test_parallel_recovery() {
+    const std::string copy_file = kTestFile + "_copy";
+    remove_store_files(kTestFile);
+    remove_store_files(copy_file);
+
+    KVStore::Options options;
+    options.compaction_interval = std::chrono::milliseconds(0);
+    options.write_hints = false;
+    const int num_threads = 8;
+    const int num_keys = 16000;
+    auto value_for = [](int key) { return std::to_string(key) + std::string(key % 400, 'r'); };
+    {
+        // A few MB in one segment so that it gets cut into several chunks.
+        KVStore store(kTestFile, options);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < num_threads; t++) {
+            threads.emplace_back([&, t] {
+                for (int i = t; i < num_keys; i += num_threads) {
+                    store.put(i, value_for(i));
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        for (int i = 0; i < num_keys; i += 7) {
+            store.remove(i);
+        }
+    }
+
+    options.recovery_threads = 4;
+    {
+        KVStore store(kTestFile, options);
+        for (int i = 0; i < num_keys; i++) {
+            ASSERT(i % 7 == 0 ? !store.get(i) : store.get(i) == value_for(i));
+        }
+    }
+
+    // Corrupt a record well past the first chunk. The parallel scan has to keep
+    // exactly what a sequential scan keeps.
+    auto size = std::filesystem::file_size(kTestFile);
+    {
+        std::fstream file(kTestFile, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(size * 2 / 3);
+        file.put('\xff');
+        file.put('\xff');
+    }
+    std::filesystem::copy_file(kTestFile, copy_file);
+    KVStore store(kTestFile, options);
+    options.recovery_threads = 1;
+    KVStore expected(copy_file, options);
+    ASSERT(std::filesystem::file_size(kTestFile) == std::filesystem::file_size(copy_file));
+    ASSERT(std::filesystem::file_size(kTestFile) < size);
+    int lost = 0;
+    for (int i = 0; i < num_keys; i++) {
+        ASSERT(store.get(i) == expected.get(i));
+        lost += i % 7 != 0 && !store.get(i);
+    }
+    ASSERT(lost > 0);
+    remove_store_files(kTestFile);
+    remove_store_files(copy_file);
+}
+
+void test_value_cache() {
+    remove_store_files(kTestFile);
+
+    KVStore::Options options;
+    options.compaction_interval = std::chrono::milliseconds(0);
+    options.value_cache_bytes = 64 << 10;
+    KVStore store(kTestFile, options);
+    const int num_keys = 2000;
+    for (int i = 0; i < num_keys; i++) {
+        store.put(i, "value" + std::to_string(i) + std::string(100, 'c'));
+    }
+
+    // A small hot set is served from the cache after the first read.
+    for (int round = 0; round < 10; round++) {
+        for (int i = 0; i < 50; i++) {
+            ASSERT(store.get(i) == "value" + std::to_string(i) + std::string(100, 'c'));
+        }
+    }
+    auto stats = store.cacheStats();
+    ASSERT(stats.misses == 50);
+    ASSERT(stats.hits == 450);
+    ASSERT(stats.evictions == 0);
+
+    // A newer put goes to a new log position, so the cached value is never returned.
+    store.put(7, "fresh");
+    ASSERT(store.get(7) == "fresh");
+    store.remove(8);
+    ASSERT(!store.get(8));
+
+    // Reading everything doesn't fit and evicts.
+    for (int i = 0; i < num_keys; i++) {
+        if (i != 8) {
+            ASSERT(store.get(i) == (i == 7 ? "fresh" : "value" + std::to_string(i) + std::string(100, 'c')));
+        }
+    }
+    stats = store.cacheStats();
+    ASSERT(stats.evictions > 0);
+    ASSERT(stats.bytes <= options.value_cache_bytes);
+
+    // A hot set that has been read more than once survives a scan of cold keys.
+    for (int round = 0; round < 2; round++) {
+        for (int i = 10; i < 50; i++) {
+            store.get(i);
+        }
+    }
+    for (int i = 1000; i < 1200; i++) {
+        store.get(i);
+    }
+    uint64_t hits = store.cacheStats().hits;
+    for (int i = 10; i < 50; i++) {
+        store.get(i);
+    }
+    ASSERT(store.cacheStats().hits - hits == 40);
+
+    // Concurrent readers and writers on a cache far smaller than the data.
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; t++) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < 2000; i++) {
+                int key = (i * 7 + t) % 200;
+                if (t == 0 && i % 10 == 0) {
+                    store.put(key, "value" + std::to_string(key) + std::string(100, 'c'));
+                }
+                auto value = store.get(key);
+                ASSERT(!value || value == "fresh" || *value == "value" + std::to_string(key) + std::string(100, 'c'));
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::cout << "cache hits " << store.cacheStats().hits << " misses " << store.cacheStats().misses
+              << " evictions " << store.cacheStats().evictions << "... ";
+    remove_store_files(kTestFile);
+}
+
+void test_write_batch() {
+    remove_store_files(kTestFile);
+
+    KVStore::Options options;
+    options.compaction_interval = std::chrono::milliseconds(0);
+    options.write_hints = false;
+    const int num_keys = 1000;
+    {
+        KVStore store(kTestFile, options);
+        KVStore::WriteBatch batch;
+        for (int i = 0; i < num_keys; i++) {
+            batch.put(i, "batch" + std::to_string(i));
+        }
+        for (int i = 0; i < num_keys; i += 3) {
+            batch.remove(i);
+        }
+        batch.put(3, "again");
+        ASSERT(batch.size() == num_keys + (num_keys + 2) / 3 + 1);
+        bool thrown = false;
+        try {
+            batch.put(1, std::string(5000, 'x'));
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        ASSERT(thrown);
+
+        auto batches = store.commitStats().batches;
+        store.write(batch);
+        ASSERT(store.commitStats().batches == batches + 1);
+        auto check = [&]() {
+            for (int i = 0; i < num_keys; i++) {
+                ASSERT(i == 3 ? store.get(i) == "again" : i % 3 == 0 ? !store.get(i) : store.get(i) == "batch" + std::to_string(i));
+            }
+        };
+        check();
+        store.compact();
+        check();
+
+        // multiGet answers in the order it was asked, whatever the log order is.
+        std::vector<KVStore::K> keys;
+        for (int i = num_keys + 10; i >= 0; i -= 2) {
+            keys.push_back(i);
+        }
+        keys.push_back(5);
+        keys.push_back(5);
+        auto values = store.multiGet(keys);
+        ASSERT(values.size() == keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            ASSERT(values[i] == store.get(keys[i]));
+        }
+    }
+
+    // A batch that didn't make it to disk in full is dropped as a whole.
+    {
+        KVStore store(kTestFile, options);
+        KVStore::WriteBatch batch;
+        for (int i = 0; i < 100; i++) {
+            batch.put(i, "torn");
+        }
+        store.write(batch);
+    }
+    auto size = std::filesystem::file_size(kTestFile);
+    std::filesystem::resize_file(kTestFile, size - 3);
+    {
+        KVStore store(kTestFile, options);
+        ASSERT(store.get(1) == "batch1");
+        ASSERT(store.get(3) == "again");
+        ASSERT(!store.get(99 * 3));
+    }
+    remove_store_files(kTestFile);
+}
+
+void test_keydir_types() {
+    for (auto type : {KVStore::KeyDirType::kHashMap, KVStore::KeyDirType::kPagedArray,
+                      KVStore::KeyDirType::kOpenAddressing}) {
+        remove_store_files(kTestFile);
+
+        KVStore::Options options;
+        options.keydir = type;
+        options.segment_size = 16 << 10;
+        options.compaction_interval = std::chrono::milliseconds(0);
+        // Sparse keys, including the ends of the key range.
+        const int num_keys = 4000;
+        auto key_for = [](int i) { return static_cast<KVStore::K>(i * 2654435761u); };
+        auto value_for = [](int i) { return "value" + std::to_string(i); };
+        auto check = [&](KVStore& store) {
+            for (int i = 0; i < num_keys; i++) {
+                ASSERT(i % 4 == 1 ? !store.get(key_for(i)) : store.get(key_for(i)) == value_for(i));
+            }
+            ASSERT(store.get(~0u) == "last");
+            ASSERT(!store.get(12345));
+        };
+        {
+            KVStore store(kTestFile, options);
+            std::vector<std::thread> threads;
+            for (int t = 0; t < 8; t++) {
+                threads.emplace_back([&, t] {
+                    for (int i = t; i < num_keys; i += 8) {
+                        store.put(key_for(i), value_for(i));
+                        if (i % 4 == 1) {
+                            store.remove(key_for(i));
+                        }
+                    }
+                });
+            }
+            store.put(~0u, "first");
+            store.put(~0u, "last");
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            check(store);
+            store.compact();
+            check(store);
+        }
+        KVStore store(kTestFile, options);
+        check(store);
+    }
+    remove_store_files(kTestFile);
+}
+
+// Bitwise CRC32C, to check the store's against.
+static uint32_t reference_crc32c(const char* data, size_t size) {
+    uint32_t crc = ~0u;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= static_cast<uint8_t>(data[i]);
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78 : 0);
+        }
+    }
+    return ~crc;
+}
+
+void test_checksums() {
+    remove_store_files(kTestFile);
+    ASSERT(reference_crc32c("123456789", 9) == 0xE3069283);
+
+    // A log written before segment headers, checksummed with std::hash.
+    {
+        std::ofstream out(kTestFile, std::ios::binary);
+        for (uint32_t key = 0; key < 10; key++) {
+            std::string value = "legacy" + std::to_string(key);
+            uint32_t length = value.size();
+            uint32_t checksum = std::hash<uint32_t>()(key) ^ std::hash<uint32_t>()(length) ^ std::hash<std::string>()(value);
+            out.write(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+            out.write(reinterpret_cast<const char*>(&key), sizeof(key));
+            out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+            out << value;
+        }
+    }
+    KVStore::Options options;
+    options.compaction_interval = std::chrono::milliseconds(0);
+    options.verify_checksums = true;
+    {
+        KVStore store(kTestFile, options);
+        for (uint32_t key = 0; key < 10; key++) {
+            ASSERT(store.get(key) == "legacy" + std::to_string(key));
+        }
+        store.put(3, "crc");
+    }
+    // The legacy segment got sealed and the put went to a new one.
+    std::string new_segment = kTestFile + ".2";
+    ASSERT(std::filesystem::exists(new_segment));
+    {
+        std::ifstream in(new_segment, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        ASSERT(data.size() == 12 + 12 + 3);
+        uint32_t checksum;
+        memcpy(&checksum, data.data() + 12, sizeof(checksum));
+        ASSERT(checksum == reference_crc32c(data.data() + 16, data.size() - 16));
+    }
+    {
+        KVStore store(kTestFile, options);
+        ASSERT(store.get(3) == "crc");
+        ASSERT(store.get(4) == "legacy4");
+        store.compact();
+        ASSERT(store.get(3) == "crc");
+        ASSERT(store.get(4) == "legacy4");
+    }
+    remove_store_files(kTestFile);
+
+    // Bit rot in a segment that restore loads from its hint only shows up on read.
+    options.segment_size = 4096;
+    for (size_t chunk_size : {size_t(0), size_t(4096)}) {
+        options.mmap_chunk_size = chunk_size;
+        {
+            KVStore store(kTestFile, options);
+            for (int i = 0; i < 100; i++) {
+                store.put(i, "value" + std::to_string(i) + std::string(50, 'b'));
+            }
+        }
+        {
+            KVStore store(kTestFile, options);
+        }
+        ASSERT(std::filesystem::exists(kTestFile + ".hint"));
+        {
+            // The value of key 0, right after the segment header and its record header.
+            std::fstream file(kTestFile, std::ios::binary | std::ios::in | std::ios::out);
+            file.seekp(12 + 12);
+            file.put('V');
+        }
+        bool thrown = false;
+        {
+            KVStore store(kTestFile, options);
+            try {
+                store.get(0);
+            } catch (const std::runtime_error&) {
+                thrown = true;
+            }
+            ASSERT(store.get(1) == "value1" + std::string(50, 'b'));
+        }
+        ASSERT(thrown);
+        options.verify_checksums = false;
+        {
+            KVStore store(kTestFile, options);
+            ASSERT(store.get(0) == "Value0" + std::string(50, 'b'));
+        }
+        options.verify_checksums = true;
+        remove_store_files(kTestFile);
+    }
+}
+
+void test_async_api() {
+    for (bool use_io_uring : {true, false}) {
+        remove_store_files(kTestFile);
+        KVStore::Options options;
+        options.compaction_interval = std::chrono::milliseconds(0);
+        options.use_io_uring = use_io_uring;
+        options.segment_size = 16 << 10;
+        options.mmap_chunk_size = 0;  // every uncached read goes async
+        const int num_keys = 2000;
+        auto value_for = [](int i) { return "async" + std::to_string(i) + std::string(i % 64, 'a'); };
+        {
+            KVStore store(kTestFile, options);
+            // Futures from several threads at once.
+            std::vector<std::thread> threads;
+            for (int t = 0; t < 4; t++) {
+                threads.emplace_back([&, t] {
+                    std::vector<std::future<void>> puts;
+                    for (int i = t; i < num_keys; i += 8) {
+                        puts.push_back(store.putAsync(i, value_for(i)));
+                    }
+                    for (auto& put : puts) {
+                        put.get();
+                    }
+                });
+            }
+            // Callbacks for the other half.
+            std::atomic<int> done{0};
+            std::atomic<int> failed{0};
+            for (int i = 4; i < num_keys; i += 8) {
+                for (int j = i; j < i + 4; j++) {
+                    store.putAsync(j, value_for(j), [&](std::exception_ptr error) {
+                        failed += error != nullptr;
+                        done++;
+                    });
+                }
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            while (done < num_keys / 2) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            ASSERT(failed == 0);
+
+            // A put is visible once its future is ready.
+            for (int i = 0; i < num_keys; i++) {
+                ASSERT(store.get(i) == value_for(i));
+            }
+            store.remove(7);
+            std::vector<std::future<std::optional<std::string>>> gets;
+            for (int i = 0; i < num_keys + 10; i++) {
+                gets.push_back(store.getAsync(i));
+            }
+            for (int i = 0; i < num_keys + 10; i++) {
+                auto value = gets[i].get();
+                ASSERT(i == 7 || i >= num_keys ? !value : value == value_for(i));
+            }
+            bool thrown = false;
+            try {
+                store.putAsync(1, std::string(5000, 'x'));
+            } catch (const std::runtime_error&) {
+                thrown = true;
+            }
+            ASSERT(thrown);
+
+            // Async reads keep going while merges delete the segments they were
+            // looked up in.
+            std::atomic<bool> stop{false};
+            std::atomic<int> mismatches{0};
+            std::thread reader([&] {
+                while (!stop) {
+                    std::vector<std::future<std::optional<std::string>>> batch;
+                    for (int i = 0; i < num_keys; i += 17) {
+                        batch.push_back(store.getAsync(i));
+                    }
+                    for (int j = 0; j < static_cast<int>(batch.size()); j++) {
+                        int i = j * 17;
+                        mismatches += batch[j].get() != (i == 7 ? std::nullopt : std::optional<std::string>(value_for(i)));
+                    }
+                }
+            });
+            for (int round = 0; round < 5; round++) {
+                for (int i = 0; i < num_keys; i += 3) {
+                    store.put(i, value_for(i));
+                }
+                store.compact();
+            }
+            stop = true;
+            reader.join();
+            ASSERT(mismatches == 0);
+
+            // Dropped without waiting on it, the store still sees it through.
+            store.putAsync(num_keys, "last");
+        }
+        KVStore store(kTestFile, options);
+        for (int i = 0; i < num_keys; i++) {
+            ASSERT(i == 7 ? !store.get(i) : store.get(i) == value_for(i));
+        }
+        ASSERT(store.get(num_keys) == "last");
+    }
+    remove_store_files(kTestFile);
+}
+
+void test_stats() {
+    remove_store_files(kTestFile);
+    KVStore::Options options;
+    options.compaction_interval = std::chrono::milliseconds(0);
+    options.segment_size = 4096;
+    options.value_cache_bytes = 1 << 20;
+    {
+        KVStore store(kTestFile, options);
+        KVStore::Stats stats = store.stats();
+        ASSERT(stats.puts == 0 && stats.keys == 0 && stats.log_bytes == 12);
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([&, t] {
+                for (int i = t; i < 200; i += 4) {
+                    store.put(i, std::string(88, 'a'));  // 100-byte records
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        for (int i = 0; i < 100; i++) {
+            store.put(i, std::string(88, 'b'));
+        }
+        store.remove(0);
+        store.remove(1);
+        store.remove(1000);
+        ASSERT(store.get(5));
+        ASSERT(store.get(5));
+        ASSERT(!store.get(1));
+        store.multiGet({1, 2, 3});
+
+        stats = store.stats();
+        ASSERT(stats.puts == 300);
+        ASSERT(stats.removes == 3);
+        ASSERT(stats.gets == 3);
+        ASSERT(stats.multi_gets == 1);
+        ASSERT(stats.bytes_appended == 300 * 100 + 2 * 12);
+        ASSERT(stats.append_latency.count == 302);
+        ASSERT(stats.append_latency.p50 > 0 && stats.append_latency.p50 <= stats.append_latency.p99);
+        ASSERT(stats.append_latency.p99 <= stats.append_latency.p999 && stats.append_latency.p999 <= stats.append_latency.max);
+        ASSERT(stats.fsync_latency.count == stats.commits.batches);
+        // The second get of key 5 is a cache hit.
+        ASSERT(stats.file_reads == 3);
+        ASSERT(stats.cache.hits == 1);
+        ASSERT(stats.cache_hit_rate > 0.2 && stats.cache_hit_rate < 0.3);
+        ASSERT(stats.keys == 200);
+        ASSERT(stats.tombstones == 2);
+        ASSERT(stats.segments > 1);
+        // The segments, which hold the records plus headers but not the hint files.
+        ASSERT(stats.log_bytes > stats.bytes_appended && stats.log_bytes < store_disk_usage(kTestFile));
+        // 200 of the 302 records are live: 198 values and 2 tombstones.
+        double live = static_cast<double>(stats.live_bytes) / stats.log_bytes;
+        ASSERT(live > 0.63 && live < 0.7);
+        ASSERT(stats.live_bytes + stats.dead_bytes == stats.log_bytes);
+
+        std::string text = stats.toText();
+        ASSERT(text.find("kvstore_puts_total 300\n") != std::string::npos);
+        ASSERT(text.find("kvstore_keys 200\n") != std::string::npos);
+        ASSERT(text.find("kvstore_append_latency_seconds_count 302\n") != std::string::npos);
+
+        // Compaction drops the garbage and the tombstones.
+        store.compact();
+        stats = store.stats();
+        ASSERT(stats.keys - stats.tombstones == 198);
+        ASSERT(stats.dead_bytes < stats.log_bytes / 10);
+    }
+    KVStore store(kTestFile, options);
+    KVStore::Stats stats = store.stats();
+    ASSERT(stats.puts == 0);
+    ASSERT(stats.keys - stats.tombstones == 198);
+    ASSERT(stats.restore_duration.count() > 0);
+    remove_store_files(kTestFile);
+}
+
+void test_scan() {
+    KVStore::Options options;
+    options.compaction_interval = std::chrono::milliseconds(0);
+    options.segment_size = 16 << 10;
+    for (auto type : {KVStore::KeyDirType::kHashMap, KVStore::KeyDirType::kPagedArray,
+                      KVStore::KeyDirType::kOpenAddressing}) {
+        remove_store_files(kTestFile);
+        options.keydir = type;
+        auto collect = [](KVStore& store, KVStore::K lo, KVStore::K hi) {
+            std::vector<std::pair<KVStore::K, KVStore::V>> out;
+            store.scan(lo, hi, [&](KVStore::K key, const KVStore::V& value) {
+                out.emplace_back(key, value);
+                return true;
+            });
+            return out;
+        };
+        {
+            KVStore store(kTestFile, options);
+            // Written out of key order, so a scan's batches span several segments.
+            for (int i = 2999; i >= 0; i--) {
+                store.put(i * 3, "v" + std::to_string(i));
+            }
+            store.put(0xFFFFFFFF, "max");
+            store.put(0x12340000, "prefix");
+            store.remove(30);
+            store.remove(31);
+
+            auto all = collect(store, 0, 0xFFFFFFFF);
+            ASSERT(all.size() == 3001);
+            ASSERT(all.front().first == 0 && all.back().first == 0xFFFFFFFF && all.back().second == "max");
+            for (size_t i = 1; i < all.size(); i++) {
+                ASSERT(all[i - 1].first < all[i].first);
+            }
+            auto range = collect(store, 25, 40);
+            ASSERT(range.size() == 4);
+            ASSERT(range[0].first == 27 && range[0].second == "v9");
+            ASSERT(range[1].first == 33 && range[3].first == 39);
+            ASSERT(collect(store, 0x12340000, 0x1234FFFF).size() == 1);
+            ASSERT(collect(store, 40, 25).empty());
+            ASSERT(collect(store, 9001, 0x1233FFFF).empty());
+
+            // Stops when the callback says so.
+            int calls = 0;
+            store.scan(0, 0xFFFFFFFF, [&](KVStore::K, const KVStore::V&) { return ++calls < 5; });
+            ASSERT(calls == 5);
+
+            // The iterator sees the same thing, batch boundaries and all.
+            size_t n = 0;
+            for (auto it = store.iterate(); it.valid(); it.next()) {
+                ASSERT(it.key() == all[n].first && it.value() == all[n].second);
+                n++;
+            }
+            ASSERT(n == all.size());
+            auto it = store.iterate(1000, 1001);
+            ASSERT(!it.valid());
+            it = store.iterate(0xFFFFFFFF, 0xFFFFFFFF);
+            ASSERT(it.valid() && it.key() == 0xFFFFFFFF);
+            it.next();
+            ASSERT(!it.valid());
+
+            // Compaction takes the removed keys out of the keydir, which leaves
+            // enough of them behind in the ordered index to rebuild it.
+            for (int i = 0; i < 2500; i++) {
+                store.remove(i * 3);
+            }
+            store.compact();
+            store.put(3, "back");
+            auto rest = collect(store, 0, 9000);
+            ASSERT(rest.size() == 501);
+            ASSERT(rest[0].first == 3 && rest[0].second == "back");
+            ASSERT(rest[1].first == 7500 && rest.back().first == 8997);
+
+            // Keys nobody touches show up, in order, while writers churn around them.
+            std::atomic<bool> stop{false};
+            std::thread writer([&] {
+                for (uint32_t i = 0; !stop; i++) {
+                    uint32_t key = 100000 + (i % 5000) * 2 + 1;
+                    if (i % 3 == 2) {
+                        store.remove(key);
+                    } else {
+                        store.put(key, "churn");
+                    }
+                }
+            });
+            for (int round = 0; round < 5; round++) {
+                KVStore::K last = 0;
+                size_t seen = 0;
+                store.scan(7500, 200000, [&](KVStore::K key, const KVStore::V&) {
+                    ASSERT(key > last);
+                    last = key;
+                    seen += key < 100000;
+                    return true;
+                });
+                ASSERT(seen == 500);
+            }
+            stop = true;
+            writer.join();
+            ASSERT(store.stats().scans >= 10);
+        }
+        // The index is rebuilt on restore.
+        KVStore store(kTestFile, options);
+        auto rest = collect(store, 0, 9000);
+        ASSERT(rest.size() == 501 && rest[0].second == "back");
+    }
+    remove_store_files(kTestFile);
+}
+
+void test_snapshots() {
+    KVStore::Options options;
+    options.compaction_interval = std::chrono::milliseconds(0);
+    options.segment_size = 16 << 10;
+    for (auto type : {KVStore::KeyDirType::kHashMap, KVStore::KeyDirType::kPagedArray,
+                      KVStore::KeyDirType::kOpenAddressing}) {
+        remove_store_files(kTestFile);
+        options.keydir = type;
+        KVStore store(kTestFile, options);
+        for (KVStore::K key = 0; key < 1000; key++) {
+            store.put(key, "a" + std::to_string(key));
+        }
+        auto snapshot = store.snapshot();
+        for (KVStore::K key = 0; key < 500; key++) {
+            store.put(key, "b");
+        }
+        for (KVStore::K key = 500; key < 600; key++) {
+            store.remove(key);
+        }
+        for (KVStore::K key = 1000; key < 1100; key++) {
+            store.put(key, "new");
+        }
+        ASSERT(store.get(7) == "b" && !store.get(550) && store.get(1050) == "new");
+        ASSERT(snapshot->get(7) == "a7" && snapshot->get(550) == "a550" && !snapshot->get(1050));
+        auto values = snapshot->multiGet({0, 599, 1000});
+        ASSERT(values[0] == "a0" && values[1] == "a599" && !values[2]);
+
+        // Scans and iterators over the snapshot don't see anything newer, across batches.
+        size_t n = 0;
+        snapshot->scan(0, 5000, [&](KVStore::K key, const KVStore::V& value) {
+            ASSERT(key == n && value == "a" + std::to_string(key));
+            n++;
+            return true;
+        });
+        ASSERT(n == 1000);
+        n = 0;
+        for (auto it = snapshot->iterate(400); it.valid(); it.next()) {
+            ASSERT(it.key() == 400 + n && it.value() == "a" + std::to_string(it.key()));
+            n++;
+        }
+        ASSERT(n == 600);
+
+        // Compaction waits until the snapshot is gone.
+        KVStore::Stats stats = store.stats();
+        ASSERT(stats.snapshots == 1 && stats.snapshot_versions == 600);
+        store.compact();
+        ASSERT(store.stats().log_bytes == stats.log_bytes);
+        ASSERT(snapshot->get(7) == "a7");
+
+        // Snapshots at different points, closed out of order.
+        store.put(5000, "v1");
+        auto first = store.snapshot();
+        store.put(5000, "v2");
+        auto second = store.snapshot();
+        store.put(5000, "v3");
+        snapshot.reset();
+        ASSERT(first->get(5000) == "v1" && second->get(5000) == "v2" && store.get(5000) == "v3");
+        first.reset();
+        ASSERT(second->get(5000) == "v2");
+        ASSERT(store.stats().snapshot_versions == 1);
+        second.reset();
+        stats = store.stats();
+        ASSERT(stats.snapshots == 0 && stats.snapshot_versions == 0);
+        store.compact();
+        ASSERT(store.stats().log_bytes < stats.log_bytes);
+        ASSERT(store.get(7) == "b" && !store.get(550) && store.get(5000) == "v3");
+    }
+
+    // Under concurrent writes a snapshot sees whole batches, doesn't change, and sees
+    // every write that returned before it was taken.
+    remove_store_files(kTestFile);
+    options.keydir = KVStore::KeyDirType::kHashMap;
+    options.compaction_interval = std::chrono::milliseconds(5);
+    options.compaction_min_segments = 1;
+    {
+        KVStore store(kTestFile, options);
+        const KVStore::K kPairs = 50;
+        std::atomic<bool> stop{false};
+        std::atomic<int> last_put{0};
+        std::vector<std::thread> writers;
+        for (int t = 0; t < 4; t++) {
+            writers.emplace_back([&, t] {
+                for (int i = 0; !stop; i++) {
+                    KVStore::WriteBatch batch;
+                    KVStore::K key = (i * 4 + t) % kPairs;
+                    std::string value = std::to_string(t) + "-" + std::to_string(i);
+                    batch.put(key, value);
+                    batch.put(key + 1000, value);
+                    store.write(batch);
+                    if (t == 0) {
+                        store.putAsync(2000, std::to_string(i)).get();
+                        last_put = i;
+                    }
+                }
+            });
+        }
+        for (int round = 0; round < 20; round++) {
+            int returned = last_put;
+            auto snapshot = store.snapshot();
+            std::vector<std::optional<KVStore::V>> first;
+            for (KVStore::K key = 0; key < kPairs; key++) {
+                first.push_back(snapshot->get(key));
+                ASSERT(first.back() == snapshot->get(key + 1000));
+            }
+            auto seen = snapshot->get(2000);
+            ASSERT(!seen || std::stoi(*seen) >= returned);
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            for (KVStore::K key = 0; key < kPairs; key++) {
+                ASSERT(snapshot->get(key) == first[key]);
+            }
+            ASSERT(snapshot->get(2000) == seen);
+        }
+        stop = true;
+        for (auto& writer : writers) {
+            writer.join();
+        }
+        ASSERT(store.stats().snapshot_versions == 0);
+    }
+    remove_store_files(kTestFile);
+
+    // Two writers on one key whose records reach the keydir out of log order, with a
+    // snapshot taken between them: it still reads the earlier record. Each shard has
+    // its own async thread, and a putAsync whose callback blocks holds up the keydir
+    // updates queued behind it. Shard 0's snapshot opens first and shard 1's inside it,
+    // so a writer held in shard 1 keeps the snapshot from picking its position until
+    // the earlier record is durable in shard 0.
+    KVStore::Options sharded;
+    sharded.shards = 2;
+    sharded.async_threads = 2;
+    sharded.use_io_uring = false;
+    sharded.max_batch_wait = std::chrono::milliseconds(50);
+    sharded.compaction_interval = std::chrono::milliseconds(0);
+    auto shard_of = [](KVStore::K key) {  // same hash as the store's
+        return ((static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ull) >> 32) * 2 >> 32;
+    };
+    std::vector<KVStore::K> keys[2];
+    for (KVStore::K key = 0; keys[0].size() < 2 || keys[1].size() < 2; key++) {
+        keys[shard_of(key)].push_back(key);
+    }
+    {
+        KVStore store(kTestFile, sharded);
+        // A put whose callback keeps its shard's async thread busy until released.
+        struct Gate {
+            std::promise<void> entered;
+            std::promise<void> release;
+        };
+        // Puts value under key right behind a gate, and returns once the gate holds up
+        // the put's keydir update. A leader waiting out max_batch_wait syncs both in
+        // one round, so the put is durable by then.
+        auto put_behind_gate = [&store](KVStore::K gate_key, KVStore::K key, const std::string& value, Gate& gate) {
+            std::thread leader([&store, gate_key] { store.put(gate_key, "leader"); });
+            while (store.stats().unsynced_bytes == 0) {
+                std::this_thread::yield();
+            }
+            std::shared_future<void> released = gate.release.get_future().share();
+            store.putAsync(gate_key, "gate", [&gate, released](std::exception_ptr) {
+                gate.entered.set_value();
+                released.wait();
+            });
+            std::future<void> put = store.putAsync(key, value);
+            leader.join();
+            gate.entered.get_future().wait();
+            return put;
+        };
+
+        Gate gates[2];
+        auto held = put_behind_gate(keys[1][0], keys[1][1], "held", gates[0]);
+        std::unique_ptr<KVStore::Snapshot> snapshot;
+        std::thread opener([&] { snapshot = store.snapshot(); });
+        while (store.stats().snapshots == 0) {
+            std::this_thread::yield();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        const KVStore::K key = keys[0][1];
+        auto earlier = put_behind_gate(keys[0][0], key, "earlier", gates[1]);
+        // The snapshot picks its position once the held put is done, then waits for
+        // the earlier one, whose record is later overtaken in the keydir.
+        gates[0].release.set_value();
+        held.get();
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        store.put(key, "later");
+        gates[1].release.set_value();
+        earlier.get();
+        opener.join();
+        ASSERT(store.get(key) == "later");
+        ASSERT(snapshot->get(key) == "earlier");
+    }
+    remove_store_files(kTestFile);
+}
+
+void test_shards() {
+    remove_store_files(kTestFile);
+    KVStore::Options options;
+    options.compaction_interval = std::chrono::milliseconds(0);
+    options.segment_size = 16 << 10;
+    options.shards = 4;
+    {
+        KVStore store(kTestFile, options);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([&store, t] {
+                for (KVStore::K key = t; key < 2000; key += 4) {
+                    store.put(key, "v" + std::to_string(key));
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        for (KVStore::K key = 0; key < 2000; key += 3) {
+            store.remove(key);
+        }
+        // Every shard got some of the keys.
+        for (int i = 0; i < 4; i++) {
+            ASSERT(std::filesystem::file_size(kTestFile + ".shard" + std::to_string(i)) > 1000);
+        }
+        ASSERT(!std::filesystem::exists(kTestFile));
+        ASSERT(store.get(1) == "v1" && !store.get(3) && store.exists(1999) && !store.exists(1998));
+        auto values = store.multiGet({1, 3, 1999, 5000});
+        ASSERT(values[0] == "v1" && !values[1] && values[2] == "v1999" && !values[3]);
+        ASSERT(store.getAsync(1).get() == "v1");
+        store.putAsync(5000, "async").get();
+        store.removeAsync(1).get();
+        ASSERT(store.get(5000) == "async" && !store.get(1));
+
+        // Scans merge the shards in key order, across batches.
+        KVStore::K expected = 2;
+        size_t n = 0;
+        store.scan(0, 1999, [&](KVStore::K key, const KVStore::V& value) {
+            ASSERT(key == expected && value == "v" + std::to_string(key));
+            expected += expected % 3 == 2 ? 2 : 1;
+            n++;
+            return true;
+        });
+        ASSERT(n == 2000 - 667 - 1);
+        n = 0;
+        for (auto it = store.iterate(100, 199); it.valid(); it.next()) {
+            ASSERT(it.key() >= 100 && it.key() <= 199 && it.key() % 3 != 0);
+            n++;
+        }
+        ASSERT(n == 67);
+
+        // A batch spanning every shard, seen by a snapshot all or nothing.
+        auto before = store.snapshot();
+        KVStore::WriteBatch batch;
+        for (KVStore::K key = 0; key < 100; key++) {
+            batch.put(key, "batch");
+        }
+        batch.remove(2);
+        store.write(batch);
+        auto after = store.snapshot();
+        store.put(7, "later");
+        for (KVStore::K key = 3; key < 100; key++) {
+            ASSERT(before->get(key) != "batch");
+            ASSERT(after->get(key) == (key == 7 ? "batch" : store.get(key)));
+        }
+        ASSERT(!after->get(2) && before->get(2) == "v2");
+        n = 0;
+        after->scan(0, 99, [&](KVStore::K /*key*/, const KVStore::V& value) {
+            ASSERT(value == "batch");
+            n++;
+            return true;
+        });
+        ASSERT(n == 99);
+        before.reset();
+        after.reset();
+
+        KVStore::Stats stats = store.stats();
+        ASSERT(stats.puts == 2001 && stats.writes == 1 && stats.snapshots == 0);
+        ASSERT(stats.keys == 2001 && stats.segments >= 4);
+        store.compact();
+        ASSERT(store.get(7) == "later" && store.get(50) == "batch");
+    }
+
+    // Reopening restores every shard.
+    {
+        KVStore store(kTestFile, options);
+        ASSERT(store.get(7) == "later" && store.get(50) == "batch" && !store.get(2));
+        ASSERT(store.get(1999) == "v1999" && !store.get(1998) && store.get(5000) == "async");
+    }
+
+    // A batch the journal holds is finished on open, one with a torn entry is dropped.
+    auto record = [](uint32_t checksum_key, uint32_t length, const std::string& value) {
+        std::string fields(8, '\0');
+        memcpy(&fields[0], &checksum_key, 4);
+        memcpy(&fields[4], &length, 4);
+        fields += value;
+        uint32_t checksum = reference_crc32c(fields.data(), fields.size());
+        return std::string(reinterpret_cast<const char*>(&checksum), 4) + fields;
+    };
+    std::string records;
+    for (KVStore::K key = 0; key < 10; key++) {
+        records += record(key, 7, "journal");
+    }
+    records += record(50, ~0u, "");
+    std::string entry = record(records.size(), ~2u, records);
+    for (bool torn : {true, false}) {
+        {
+            std::ofstream out(kTestFile + ".journal", std::ios::binary);
+            out << entry.substr(0, torn ? entry.size() - 1 : entry.size());
+        }
+        KVStore store(kTestFile, options);
+        ASSERT(std::filesystem::file_size(kTestFile + ".journal") == 0);
+        ASSERT((store.get(0) == "journal") == !torn && (store.get(9) == "journal") == !torn);
+        ASSERT(!store.get(50) == !torn);
+    }
+
+    // The shard count is fixed once the store exists.
+    for (size_t shards : {1, 2}) {
+        options.shards = shards;
+        bool threw = false;
+        try {
+            KVStore store(kTestFile, options);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        ASSERT(threw);
+    }
+    remove_store_files(kTestFile);
+    {
+        KVStore store(kTestFile);
+        store.put(1, "unsharded");
+    }
+    options.shards = 4;
+    bool threw = false;
+    try {
+        KVStore store(kTestFile, options);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    ASSERT(threw);
+    remove_store_files(kTestFile);
+}
+
+void test_durability() {
+    remove_store_files(kTestFile);
+    KVStore::Options options;
+    options.compaction_interval = std::chrono::milliseconds(0);
+    options.durability = KVStore::Durability::kAsync;
+    options.flush_interval = std::chrono::milliseconds(3600 * 1000);
+    options.flush_bytes = 1 << 30;
+    {
+        KVStore store(kTestFile, options);
+        for (KVStore::K key = 0; key < 100; key++) {
+            store.put(key, "async" + std::to_string(key));
+        }
+        store.remove(5);
+        KVStore::WriteBatch batch;
+        batch.put(200, "batch");
+        store.write(batch);
+        // Visible right away, durable only once fenced.
+        ASSERT(store.get(7) == "async7" && !store.get(5) && store.get(200) == "batch");
+        KVStore::Stats stats = store.stats();
+        ASSERT(stats.unsynced_bytes > 100 * 12 && stats.unsynced_age.count() > 0);
+        ASSERT(stats.commits.records == 0);
+        store.waitDurable(store.logEnd());
+        stats = store.stats();
+        ASSERT(stats.unsynced_bytes == 0 && stats.unsynced_age.count() == 0);
+        ASSERT(stats.durable_lag.count == 1 && stats.commits.records == 102);
+
+        // A snapshot flushes first, so it has every write that returned.
+        store.put(300, "before snapshot");
+        auto snapshot = store.snapshot();
+        ASSERT(snapshot->get(300) == "before snapshot");
+        snapshot.reset();
+
+        // Per call, a durable write on an async store.
+        store.put(301, "sync", KVStore::Durability::kSync);
+        ASSERT(store.stats().unsynced_bytes == 0);
+        store.put(302, "unsynced");
+        store.flush();
+        ASSERT(store.stats().unsynced_bytes == 0);
+        // Closing flushes what is left.
+        store.put(303, "closing");
+    }
+    {
+        KVStore store(kTestFile, options);
+        ASSERT(store.get(99) == "async99" && !store.get(5) && store.get(200) == "batch");
+        ASSERT(store.get(302) == "unsynced" && store.get(303) == "closing");
+    }
+
+    // The flusher syncs on its own, by size and by time.
+    auto wait_synced = [](KVStore& store, uint64_t below) {
+        for (int i = 0; i < 2000 && store.stats().unsynced_bytes >= below; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return store.stats().unsynced_bytes < below;
+    };
+    options.flush_bytes = 1000;
+    {
+        KVStore store(kTestFile, options);
+        for (KVStore::K key = 0; key < 20; key++) {
+            store.put(key, std::string(100, 'x'));
+        }
+        ASSERT(wait_synced(store, 1000));
+        ASSERT(store.stats().commits.batches > 0);
+    }
+    options.flush_bytes = 1 << 30;
+    options.flush_interval = std::chrono::milliseconds(5);
+    {
+        KVStore store(kTestFile, options);
+        store.put(1, "timed");
+        ASSERT(wait_synced(store, 1));
+    }
+
+    // kSync doesn't wait out max_batch_wait for company, kGroupCommit does.
+    options.durability = KVStore::Durability::kGroupCommit;
+    options.max_batch_wait = std::chrono::milliseconds(300);
+    {
+        KVStore store(kTestFile, options);
+        auto start = std::chrono::steady_clock::now();
+        store.put(1, "sync", KVStore::Durability::kSync);
+        ASSERT(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(250));
+        start = std::chrono::steady_clock::now();
+        store.put(1, "group");
+        ASSERT(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(250));
+    }
+
+    // Sharded stores flush every shard.
+    remove_store_files(kTestFile);
+    options.max_batch_wait = std::chrono::microseconds(0);
+    options.durability = KVStore::Durability::kAsync;
+    options.flush_interval = std::chrono::milliseconds(3600 * 1000);
+    options.shards = 4;
+    {
+        KVStore store(kTestFile, options);
+        for (KVStore::K key = 0; key < 100; key++) {
+            store.put(key, "sharded");
+        }
+        ASSERT(store.stats().unsynced_bytes > 0);
+        store.flush();
+        ASSERT(store.stats().unsynced_bytes == 0);
+        bool threw = false;
+        try {
+            store.logEnd();
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        ASSERT(threw);
+    }
+    remove_store_files(kTestFile);
+}
+
+// Connects to the server on localhost:port.
+static int connect_to(uint16_t port) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT(fd != -1 && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    return fd;
+}
+
+// Reads exactly size bytes, or fewer if the server closes the connection.
+static std::string read_bytes(int fd, size_t size) {
+    std::string data;
+    char buf[4096];
+    while (data.size() < size) {
+        ssize_t n = recv(fd, buf, std::min(sizeof(buf), size - data.size()), 0);
+        if (n <= 0) {
+            break;
+        }
+        data.append(buf, n);
+    }
+    return data;
+}
+
+// Sends request and checks that the reply is exactly expected.
+static bool roundtrip(int fd, const std::string& request, const std::string& expected) {
+    ASSERT(send(fd, request.data(), request.size(), 0) == static_cast<ssize_t>(request.size()));
+    std::string reply = read_bytes(fd, expected.size());
+    if (reply != expected) {
+        std::cout << "unexpected reply: " << reply << std::endl;
+    }
+    return reply == expected;
+}
+
+void test_zero_alloc() {
+    remove_store_files(kTestFile);
+    KVStore::Options options;
+    options.compaction_interval = std::chrono::milliseconds(0);
+    KVStore store(kTestFile, options);
+    const std::string value(100, 'v');
+    for (KVStore::K key = 0; key < 1000; key++) {
+        store.put(key, value);
+    }
+    // Warm up the caller's buffer and whatever the store keeps around per thread.
+    std::string out;
+    ASSERT(store.get(1, out) && out == value);
+
+    count_allocations = true;
+    allocations = 0;
+    bool found = true;
+    for (KVStore::K i = 0; i < 10000; i++) {
+        store.put(i % 1000, value);
+        found = store.get(i % 1000, out) && found;
+    }
+    count_allocations = false;
+    ASSERT(found && out == value);
+    ASSERT(allocations == 0);
+    ASSERT(!store.get(5000, out));
+    remove_store_files(kTestFile);
+}
+
+void test_inline_values() {
+    remove_store_files(kTestFile);
+    KVStore::Options options;
+    options.compaction_interval = std::chrono::milliseconds(0);
+    options.segment_size = 16 << 10;
+    options.inline_value_bytes = 8;
+    // Odd keys get values short enough to go inline.
+    auto value_of = [](KVStore::K key) {
+        return key % 2 ? "v" + std::to_string(key) : std::string(20, 'a' + key % 26);
+    };
+    const KVStore::K num_keys = 1000;
+    {
+        KVStore store(kTestFile, options);
+        for (KVStore::K key = 0; key < num_keys; key++) {
+            store.put(key, value_of(key));
+        }
+        // Small values come straight out of the keydir, big ones still get read.
+        uint64_t file_reads = store.stats().file_reads;
+        ASSERT(store.stats().inline_values == num_keys / 2);
+        for (KVStore::K key = 0; key < num_keys; key++) {
+            ASSERT(store.get(key) == value_of(key));
+        }
+        ASSERT(store.stats().file_reads == file_reads + num_keys / 2);
+
+        // Values stay inline only for as long as they are small and live.
+        store.put(1, std::string(20, 'b'));
+        store.put(2, "small");
+        store.remove(3);
+        KVStore::WriteBatch batch;
+        batch.put(5, "batched");
+        batch.remove(7);
+        store.write(batch);
+        store.putAsync(9, "async").get();
+        ASSERT(store.stats().inline_values == num_keys / 2 - 2);
+        file_reads = store.stats().file_reads;
+        ASSERT(store.get(2) == "small" && store.get(5) == "batched" && store.get(9) == "async");
+        ASSERT(store.getAsync(11).get() == value_of(11));
+        ASSERT(store.multiGet({13, 15, 3})[1] == value_of(15));
+        ASSERT(!store.get(3) && !store.get(7));
+        ASSERT(store.stats().file_reads == file_reads);
+        ASSERT(store.get(1) == std::string(20, 'b'));
+
+        // A merge keeps the values with the entries it moves.
+        store.compact();
+        file_reads = store.stats().file_reads;
+        ASSERT(store.get(2) == "small" && store.get(15) == value_of(15));
+        ASSERT(store.stats().file_reads == file_reads);
+    }
+    for (int run = 0; run < 2; run++) {
+        // Scanned segments have their values at hand. Entries loaded from hint files
+        // get theirs on the first read.
+        KVStore store(kTestFile, options);
+        for (KVStore::K key = 11; key < num_keys; key++) {
+            ASSERT(store.get(key) == value_of(key));
+        }
+        uint64_t file_reads = store.stats().file_reads;
+        for (KVStore::K key = 11; key < num_keys; key += 2) {
+            ASSERT(store.get(key) == value_of(key));
+        }
+        ASSERT(store.stats().file_reads == file_reads);
+        ASSERT(store.get(2) == "small" && store.get(9) == "async" && !store.get(3));
+    }
+
+    options.keydir = KVStore::KeyDirType::kOpenAddressing;
+    {
+        // No room for values in a packed keydir, so it goes without.
+        KVStore store(kTestFile, options);
+        ASSERT(store.stats().inline_values == 0 && store.get(2) == "small");
+    }
+    options.inline_value_bytes = KVStore::kMaxInlineValue + 1;
+    bool threw = false;
+    try {
+        KVStore store(kTestFile, options);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    ASSERT(threw);
+    remove_store_files(kTestFile);
+}
+
+// A fixed-size value for test_traits.
+struct Reading {
+    uint32_t sensor;
+    float celsius;
+};
+using ReadingStore = BasicKVStore<FixedValueTraits<Reading, uint64_t>>;
+using WideKVStore = BasicKVStore<StringValueTraits<uint64_t>>;
+
+void test_traits() {
+    remove_store_files(kTestFile);
+    ReadingStore::Options options;
+    options.compaction_interval = std::chrono::milliseconds(0);
+    options.segment_size = 4 << 10;
+    options.inline_value_bytes = 8;
+    auto reading_of = [](uint64_t key) { return Reading{uint32_t(key), float(key % 100) / 4}; };
+    auto same = [](const std::optional<Reading>& a, const Reading& b) {
+        return a && a->sensor == b.sensor && a->celsius == b.celsius;
+    };
+    // Keys past 32 bits that would collide if they were cut down to 32.
+    const uint64_t base = uint64_t(1) << 40;
+    const uint64_t num_keys = 1000;
+    // Records of fixed-size values have no length field, tombstones included: each is
+    // a checksum, a key and a value's worth of bytes after the segment header.
+    {
+        ReadingStore store(kTestFile, options);
+        for (uint64_t key = base; key < base + 10; key++) {
+            store.put(key, reading_of(key));
+        }
+        store.remove(base);
+    }
+    ASSERT(std::filesystem::file_size(kTestFile) == 12 + 11 * (4 + 8 + sizeof(Reading)));
+    {
+        ReadingStore store(kTestFile, options);
+        ASSERT(!store.get(base) && same(store.get(base + 9), reading_of(base + 9)));
+    }
+    remove_store_files(kTestFile);
+    {
+        ReadingStore store(kTestFile, options);
+        for (uint64_t key = base; key < base + num_keys; key++) {
+            store.put(key, reading_of(key));
+        }
+        store.put(5, reading_of(5));
+        ReadingStore::WriteBatch batch;
+        batch.put(base + 1, reading_of(1));
+        batch.remove(base + 2);
+        store.write(batch);
+        store.putAsync(base + 3, reading_of(3)).get();
+        Reading reading;
+        ASSERT(store.get(5, reading) && reading.sensor == 5);
+        ASSERT(same(store.get(base + 1), reading_of(1)) && same(store.getAsync(base + 3).get(), reading_of(3)));
+        ASSERT(!store.get(base + 2) && !store.get(1) && same(store.get(base + 5), reading_of(base + 5)));
+        size_t scanned = 0;
+        store.scan(base + 4, base + num_keys, [&](uint64_t key, const Reading& value) {
+            scanned += value.sensor == uint32_t(key);
+            return true;
+        });
+        ASSERT(scanned == num_keys - 4);
+        store.compact();
+        ASSERT(same(store.get(base + 500), reading_of(base + 500)));
+    }
+    {
+        ReadingStore store(kTestFile, options);
+        for (uint64_t key = base + 4; key < base + num_keys; key++) {
+            ASSERT(same(store.get(key), reading_of(key)));
+        }
+        ASSERT(same(store.get(base + 1), reading_of(1)) && !store.get(base + 2) && same(store.get(5), reading_of(5)));
+    }
+    // A store with other traits refuses the log rather than misreading it.
+    bool threw = false;
+    try {
+        KVStore store(kTestFile);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    ASSERT(threw);
+    threw = false;
+    try {
+        WideKVStore store(kTestFile);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    ASSERT(threw);
+    remove_store_files(kTestFile);
+
+    {
+        WideKVStore store(kTestFile);
+        store.put(base + 7, "wide");
+        store.put(7, "narrow");
+    }
+    {
+        WideKVStore store(kTestFile);
+        ASSERT(store.get(base + 7) == "wide" && store.get(7) == "narrow");
+    }
+    // The paged keydir only covers 32-bit keys.
+    WideKVStore::Options paged;
+    paged.keydir = WideKVStore::KeyDirType::kPagedArray;
+    threw = false;
+    try {
+        WideKVStore store(kTestFile, paged);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    ASSERT(threw);
+    remove_store_files(kTestFile);
+
+    // A sharded store finishes the batch its journal holds after a crash. The entry
+    // is laid out like the log, with 64-bit key fields.
+    WideKVStore::Options sharded;
+    sharded.shards = 2;
+    {
+        WideKVStore store(kTestFile, sharded);
+        for (uint64_t key = base; key < base + 10; key++) {
+            store.put(key, "old");
+        }
+    }
+    auto record = [](uint64_t key, uint32_t length, const std::string& value) {
+        std::string fields(12, '\0');
+        memcpy(&fields[0], &key, 8);
+        memcpy(&fields[8], &length, 4);
+        fields += value;
+        uint32_t checksum = reference_crc32c(fields.data(), fields.size());
+        return std::string(reinterpret_cast<const char*>(&checksum), 4) + fields;
+    };
+    std::string records;
+    for (uint64_t key = base; key < base + 10; key++) {
+        records += record(key, 3, "new");
+    }
+    {
+        std::ofstream out(kTestFile + ".journal", std::ios::binary);
+        out << record(records.size(), ~2u, records);
+    }
+    {
+        WideKVStore store(kTestFile, sharded);
+        ASSERT(std::filesystem::file_size(kTestFile + ".journal") == 0);
+        for (uint64_t key = base; key < base + 10; key++) {
+            ASSERT(store.get(key) == "new");
+        }
+    }
+    remove_store_files(kTestFile);
+}
+
+void test_follower() {
+    remove_store_files(kTestFile);
+    KVStore::Options options;
+    options.compaction_interval = std::chrono::milliseconds(0);
+    options.segment_size = 4 << 10;
+    options.inline_value_bytes = 8;
+    // kAsync writes only become durable through flush().
+    options.flush_interval = std::chrono::hours(1);
+    options.flush_bytes = size_t(1) << 30;
+    KVStore::Options follower_options = options;
+    follower_options.follower = true;
+    follower_options.follow_interval = std::chrono::milliseconds(0);
+
+    bool threw = false;
+    try {
+        KVStore follower(kTestFile, follower_options);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    ASSERT(threw);
+    {
+        KVStore primary(kTestFile, options);
+        for (uint32_t key = 0; key < 200; key++) {
+            primary.put(key, "v" + std::to_string(key));
+        }
+        KVStore follower(kTestFile, follower_options);
+        ASSERT(follower.durableEnd() == primary.durableEnd());
+        ASSERT(follower.get(7) == std::string("v7") && follower.get(199) == std::string("v199"));
+
+        // Nothing reaches the follower before it is durable on the primary.
+        primary.put(7, "async", KVStore::Durability::kAsync);
+        follower.catchUp();
+        ASSERT(follower.get(7) == std::string("v7"));
+        primary.flush();
+        ASSERT(follower.catchUp() == primary.durableEnd());
+        ASSERT(follower.get(7) == std::string("async"));
+
+        auto snapshot = follower.snapshot();
+        KVStore::WriteBatch batch;
+        batch.put(300, "batch");
+        batch.remove(9);
+        primary.write(batch);
+        for (uint32_t key = 0; key < 200; key += 2) {
+            primary.put(key, "w" + std::to_string(key));
+        }
+        follower.catchUp();
+        ASSERT(follower.get(300) == std::string("batch") && !follower.get(9) && follower.get(10) == std::string("w10"));
+        ASSERT(snapshot->get(9) == std::string("v9") && !snapshot->get(300));
+        snapshot.reset();
+
+        // Once past a merge on the primary the follower moves over to the compacted
+        // segment and lets go of the ones it replaced.
+        primary.compact();
+        for (uint32_t key = 200; key < 400; key++) {
+            primary.put(key, "v" + std::to_string(key));
+        }
+        follower.catchUp();
+        ASSERT(follower.stats().segments == primary.stats().segments);
+        for (uint32_t key = 0; key < 400; key++) {
+            ASSERT(follower.get(key) == primary.get(key));
+        }
+
+        threw = false;
+        try {
+            follower.put(1, "x");
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        ASSERT(threw);
+        threw = false;
+        try {
+            follower.remove(1);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        ASSERT(threw && follower.catchUp() == primary.durableEnd());
+    }
+
+    // The primary in a process of its own, followed as it writes.
+    const uint32_t num_keys = 2000;
+    // Or the child would print what is buffered again.
+    std::cout << std::flush;
+    pid_t pid = fork();
+    if (pid == 0) {
+        int status = 0;
+        try {
+            KVStore primary(kTestFile, options);
+            for (uint32_t key = 0; key < num_keys; key++) {
+                primary.put(key, "p" + std::to_string(key));
+                if (key == num_keys / 2) {
+                    primary.compact();
+                }
+            }
+        } catch (const std::exception&) {
+            status = 1;
+        }
+        _exit(status);
+    }
+    ASSERT(pid > 0);
+    {
+        follower_options.follow_interval = std::chrono::milliseconds(1);
+        KVStore follower(kTestFile, follower_options);
+        const std::string last = "p" + std::to_string(num_keys - 1);
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+        while (follower.get(num_keys - 1) != last && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        for (uint32_t key = 0; key < num_keys; key++) {
+            ASSERT(follower.get(key) == "p" + std::to_string(key));
+        }
+        int status;
+        ASSERT(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        // It holds on to no more segments than the primary left behind.
+        follower.catchUp();
+        uint64_t segments = 0;
+        for (const auto& entry : std::filesystem::directory_iterator(".")) {
+            std::string name = entry.path().filename().string();
+            segments += name == kTestFile || (name.rfind(kTestFile + ".", 0) == 0 &&
+                                              isdigit(static_cast<unsigned char>(name.back())));
+        }
+        ASSERT(follower.stats().segments == segments);
+    }
+    remove_store_files(kTestFile);
+}
+
+// The newest regular segment of the store at path.
+static std::string active_segment(const std::string& path) {
+    uint32_t newest = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(".")) {
+        std::string name = entry.path().filename().string();
+        if (name.rfind(path + ".", 0) != 0) {
+            continue;
+        }
+        std::string suffix = name.substr(path.size() + 1);
+        if (!suffix.empty() && suffix.find_first_not_of("0123456789") == std::string::npos) {
+            newest = std::max<uint32_t>(newest, std::stoul(suffix));
+        }
+    }
+    return newest == 0 ? path : path + "." + std::to_string(newest);
+}
+
+void test_log_modes() {
+    KVStore::Options options;
+    options.compaction_interval = std::chrono::milliseconds(0);
+    options.segment_size = 64 << 10;
+    auto check = [](KVStore& store) {
+        for (KVStore::K key = 0; key < 1000; key++) {
+            ASSERT(key == 3 ? !store.get(key) : store.get(key) == "value" + std::to_string(key));
+        }
+        ASSERT(store.get(1000) == "batch" && store.get(1001) == "async");
+        for (KVStore::K key = 2000; key < 2200; key++) {
+            ASSERT(store.get(key) == std::string(1000, 'a' + key % 26));
+        }
+    };
+    auto leftovers = [] {
+        for (const auto& entry : std::filesystem::directory_iterator(".")) {
+            std::string name = entry.path().filename().string();
+            if (name.rfind(kTestFile + ".", 0) == 0 && name.size() > 4 &&
+                name.compare(name.size() - 4, 4, ".tmp") == 0) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    for (auto mode : {KVStore::LogMode::kPreallocated, KVStore::LogMode::kDirect}) {
+        remove_store_files(kTestFile);
+        options.log_mode = mode;
+        {
+            KVStore store(kTestFile, options);
+            ASSERT(std::filesystem::file_size(kTestFile) > options.segment_size);
+            for (KVStore::K key = 0; key < 1000; key++) {
+                store.put(key, "value" + std::to_string(key));
+            }
+            store.remove(3);
+            KVStore::WriteBatch batch;
+            batch.put(1000, "batch");
+            store.write(batch);
+            // Readable before it is synced, which for kDirect means out of staging.
+            store.put(1001, "async", KVStore::Durability::kAsync);
+            ASSERT(store.get(1001) == "async" && store.getAsync(1001).get() == "async");
+            store.putAsync(1002, "later").get();
+            ASSERT(store.getAsync(1002).get() == "later");
+            store.remove(1002);
+        }
+        {
+            // A clean close lets the next open append to the same segment.
+            KVStore store(kTestFile, options);
+            ASSERT(store.stats().segments == 1);
+            for (KVStore::K key = 2000; key < 2200; key++) {
+                store.put(key, std::string(1000, 'a' + key % 26));
+            }
+            ASSERT(store.stats().segments > 3);
+            check(store);
+        }
+        ASSERT(!leftovers());
+        uint64_t segments;
+        {
+            KVStore store(kTestFile, options);
+            check(store);
+            segments = store.stats().segments;
+        }
+
+        // Fake a crash: no end record, and a record past a gap that was never
+        // acknowledged. It must not come back, however the log grows over it.
+        std::string path = active_segment(kTestFile);
+        std::string data;
+        {
+            std::ifstream in(path, std::ios::binary);
+            data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+        auto record = [](uint32_t key, uint32_t length, const std::string& value) {
+            std::string fields(8, '\0');
+            memcpy(&fields[0], &key, 4);
+            memcpy(&fields[4], &length, 4);
+            fields += value;
+            uint32_t checksum = reference_crc32c(fields.data(), fields.size());
+            return std::string(reinterpret_cast<const char*>(&checksum), 4) + fields;
+        };
+        std::string end_record = record(0, ~3u, "");
+        size_t end = data.find(end_record);
+        ASSERT(end != std::string::npos);
+        std::string stray = record(7, 5, "stray");
+        data.replace(end, end_record.size(), end_record.size(), '\0');
+        data.replace(end + 64, stray.size(), stray);
+        {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            out << data;
+        }
+        {
+            KVStore store(kTestFile, options);
+            ASSERT(store.stats().segments == segments + 1);
+            ASSERT(store.get(7) == "value7");
+            for (KVStore::K key = 3000; key < 3100; key++) {
+                store.put(key, "after");
+            }
+        }
+        {
+            KVStore store(kTestFile, options);
+            check(store);
+            ASSERT(store.get(3099) == "after");
+        }
+
+        // Either way round, a store opens in the other mode.
+        options.log_mode = KVStore::LogMode::kGrowing;
+        {
+            KVStore store(kTestFile, options);
+            check(store);
+            store.put(4000, "growing");
+        }
+        options.log_mode = mode;
+        {
+            KVStore store(kTestFile, options);
+            check(store);
+            ASSERT(store.get(4000) == "growing" && store.get(3099) == "after");
+        }
+        ASSERT(!leftovers());
+    }
+    remove_store_files(kTestFile);
+}
+
+void test_server() {
+    remove_store_files(kTestFile);
+    KVStore store(kTestFile);
+    KVServer::Options options;
+    options.port = 0;
+    options.reactors = 2;
+    options.max_pipeline = 4;
+    KVServer server(store, options);
+    ASSERT(server.port() != 0);
+
+    int fd = connect_to(server.port());
+    // Pipelined, the replies come back in request order.
+    ASSERT(roundtrip(fd,
+                     "*3\r\n$3\r\nSET\r\n$1\r\n1\r\n$5\r\nhello\r\n"
+                     "*2\r\n$3\r\nGET\r\n$1\r\n1\r\n"
+                     "*2\r\n$3\r\nget\r\n$1\r\n2\r\n"
+                     "*3\r\n$4\r\nMGET\r\n$1\r\n1\r\n$1\r\n2\r\n"
+                     "*3\r\n$3\r\nDEL\r\n$1\r\n1\r\n$1\r\n2\r\n"
+                     "*2\r\n$3\r\nGET\r\n$1\r\n1\r\n",
+                     "+OK\r\n$5\r\nhello\r\n$-1\r\n*2\r\n$5\r\nhello\r\n$-1\r\n:1\r\n$-1\r\n"));
+    // A key named twice in one DEL counts once.
+    ASSERT(roundtrip(fd,
+                     "*3\r\n$3\r\nSET\r\n$1\r\n3\r\n$5\r\nthree\r\n"
+                     "*4\r\n$3\r\nDEL\r\n$1\r\n3\r\n$1\r\n3\r\n$1\r\n4\r\n"
+                     "*3\r\n$3\r\nDEL\r\n$1\r\n3\r\n$1\r\n3\r\n",
+                     "+OK\r\n:1\r\n:0\r\n"));
+    // Inline requests and a request split over two packets.
+    ASSERT(roundtrip(fd, "PING\r\nSET 7 seven\r\n", "+PONG\r\n+OK\r\n"));
+    ASSERT(send(fd, "*2\r\n$3\r\nGET", 11, 0) == 11);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    ASSERT(roundtrip(fd, "\r\n$1\r\n7\r\n", "$5\r\nseven\r\n"));
+    // Bad requests get an error and the connection stays usable.
+    ASSERT(roundtrip(fd, "GET x\r\n", "-ERR key is not a 32-bit unsigned integer\r\n"));
+    ASSERT(roundtrip(fd, "GET 99999999999\r\n", "-ERR key is not a 32-bit unsigned integer\r\n"));
+    ASSERT(roundtrip(fd, "GET\r\n", "-ERR wrong number of arguments for 'GET' command\r\n"));
+    ASSERT(roundtrip(fd, "FLUSHALL\r\n", "-ERR unknown command 'FLUSHALL'\r\n"));
+    ASSERT(roundtrip(fd, "SET 1 " + std::string(4097, 'x') + "\r\n", "-ERR value is larger than 4096 bytes\r\n"));
+    // Far more requests than max_pipeline in one go.
+    std::string requests;
+    std::string replies;
+    for (int i = 0; i < 500; i++) {
+        requests += "SET " + std::to_string(1000 + i) + " v" + std::to_string(i) + "\r\n";
+        replies += "+OK\r\n";
+    }
+    for (int i = 0; i < 500; i++) {
+        std::string value = "v" + std::to_string(i);
+        requests += "GET " + std::to_string(1000 + i) + "\r\n";
+        replies += "$" + std::to_string(value.size()) + "\r\n" + value + "\r\n";
+    }
+    ASSERT(roundtrip(fd, requests, replies));
+    ASSERT(roundtrip(fd, "QUIT\r\n", "+OK\r\n"));
+    ASSERT(read_bytes(fd, 1).empty());
+    close(fd);
+
+    // A malformed request closes the connection after the error.
+    fd = connect_to(server.port());
+    ASSERT(roundtrip(fd, "*1\r\n#3\r\n", "-ERR Protocol error\r\n"));
+    ASSERT(read_bytes(fd, 1).empty());
+    close(fd);
+
+    // Many connections writing at once.
+    std::vector<std::thread> clients;
+    std::atomic<int> failures{0};
+    for (int t = 0; t < 8; t++) {
+        clients.emplace_back([&, t] {
+            int client = connect_to(server.port());
+            for (int round = 0; round < 20; round++) {
+                std::string key = std::to_string(5000 + t * 100 + round);
+                failures += !roundtrip(client, "SET " + key + " x" + key + "\r\nGET " + key + "\r\n",
+                                       "+OK\r\n$" + std::to_string(key.size() + 1) + "\r\nx" + key + "\r\n");
+            }
+            close(client);
+        });
+    }
+    for (auto& client : clients) {
+        client.join();
+    }
+    ASSERT(failures == 0);
+    server.stop();
+    ASSERT(store.get(7) == "seven" && store.get(1499) == "v499" && !store.get(1) && store.get(5719) == "x5719");
+    remove_store_files(kTestFile);
+}
+
 int main() {
     try {
         TEST(test_in_memory_operations);
         TEST(test_persistence);
+        TEST(test_truncate_bad_tail);
+        TEST(test_failed_writes);
         TEST(test_concurrency);
+        TEST(test_group_commit);
+        TEST(test_mmap_reads);
+        TEST(test_segments_and_compaction);
+        TEST(test_hint_files);
+        TEST(test_parallel_recovery);
+        TEST(test_value_cache);
+        TEST(test_write_batch);
+        TEST(test_keydir_types);
+        TEST(test_checksums);
+        TEST(test_async_api);
+        TEST(test_stats);
+        TEST(test_scan);
+        TEST(test_snapshots);
+        TEST(test_shards);
+        TEST(test_durability);
+        TEST(test_zero_alloc);
+        TEST(test_inline_values);
+        TEST(test_traits);
+        TEST(test_follower);
+        TEST(test_log_modes);
+        TEST(test_server);
         
         std::cout << "All tests passed!" << std::endl;
         return 0;